@@ -0,0 +1,268 @@
+#define _GNU_SOURCE // getaddrinfo_a()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include "connect.h"
+
+#define NET_MAX_ADDRS 16   // addresses kept per host
+#define NET_CACHE 16       // hosts kept
+#define NET_MAX_HOST 256
+
+struct net_addrs {
+    struct sockaddr_storage addr[NET_MAX_ADDRS];
+    socklen_t len[NET_MAX_ADDRS];
+    int cnt;
+};
+
+struct net_cache_entry {
+    char host[NET_MAX_HOST];
+    char service[32];
+    time_t expires; // 0 for an unused entry
+    struct net_addrs addrs;
+};
+
+// A lookup we stopped waiting for. It keeps running and fills the cache when it lands.
+struct net_lookup {
+    struct gaicb cb;
+    struct addrinfo hints;
+    char host[NET_MAX_HOST];
+    char service[32];
+    struct net_lookup *next;
+};
+
+static struct net_cache_entry net_cache[NET_CACHE];
+static struct net_lookup *net_abandoned;
+static pthread_mutex_t net_mu = PTHREAD_MUTEX_INITIALIZER;
+
+static long long now_ms( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC,&ts );
+    return ts.tv_sec*1000LL + ts.tv_nsec/1000000;
+}
+
+// Copies the resolver's answer, interleaving address families (RFC 8305 section 4) so the
+// race alternates between IPv6 and IPv4 instead of exhausting one first.
+static void addrs_from( struct net_addrs *out,const struct addrinfo *res ) {
+    const struct addrinfo *fam[2][NET_MAX_ADDRS];
+    int n[2]= { 0,0 };
+    int first= res ? res->ai_family : AF_INET6; // the resolver's preferred family leads
+    for ( const struct addrinfo *rp=res; rp; rp=rp->ai_next ) {
+        int f= rp->ai_family==first ? 0 : 1;
+        if ( n[f]<NET_MAX_ADDRS && rp->ai_addrlen<=sizeof( struct sockaddr_storage ) ) {
+            fam[f][n[f]++]= rp;
+        }
+    }
+    out->cnt= 0;
+    for ( int i=0; out->cnt<NET_MAX_ADDRS && ( i<n[0] || i<n[1] ); i++ ) {
+        for ( int f=0; f<2; f++ ) {
+            if ( i<n[f] && out->cnt<NET_MAX_ADDRS ) {
+                memcpy( &out->addr[out->cnt],fam[f][i]->ai_addr,fam[f][i]->ai_addrlen );
+                out->len[out->cnt++]= fam[f][i]->ai_addrlen;
+            }
+        }
+    }
+}
+
+// Called with the lock held.
+static struct net_cache_entry *cache_find( const char *host,const char *service ) {
+    time_t now= time( NULL );
+    for ( int i=0; i<NET_CACHE; i++ ) {
+        struct net_cache_entry *e= &net_cache[i];
+        if ( e->expires>now && strcmp( e->host,host )==0 && strcmp( e->service,service )==0 ) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// Called with the lock held.
+static void cache_store( const char *host,const char *service,const struct addrinfo *res ) {
+    struct net_cache_entry *e= &net_cache[0];
+    for ( int i=1; i<NET_CACHE; i++ ) { // reuse the entry closest to expiring
+        if ( net_cache[i].expires<e->expires ) {
+            e= &net_cache[i];
+        }
+    }
+    snprintf( e->host,sizeof( e->host ),"%s",host );
+    snprintf( e->service,sizeof( e->service ),"%s",service );
+    addrs_from( &e->addrs,res );
+    e->expires= e->addrs.cnt>0 ? time( NULL )+NET_DNS_TTL : 0;
+}
+
+// Collects lookups that finished after their caller gave up. Called with the lock held.
+static void reap_abandoned( void ) {
+    for ( struct net_lookup **pp=&net_abandoned; *pp; ) {
+        struct net_lookup *l= *pp;
+        int rc= gai_error( &l->cb );
+        if ( rc==EAI_INPROGRESS ) {
+            pp= &l->next;
+            continue;
+        }
+        if ( rc==0 ) {
+            cache_store( l->host,l->service,l->cb.ar_result );
+            freeaddrinfo( l->cb.ar_result );
+        }
+        *pp= l->next;
+        free( l );
+    }
+}
+
+// Resolves host:service into out, from the cache when possible. Returns 0 or -1.
+static int resolve( const char *host,const char *service,struct net_addrs *out ) {
+    if ( strlen( host )>=NET_MAX_HOST || strlen( service )>=32 ) {
+        fprintf( stderr,"stream-talk-client: getaddrinfo: name too long\n" );
+        return -1;
+    }
+    pthread_mutex_lock( &net_mu );
+    reap_abandoned();
+    struct net_cache_entry *e= cache_find( host,service );
+    if ( e ) {
+        *out= e->addrs;
+    }
+    pthread_mutex_unlock( &net_mu );
+    if ( e ) {
+        return 0;
+    }
+
+    struct net_lookup *l= calloc( 1,sizeof( *l ) );
+    if ( !l ) {
+        return -1;
+    }
+    strcpy( l->host,host );
+    strcpy( l->service,service );
+    l->hints.ai_family= AF_UNSPEC;
+    l->hints.ai_socktype= SOCK_STREAM;
+    l->hints.ai_flags= AI_ADDRCONFIG;
+    l->cb.ar_name= l->host;
+    l->cb.ar_service= l->service;
+    l->cb.ar_request= &l->hints;
+    struct gaicb *list[1]= { &l->cb };
+    int rc= getaddrinfo_a( GAI_NOWAIT,list,1,NULL );
+    if ( rc==0 ) {
+        struct timespec ts= { NET_RESOLVE_TIMEOUT/1000,( NET_RESOLVE_TIMEOUT%1000 )*1000000L };
+        while ( gai_suspend( ( const struct gaicb * const * )list,1,&ts )==EAI_INTR ) {
+        }
+        rc= gai_error( &l->cb );
+    }
+    if ( rc==EAI_INPROGRESS ) {
+        if ( gai_cancel( &l->cb )!=EAI_CANCELED ) {
+            pthread_mutex_lock( &net_mu );
+            l->next= net_abandoned; // still running; it fills the cache for next time
+            net_abandoned= l;
+            pthread_mutex_unlock( &net_mu );
+            l= NULL;
+        }
+        fprintf( stderr,"stream-talk-client: getaddrinfo: %s timed out\n",host );
+        free( l );
+        return -1;
+    }
+    if ( rc!=0 ) {
+        fprintf( stderr,"stream-talk-client: getaddrinfo: %s\n",gai_strerror( rc ) );
+        free( l );
+        return -1;
+    }
+    pthread_mutex_lock( &net_mu );
+    cache_store( host,service,l->cb.ar_result );
+    pthread_mutex_unlock( &net_mu );
+    addrs_from( out,l->cb.ar_result );
+    freeaddrinfo( l->cb.ar_result );
+    free( l );
+    return 0;
+}
+
+// Starts a non-blocking connect. Returns the socket (with *done set if it connected at
+// once), or -1 if the attempt failed outright.
+static int attempt_start( const struct sockaddr_storage *addr,socklen_t len,bool *done ) {
+    int s= socket( addr->ss_family,SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,0 );
+    if ( s<0 ) {
+        return -1;
+    }
+    *done= connect( s,( const struct sockaddr * )addr,len )==0;
+    if ( !*done && errno!=EINPROGRESS ) {
+        int err= errno;
+        close( s );
+        errno= err;
+        return -1;
+    }
+    return s;
+}
+
+int lookup_and_connect( const char *host,const char *service ) {
+    struct net_addrs a;
+    if ( resolve( host,service,&a )<0 ) {
+        return -1;
+    }
+
+    struct pollfd racing[NET_MAX_ADDRS];
+    int nr= 0, next= 0, won= -1, err= ECONNREFUSED;
+    long long deadline= now_ms()+NET_CONNECT_TIMEOUT, next_at= 0;
+    while ( won<0 ) {
+        long long now= now_ms();
+        if ( next<a.cnt && ( now>=next_at || nr==0 ) ) {
+            bool done;
+            int s= attempt_start( &a.addr[next],a.len[next],&done );
+            next++;
+            if ( s<0 ) {
+                err= errno;
+                next_at= 0; // failed outright, move straight on
+                continue;
+            }
+            if ( done ) {
+                won= s;
+                break;
+            }
+            racing[nr++]= ( struct pollfd ){ .fd= s,.events= POLLOUT };
+            next_at= now+NET_ATTEMPT_DELAY;
+        }
+        if ( nr==0 && next>=a.cnt ) {
+            break; // every address failed
+        }
+        if ( now>=deadline ) {
+            err= ETIMEDOUT;
+            break;
+        }
+        long long until= next<a.cnt && next_at<deadline ? next_at : deadline;
+        int n= poll( racing,nr,until>now ? ( int )( until-now ) : 0 );
+        if ( n<0 && errno!=EINTR ) {
+            err= errno;
+            break;
+        }
+        for ( int i=0; n>0 && i<nr; i++ ) {
+            if ( !racing[i].revents ) {
+                continue;
+            }
+            int so_err= 0;
+            socklen_t sl= sizeof( so_err );
+            getsockopt( racing[i].fd,SOL_SOCKET,SO_ERROR,&so_err,&sl );
+            if ( so_err==0 ) {
+                won= racing[i].fd;
+                racing[i]= racing[--nr];
+                break;
+            }
+            err= so_err;
+            close( racing[i].fd );
+            racing[i--]= racing[--nr];
+            next_at= 0; // a slot opened up, start the next address now
+        }
+    }
+    for ( int i=0; i<nr; i++ ) {
+        close( racing[i].fd ); // the losers
+    }
+    if ( won<0 ) {
+        errno= err;
+        perror( "stream-talk-client: connect" );
+        return -1;
+    }
+    fcntl( won,F_SETFL,fcntl( won,F_GETFL ) & ~O_NONBLOCK ); // callers use blocking I/O
+    return won;
+}
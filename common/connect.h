@@ -0,0 +1,25 @@
+// Shared client connector for the programs in this repo.
+#ifndef CONNECT_H
+#define CONNECT_H
+
+#define NET_DNS_TTL 60            // seconds a resolved host stays cached
+#define NET_RESOLVE_TIMEOUT 5000  // ms to wait for the resolver
+#define NET_CONNECT_TIMEOUT 10000 // ms for the whole connect race
+#define NET_ATTEMPT_DELAY 250     // ms before the next address joins the race (RFC 8305)
+
+/*
+ * Lookup a host IP address and connect to it using service. Arguments match the first two
+ * arguments to getaddrinfo(3).
+ *
+ * The lookup runs asynchronously under a timeout and its answer is cached for NET_DNS_TTL.
+ * Addresses are then raced Happy Eyeballs style: a new non-blocking connect starts every
+ * NET_ATTEMPT_DELAY ms (or as soon as one fails), alternating IPv6 and IPv4, and the first
+ * to complete wins. A dead address therefore costs at most the attempt delay, not a full
+ * TCP timeout.
+ *
+ * Returns a connected, blocking socket descriptor or -1 on error. Caller is responsible for
+ * closing the returned socket.
+ */
+int lookup_and_connect( const char *host, const char *service );
+
+#endif
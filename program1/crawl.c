@@ -0,0 +1,414 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include "connect.h"
+#include "crawl.h"
+#include "http.h"
+#include "scan.h"
+#include "soc.h"
+
+struct crawl_host {
+	char name[256];
+	char port[16];
+	int active;             // workers holding a connection to it
+	int *jobs;              // its jobs in list order; jobs[next] is the first not taken
+	int job_cnt, job_cap;
+	int next;
+};
+
+struct crawl_job {
+	char *url;
+	const char *path;       // within url
+	int host;               // index into crawl.hosts
+	bool taken;
+	bool retried;           // already resent once after losing a connection
+	double sent;
+	// results
+	const char *err;
+	int status;
+	unsigned long long bytes;      // body, after framing is removed
+	unsigned long long wire_bytes; // status line, headers and framing too
+	uint64_t count[SCAN_MAX_PATTERNS];
+	double ms;
+};
+
+// A worker's connection, with whatever it has received but not yet parsed.
+struct crawl_conn {
+	int s;
+	int host;
+	char *buf;
+	size_t off, have;
+};
+
+struct crawl {
+	const struct crawl_opts *opts;
+	struct crawl_job *jobs;
+	int job_cnt;
+	struct crawl_host *hosts;
+	int host_cnt;
+	int next;               // no job before this one is still waiting
+	int failed;
+	pthread_mutex_t mu;
+	pthread_cond_t cv;      // signalled when a host slot frees up
+};
+
+static double now_ms( void ) {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void scan_body( void *arg, const char *data, size_t len ) {
+	scan_feed( arg, data, len );
+}
+
+// Pipelines the requests for jobs[0..n) on c.
+static int send_requests( struct crawl *cr, struct crawl_conn *c, struct crawl_job **jobs, int n ) {
+	static const char fmt[] = "GET %s HTTP/1.1\r\nHost: %s\r\nAccept-Encoding: gzip, deflate\r\n\r\n";
+	const char *host = cr->hosts[c->host].name;
+	size_t cap = 1;
+	for ( int i = 0; i < n; i++ ) {
+		cap += strlen( jobs[i]->path ) + strlen( host ) + sizeof( fmt );
+	}
+	char *req = malloc( cap );
+	if ( !req ) {
+		return -1;
+	}
+	int len = 0;
+	double now = now_ms();
+	for ( int i = 0; i < n; i++ ) {
+		len += sprintf( req + len, fmt, jobs[i]->path, host );
+		jobs[i]->sent = now;
+	}
+	int rc = send_data_to_soc( c->s, req, &len );
+	free( req );
+	return rc;
+}
+
+// Reads the next response on c into job, scanning the body as it arrives. Returns 1 if
+// the connection stays open, 0 if the server closes it after this response, -1 if it was
+// lost before the response was complete, -2 if the response was malformed.
+static int read_response( struct crawl *cr, struct crawl_conn *c, struct crawl_job *job ) {
+	const struct crawl_opts *o = cr->opts;
+	struct scan sc;
+	struct http_resp r;
+
+	scan_init( &sc, o->tags, o->tag_cnt ); // the tags were validated before the crawl began
+	http_resp_init( &r, scan_body, &sc );
+	while ( !http_resp_done( &r ) ) {
+		if ( c->off == c->have ) {
+			ssize_t got = recv( c->s, c->buf, o->chunk_size, 0 );
+			if ( got <= 0 ) {
+				if ( got == 0 && http_resp_eof( &r ) == 0 ) {
+					break;
+				}
+				http_resp_end( &r );
+				return -1;
+			}
+			c->off = 0;
+			c->have = got;
+			// ACK at once: a server that leaves Nagle on otherwise holds the tail of each
+			// response for our delayed ACK, which costs ~40 ms per request on a kept-alive
+			// connection
+			int one = 1;
+			setsockopt( c->s, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof( one ) );
+		}
+		long used = http_resp_feed( &r, c->buf + c->off, c->have - c->off );
+		if ( used < 0 ) {
+			return -2;
+		}
+		c->off += used;
+	}
+	job->status = r.status;
+	job->bytes = r.body_bytes;
+	job->wire_bytes = r.wire_bytes;
+	memcpy( job->count, sc.count, sizeof( job->count ) );
+	job->ms = now_ms() - job->sent;
+	return r.keep_alive;
+}
+
+static void conn_close( struct crawl_conn *c ) {
+	if ( c->s >= 0 ) {
+		close( c->s );
+		c->s = -1;
+	}
+	c->off = c->have = 0;
+}
+
+// Fetches jobs[0..n), all for c->host, pipelining the requests on c's connection and
+// opening a new one whenever it is closed. A keep-alive connection may be closed by the
+// server at any time, so a request that loses its connection is resent once.
+static void fetch_batch( struct crawl *cr, struct crawl_conn *c, struct crawl_job **jobs, int n ) {
+	struct crawl_host *h = &cr->hosts[c->host];
+	int i = 0; // first job still waiting for its response
+	while ( i < n ) {
+		if ( c->s < 0 ) {
+			double start = now_ms();
+			if ( ( c->s = lookup_and_connect( h->name, h->port ) ) < 0 ) {
+				for ( ; i < n; i++ ) {
+					jobs[i]->err = "connect failed";
+					jobs[i]->ms = now_ms() - start;
+				}
+				return;
+			}
+		}
+		int rc = send_requests( cr, c, jobs + i, n - i ) < 0 ? -1 : 1;
+		while ( i < n && rc > 0 ) {
+			if ( ( rc = read_response( cr, c, jobs[i] ) ) >= 0 ) {
+				i++;
+			}
+		}
+		if ( rc == -2 ) {
+			jobs[i++]->err = "malformed response";
+		} else if ( rc == -1 && jobs[i]->retried ) {
+			jobs[i++]->err = "connection lost";
+		} else if ( rc == -1 ) {
+			jobs[i]->retried = true;
+		}
+		if ( rc <= 0 ) {
+			conn_close( c );
+		}
+	}
+	if ( c->off < c->have ) { // bytes nobody asked for: the connection is out of step
+		conn_close( c );
+	}
+}
+
+// Takes up to max of h's jobs, in list order, into batch.
+static int take( struct crawl *cr, struct crawl_host *h, struct crawl_job **batch, int max ) {
+	int n = 0;
+	while ( n < max && h->next < h->job_cnt ) {
+		struct crawl_job *job = &cr->jobs[h->jobs[h->next++]];
+		job->taken = true;
+		batch[n++] = job;
+	}
+	return n;
+}
+
+// Claims the next batch for a worker whose connection is to *host (-1 if none). More
+// jobs for that host come first, so the connection is reused; otherwise its slot is
+// given up and the batch starts at the earliest waiting job whose host has a free slot,
+// waiting for one to open up if need be. Returns 0 once every job has been claimed.
+// Called with cr->mu held.
+static int claim( struct crawl *cr, int *host, struct crawl_job **batch ) {
+	int max = cr->opts->pipeline;
+	while ( true ) {
+		if ( *host >= 0 ) {
+			struct crawl_host *h = &cr->hosts[*host];
+			if ( h->next < h->job_cnt ) {
+				return take( cr, h, batch, max );
+			}
+			h->active--;
+			*host = -1;
+			pthread_cond_broadcast( &cr->cv );
+		}
+		while ( cr->next < cr->job_cnt && cr->jobs[cr->next].taken ) {
+			cr->next++;
+		}
+		if ( cr->next == cr->job_cnt ) {
+			return 0;
+		}
+		for ( int i = cr->next; i < cr->job_cnt; i++ ) {
+			struct crawl_job *job = &cr->jobs[i];
+			struct crawl_host *h = &cr->hosts[job->host];
+			if ( !job->taken && h->active < cr->opts->per_host ) {
+				h->active++;
+				*host = job->host;
+				return take( cr, h, batch, max );
+			}
+		}
+		pthread_cond_wait( &cr->cv, &cr->mu );
+	}
+}
+
+static void report( const struct crawl *cr, const struct crawl_job *job ) {
+	const struct crawl_opts *o = cr->opts;
+	if ( job->err ) {
+		printf( "%s: error: %s (%.1f ms)\n", job->url, job->err, job->ms );
+		return;
+	}
+	printf( "%s: %d,", job->url, job->status );
+	for ( int k = 0; k < o->tag_cnt; k++ ) {
+		printf( " %llu %s,", ( unsigned long long )job->count[k], o->tags[k] );
+	}
+	printf( " %llu bytes (%llu on the wire), %.1f ms\n", job->bytes, job->wire_bytes, job->ms );
+}
+
+static void *worker( void *arg ) {
+	struct crawl *cr = arg;
+	struct crawl_conn c = { .s = -1, .host = -1, .buf = malloc( cr->opts->chunk_size ) };
+	struct crawl_job **batch = malloc( cr->opts->pipeline * sizeof( *batch ) );
+	if ( !c.buf || !batch ) {
+		perror( "malloc" );
+		free( c.buf );
+		free( batch );
+		return NULL;
+	}
+	pthread_mutex_lock( &cr->mu );
+	int n;
+	while ( ( n = claim( cr, &c.host, batch ) ) > 0 ) {
+		pthread_mutex_unlock( &cr->mu );
+		fetch_batch( cr, &c, batch, n );
+		pthread_mutex_lock( &cr->mu );
+		for ( int i = 0; i < n; i++ ) {
+			cr->failed += batch[i]->err != NULL;
+			report( cr, batch[i] );
+		}
+		if ( cr->hosts[c.host].next == cr->hosts[c.host].job_cnt ) {
+			conn_close( &c ); // nothing left for this host; claim() frees the slot
+		}
+	}
+	pthread_mutex_unlock( &cr->mu );
+	conn_close( &c );
+	free( c.buf );
+	free( batch );
+	return NULL;
+}
+
+// Index of host:port in cr->hosts, adding it if new.
+static int host_index( struct crawl *cr, const char *host, const char *port, int *cap ) {
+	for ( int i = 0; i < cr->host_cnt; i++ ) {
+		if ( strcmp( cr->hosts[i].name, host ) == 0 && strcmp( cr->hosts[i].port, port ) == 0 ) {
+			return i;
+		}
+	}
+	if ( cr->host_cnt == *cap ) {
+		int ncap = *cap ? *cap * 2 : 16;
+		struct crawl_host *nh = realloc( cr->hosts, ncap * sizeof( *nh ) );
+		if ( !nh ) {
+			return -1;
+		}
+		cr->hosts = nh;
+		*cap = ncap;
+	}
+	struct crawl_host *h = &cr->hosts[cr->host_cnt];
+	memset( h, 0, sizeof( *h ) );
+	strcpy( h->name, host );
+	strcpy( h->port, port );
+	return cr->host_cnt++;
+}
+
+// Reads the URL list into cr->jobs. Malformed URLs become jobs that have already failed,
+// so they still show up in the report.
+static int load( struct crawl *cr, FILE *list ) {
+	char line[4096];
+	int job_cap = 0, host_cap = 0;
+	while ( fgets( line, sizeof( line ), list ) ) {
+		line[strcspn( line, "\r\n" )] = '\0';
+		char *url = line + strspn( line, " \t" );
+		if ( *url == '\0' || *url == '#' ) {
+			continue;
+		}
+		if ( cr->job_cnt == job_cap ) {
+			job_cap = job_cap ? job_cap * 2 : 64;
+			struct crawl_job *nj = realloc( cr->jobs, job_cap * sizeof( *nj ) );
+			if ( !nj ) {
+				return -1;
+			}
+			cr->jobs = nj;
+		}
+		struct crawl_job *job = &cr->jobs[cr->job_cnt];
+		memset( job, 0, sizeof( *job ) );
+		job->url = strdup( url );
+		if ( !job->url ) {
+			return -1;
+		}
+		char host[256], port[16];
+		if ( http_parse_url( job->url, host, sizeof( host ), port, sizeof( port ), &job->path ) < 0 ) {
+			job->err = "unsupported URL";
+			job->taken = true;
+			job->host = -1;
+		} else if ( ( job->host = host_index( cr, host, port, &host_cap ) ) < 0 ) {
+			return -1;
+		} else {
+			struct crawl_host *h = &cr->hosts[job->host];
+			if ( h->job_cnt == h->job_cap ) {
+				h->job_cap = h->job_cap ? h->job_cap * 2 : 16;
+				int *nj = realloc( h->jobs, h->job_cap * sizeof( *nj ) );
+				if ( !nj ) {
+					return -1;
+				}
+				h->jobs = nj;
+			}
+			h->jobs[h->job_cnt++] = cr->job_cnt;
+		}
+		cr->job_cnt++;
+	}
+	return 0;
+}
+
+int crawl_run( FILE *list, const struct crawl_opts *opts ) {
+	struct crawl cr = { .opts = opts };
+	if ( load( &cr, list ) < 0 ) {
+		perror( "Reading the URL list failed" );
+		return -1;
+	}
+	pthread_mutex_init( &cr.mu, NULL );
+	pthread_cond_init( &cr.cv, NULL );
+	signal( SIGPIPE, SIG_IGN ); // a server closing a keep-alive connection must not kill us
+	for ( int i = 0; i < cr.job_cnt; i++ ) {
+		if ( cr.jobs[i].host < 0 ) {
+			report( &cr, &cr.jobs[i] );
+			cr.failed++;
+		}
+	}
+
+	int nthreads = opts->concurrency < cr.job_cnt ? opts->concurrency : cr.job_cnt;
+	pthread_t *threads = malloc( ( nthreads + 1 ) * sizeof( *threads ) );
+	double start = now_ms();
+	int started = 0;
+	while ( threads && started < nthreads && pthread_create( &threads[started], NULL, worker, &cr ) == 0 ) {
+		started++;
+	}
+	if ( started == 0 && nthreads > 0 ) {
+		perror( "Starting crawl workers failed" );
+		return -1;
+	}
+	for ( int i = 0; i < started; i++ ) {
+		pthread_join( threads[i], NULL );
+	}
+	double secs = ( now_ms() - start ) / 1e3;
+
+	// Aggregate over the pages that were fetched
+	unsigned long long bytes = 0, wire_bytes = 0;
+	uint64_t count[SCAN_MAX_PATTERNS] = { 0 };
+	for ( int i = 0; i < cr.job_cnt; i++ ) {
+		if ( cr.jobs[i].err ) {
+			continue;
+		}
+		bytes += cr.jobs[i].bytes;
+		wire_bytes += cr.jobs[i].wire_bytes;
+		for ( int k = 0; k < opts->tag_cnt; k++ ) {
+			count[k] += cr.jobs[i].count[k];
+		}
+	}
+	printf( "Pages: %d fetched, %d failed, in %.2f s (%.1f pages/s, %d workers, %d per host, %d pipelined)\n",
+		cr.job_cnt - cr.failed, cr.failed, secs, secs > 0 ? ( cr.job_cnt - cr.failed ) / secs : 0.0, started, opts->per_host, opts->pipeline );
+	for ( int k = 0; k < opts->tag_cnt; k++ ) {
+		printf( "Number of %s tags: %llu\n", opts->tags[k], ( unsigned long long )count[k] );
+	}
+	printf( "Number of bytes: %llu\n", bytes );
+	printf( "Number of bytes on the wire: %llu\n", wire_bytes );
+
+	for ( int i = 0; i < cr.job_cnt; i++ ) {
+		free( cr.jobs[i].url );
+	}
+	for ( int i = 0; i < cr.host_cnt; i++ ) {
+		free( cr.hosts[i].jobs );
+	}
+	free( cr.jobs );
+	free( cr.hosts );
+	free( threads );
+	pthread_mutex_destroy( &cr.mu );
+	pthread_cond_destroy( &cr.cv );
+	return cr.failed;
+}
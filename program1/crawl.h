@@ -0,0 +1,28 @@
+// Crawl mode for h1-counter: fetch a list of URLs on a pool of worker threads and count
+// tags in each page as it is received. Each worker keeps its HTTP/1.1 connection to a host
+// open and pipelines several requests on it.
+#ifndef CRAWL_H
+#define CRAWL_H
+
+#include <stdio.h>
+
+#define CRAWL_CONCURRENCY 16 // default worker threads, i.e. connections open
+#define CRAWL_PER_HOST 4     // default connections open to any one host:port
+#define CRAWL_PIPELINE 8     // default requests in flight on one connection
+
+struct crawl_opts {
+	int concurrency;
+	int per_host;
+	int pipeline;
+	int chunk_size;         // most bytes taken per recv(), as in single-page mode
+	const char *const *tags;
+	int tag_cnt;
+};
+
+// Reads one URL per line from list (http://host[:port]/path, or host[/path]; blank lines
+// and lines starting with # are skipped) and fetches them concurrently. Prints a line per
+// URL as it finishes and a summary at the end. Returns the number of failed URLs, or -1
+// if the crawl could not start.
+int crawl_run( FILE *list, const struct crawl_opts *opts );
+
+#endif
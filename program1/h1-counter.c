@@ -7,42 +7,100 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
-
-
-/*
- * Lookup a host IP address and connect to it using service. Arguments match the first two
- * arguments to getaddrinfo(3).
- *
- * Returns a connected socket descriptor or -1 on error. Caller is responsible for closing
- * the returned socket.
- */
-int lookup_and_connect( const char *host, const char *service );
-
-int send_data_to_soc( int s, const char *buf, int *len );
-
-int recv_data_from_soc( int s, char *buf, int *len );
+#include "connect.h"
+#include "crawl.h"
+#include "http.h"
+#include "scan.h"
+#include "soc.h"
+
+static void scan_body( void *arg, const char *data, size_t len ) {
+	scan_feed( arg, data, len );
+}
 
 
 int main( int argc, char *argv[] ) {
-	const char *http_request = "GET /~kkredo/file.html HTTP/1.0\r\n\r\n";
-    const char *host = "www.ecst.csuchico.edu";
-    const char *port = "80";
+	const char *url = "http://www.ecst.csuchico.edu/~kkredo/file.html";
+	char http_request[HTTP_MAX_LINE];
+	char host[256];
+	char port[16];
+	const char *path;
 
 	int chunk_size;
-	int h1_tags_count = 0;
-	int total_bytes = 0;
+	struct http_resp resp;
+	const char *default_tags[] = { "<h1>" };
+	const char *const *tags = default_tags;
+	int tag_cnt = 1;
+	struct scan sc;
 	char *bufs = NULL;
 	int s;
 	int len;
+	const char *url_list = NULL;
+	struct crawl_opts crawl = { .concurrency = CRAWL_CONCURRENCY, .per_host = CRAWL_PER_HOST, .pipeline = CRAWL_PIPELINE };
+	const char *prog = argv[0];
+	int opt;
+
+	while ((opt = getopt(argc, argv, "U:u:c:H:P:")) != -1) {
+		switch (opt) {
+		case 'U':
+			url = optarg;
+			break;
+		case 'u':
+			url_list = optarg;
+			break;
+		case 'c':
+			crawl.concurrency = atoi(optarg);
+			break;
+		case 'H':
+			crawl.per_host = atoi(optarg);
+			break;
+		case 'P':
+			crawl.pipeline = atoi(optarg);
+			break;
+		default:
+			optind = argc; // fall through to the usage message
+			break;
+		}
+	}
+	argc -= optind - 1; // the positional arguments now start at argv[1]
+	argv += optind - 1;
 
-
-
-
-	if (argc != 2) { // we're checking to make sure we get the correct amount of arguments
-		perror("Incorrect number of arguments given");
+	if (argc < 2 || crawl.concurrency < 1 || crawl.per_host < 1 || crawl.pipeline < 1) { // we need a chunk size, optionally followed by the tags to count
+		fprintf(stderr, "Usage: %s [-U url | -u url file|- [-c workers] [-H per host] [-P pipeline depth]] <chunk size> [tag ...]\n", prog);
         exit(1);
     }
+	if (argc > 2) {
+		tags = (const char *const *)argv + 2;
+		tag_cnt = argc - 2;
+	}
+	if (scan_init(&sc, tags, tag_cnt) < 0) {
+		fprintf(stderr, "At most %d tags of 1 to %d bytes each\n", SCAN_MAX_PATTERNS, SCAN_MAX_LEN);
+		exit(1);
+	}
+
+	if (url_list) { // crawl mode: fetch every URL in the list on a pool of workers
+		FILE *list = strcmp(url_list, "-") == 0 ? stdin : fopen(url_list, "r");
+		if (!list) {
+			perror(url_list);
+			exit(1);
+		}
+		crawl.chunk_size = atoi(argv[1]);
+		crawl.tags = tags;
+		crawl.tag_cnt = tag_cnt;
+		if (crawl.chunk_size < 1) {
+			fprintf(stderr, "chunk size must be at least 1\n");
+			exit(1);
+		}
+		return crawl_run(list, &crawl) == 0 ? 0 : 1;
+	}
+
+	// Single-page mode: the course page unless -U names another, e.g. a local stand-in
+	if (http_parse_url(url, host, sizeof(host), port, sizeof(port), &path) < 0 ||
+	    snprintf(http_request, sizeof(http_request), "GET %s HTTP/1.1\r\nHost: %s\r\nAccept-Encoding: gzip, deflate\r\nConnection: close\r\n\r\n", path, host) >= (int)sizeof(http_request)) {
+		fprintf(stderr, "Unsupported URL: %s\n", url);
+		exit(1);
+	}
 
 	/* Lookup IP and connect to server */
 	if ( ( s = lookup_and_connect( host, port ) ) < 0 ) {
@@ -53,9 +111,10 @@ int main( int argc, char *argv[] ) {
 	// We need to grab the size of the chunk_size that the user enters to make sure  its valid
 	chunk_size = atoi( argv[1] );
 
-	// Checking to make sure the user enter a valid chunk size between 1 and 1000
-	if ( chunk_size > 1000 || chunk_size < 1) {
-		perror("chucnk size must be between 1 and 1000");
+	// Checking to make sure the user entered a usable chunk size; the scanner carries
+	// partial tags between chunks, so any size works
+	if ( chunk_size < 1) {
+		fprintf(stderr, "chunk size must be at least 1\n");
 		exit ( 1 );
 	}
 
@@ -70,7 +129,7 @@ int main( int argc, char *argv[] ) {
         return -1;
     }
 
-	bufs = malloc(chunk_size + 1); // +1 to account for the null terminator
+	bufs = malloc(chunk_size);
     if (!bufs) {
         perror("malloc");
 		perror("Memory allocation for bufs failed");
@@ -79,106 +138,46 @@ int main( int argc, char *argv[] ) {
     }
 
 
-	while (1) {                   
-        int byte_from_request = chunk_size; //we want the chunk_size bytes for every request
-        int result = recv_data_from_soc(s, bufs, &byte_from_request); //here we want to read that many bytes that came in
+	http_resp_init(&resp, scan_body, &sc); // only the body is scanned and counted
+	int rc = 0;
+	while (!http_resp_done(&resp)) { // a server may keep the connection open past the response
+        // up to chunk_size bytes per read; waiting for a full chunk could outlast the response
+        ssize_t byte_from_request = recv(s, bufs, chunk_size, 0);
 
-        if (result < 0) {
-            perror("recvAll");
+        if (byte_from_request < 0 && errno == EINTR) {
+            continue;
+        }
+        if (byte_from_request < 0) {
+            perror("recv");
+            http_resp_end(&resp);
+            rc = 1;
             break;
         }
         if (byte_from_request == 0) { // when there's no more data
+            if (http_resp_eof(&resp) < 0) {
+                fprintf(stderr, "Response cut short\n");
+                rc = 1;
+            }
             break;
         }
 
-        bufs[byte_from_request] = '\0';  // so we won't read past the data
-        total_bytes += byte_from_request;
-        char *h1_tag_search = bufs; //where we search for h1 tags in the new 'chunk_size' chunk of data 
-        while ((h1_tag_search = strstr(h1_tag_search, "<h1>")) != NULL) {
-            h1_tags_count++;
-            h1_tag_search += 4; 
+        // tags split across chunks are still counted
+        if (http_resp_feed(&resp, bufs, byte_from_request) < 0) {
+            fprintf(stderr, "Malformed HTTP response\n");
+            http_resp_end(&resp);
+            rc = 1;
+            break;
         }
     }
 
 	// After the while loop grabs all the data we'll print below
-	printf("Number of <h1> tags: %d\n", h1_tags_count);
-	printf("Number of bytes: %d\n", total_bytes);
+	for (int k = 0; k < tag_cnt; k++) {
+		printf("Number of %s tags: %llu\n", tags[k], (unsigned long long)sc.count[k]);
+	}
+	printf("Number of bytes: %llu\n", resp.body_bytes); // decoded, if the server compressed it
+	printf("Number of bytes on the wire: %llu\n", resp.wire_bytes);
 
 	close( s );
-	return 0;
-}
-
-
-int send_data_to_soc(int s, const char *buf, int *len) {
-    int total = 0;        // how many bytes we've sent
-    int bytesleft = *len; // how many we have left to send
-    int n;
-    while(total < *len) {
-        n = send(s, buf+total, bytesleft, 0);
-        if (n == -1) { 
-			break; 
-		}
-        total += n;
-        bytesleft -= n;
-    }
-    *len = total; // return number actually sent here
-    return (n == -1) ? -1 : 0; // here we'll return -1 if failure, 0 if good
+	return rc; // the counts above are partial if the response was not read to its end
 }
 
-int recv_data_from_soc(int s, char *buf, int *len) {
-    int total=0;
-    int bytesleft = *len;
-    int n;
-
-    while(total < *len){
-        n = recv(s, buf + total, bytesleft,0);
-        if (n <= 0) { 
-			break; 
-		}
-        total += n;
-        bytesleft -= n;
-    }
-    *len = total; // return number actually sent here
-    return (n < 0) ? -1 : 0; // return -1 on failure, 0 on success
-}
-
-
-// we shouldn't need to change any of  this 
-int lookup_and_connect( const char *host, const char *service ) {
-	struct addrinfo hints;
-	struct addrinfo *rp, *result;
-	int s;
-
-	/* Translate host name into peer's IP address */
-	memset( &hints, 0, sizeof( hints ) );
-	hints.ai_family = AF_INET;
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = 0;
-	hints.ai_protocol = 0;
-
-	if ( ( s = getaddrinfo( host, service, &hints, &result ) ) != 0 ) {
-		fprintf( stderr, "stream-talk-client: getaddrinfo: %s\n", gai_strerror( s ) );
-		return -1;
-	}
-
-	/* Iterate through the address list and try to connect */
-	for ( rp = result; rp != NULL; rp = rp->ai_next ) {
-		if ( ( s = socket( rp->ai_family, rp->ai_socktype, rp->ai_protocol ) ) == -1 ) {
-			continue;
-		}
-
-		if ( connect( s, rp->ai_addr, rp->ai_addrlen ) != -1 ) {
-			break;
-		}
-
-		close( s );
-	}
-	if ( rp == NULL ) {
-		perror( "stream-talk-client: connect" );
-		return -1;
-	}
-	freeaddrinfo( result );
-
-	return s;
-}
\ No newline at end of file
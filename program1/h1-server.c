@@ -0,0 +1,298 @@
+// Offline stand-in for the page h1-counter fetches: serves one generated HTML corpus over
+// HTTP/1.1 to every GET, with keep-alive and pipelining, and gzipped when asked with -z.
+// Size, tag density, how the response is cut into writes and how long each write waits
+// are all configurable, so runs are reproducible without the network.
+// Usage: ./h1-server [-p port] [-s size[K|M]] [-d tags per KB] [-t tag ...] [-S seed]
+//                    [-f fragment bytes] [-D us between fragments] [-l us before replying] [-z]
+// The first line on stdout gives the port and the count of each tag in the corpus.
+#define _GNU_SOURCE // strcasestr()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
+#include "scan.h"
+#include "soc.h"
+
+#define SERVER_REQ_MAX 16384   // longest request head accepted
+#define SERVER_MAX_TAGS SCAN_MAX_PATTERNS
+
+struct corpus {
+	char *html;
+	size_t len;
+	char *gz;               // html gzipped, when -z allows it
+	size_t gz_len;
+	uint64_t count[SERVER_MAX_TAGS];
+};
+
+struct server_opts {
+	int port;
+	size_t size;
+	double density;         // tags inserted per KB of page
+	const char *tags[SERVER_MAX_TAGS];
+	int tag_cnt;
+	uint64_t seed;
+	int fragment;           // bytes per send(), 0 for the whole response at once
+	int delay_us;           // pause before each fragment after the first
+	int latency_us;         // pause before the first byte of each response
+	bool gzip;
+};
+
+static struct corpus corpus;
+static struct server_opts opts = { .size = 1 << 20, .density = 2, .seed = 1 };
+
+// The filler a page is made of, none of which is one of the default tags
+static const char *filler[] = {
+	"<div class=\"row\">", "</div>", "<p>", "</p>", "<span>", "</span>", "<a href=\"/page\">", "</a>",
+	"lorem ", "ipsum ", "dolor ", "sit ", "amet, ", "consectetur ", "adipiscing ", "elit. ", "\n",
+};
+
+static uint64_t next_rand( uint64_t *s ) {
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+// Appends str, cut short at the end of the page.
+static void put( struct corpus *c, size_t cap, const char *str ) {
+	size_t n = strlen( str );
+	if ( n > cap - c->len ) {
+		n = cap - c->len;
+	}
+	memcpy( c->html + c->len, str, n );
+	c->len += n;
+}
+
+// Fills the page with filler, dropping a tag in every 1024 / density bytes on average.
+// An <x> tag also gets its </x>. The tags are counted afterwards with the same scanner
+// h1-counter uses, so the expected counts hold whatever the filler happens to contain.
+static int make_corpus( struct corpus *c, const struct server_opts *o ) {
+	uint64_t rnd = o->seed ? o->seed : 1;
+	c->html = malloc( o->size + 1 );
+	if ( !c->html ) {
+		return -1;
+	}
+	c->len = 0;
+	double gap = o->density > 0 ? 1024 / o->density : 0;
+	size_t next_tag = gap > 0 ? ( size_t )( gap * ( next_rand( &rnd ) % 1000 ) / 1000 ) : o->size;
+	put( c, o->size, "<!DOCTYPE html>\n<html><body>\n" );
+	while ( c->len < o->size ) {
+		if ( c->len >= next_tag ) {
+			const char *tag = o->tags[next_rand( &rnd ) % o->tag_cnt];
+			size_t n = strlen( tag );
+			put( c, o->size, tag );
+			put( c, o->size, "heading " );
+			if ( n > 2 && tag[0] == '<' && tag[n - 1] == '>' && tag[1] != '/' ) {
+				char close[SCAN_MAX_LEN + 2] = "</";
+				memcpy( close + 2, tag + 1, n - 1 );
+				close[n + 1] = '\0';
+				put( c, o->size, close );
+			}
+			// uniform in [gap / 2, 3 gap / 2)
+			next_tag = c->len + ( size_t )( gap / 2 + gap * ( next_rand( &rnd ) % 1000 ) / 1000 );
+		} else {
+			put( c, o->size, filler[next_rand( &rnd ) % ( sizeof( filler ) / sizeof( filler[0] ) )] );
+		}
+	}
+
+	struct scan sc;
+	if ( scan_init( &sc, o->tags, o->tag_cnt ) < 0 ) {
+		return -1;
+	}
+	scan_feed( &sc, c->html, c->len );
+	memcpy( c->count, sc.count, sizeof( c->count ) );
+
+	if ( o->gzip ) {
+		z_stream z = { 0 };
+		uLong cap = deflateBound( &z, c->len ) + 32; // gzip header and trailer
+		c->gz = malloc( cap );
+		if ( !c->gz || deflateInit2( &z, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY ) != Z_OK ) {
+			return -1;
+		}
+		z.next_in = ( unsigned char * )c->html;
+		z.avail_in = c->len;
+		z.next_out = ( unsigned char * )c->gz;
+		z.avail_out = cap;
+		int rc = deflate( &z, Z_FINISH );
+		c->gz_len = cap - z.avail_out;
+		deflateEnd( &z );
+		if ( rc != Z_STREAM_END ) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Sends len bytes in fragments of the configured size, pausing between them.
+static int send_paced( int s, const char *buf, size_t len, bool *first ) {
+	size_t step = opts.fragment > 0 ? ( size_t )opts.fragment : len;
+	for ( size_t off = 0; off < len; off += step ) {
+		if ( !*first && opts.delay_us > 0 ) {
+			usleep( opts.delay_us );
+		}
+		*first = false;
+		int n = len - off < step ? len - off : step;
+		if ( send_data_to_soc( s, buf + off, &n ) < 0 ) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Answers one request head. Returns 1 to keep the connection, 0 to close it, -1 on error.
+static int respond( int s, char *req ) {
+	bool keep = strstr( req, " HTTP/1.1\r\n" ) != NULL;
+	bool gzip = false;
+	for ( char *line = strstr( req, "\r\n" ); line && line[2] != '\r'; line = strstr( line + 2, "\r\n" ) ) {
+		const char *h = line + 2;
+		if ( strncasecmp( h, "Connection:", 11 ) == 0 ) {
+			keep = strncasecmp( h + 11 + strspn( h + 11, " \t" ), "close", 5 ) != 0 && ( keep || strcasestr( h, "keep-alive" ) );
+		} else if ( strncasecmp( h, "Accept-Encoding:", 16 ) == 0 ) {
+			gzip = opts.gzip && strcasestr( h, "gzip" );
+		}
+	}
+
+	bool get = strncmp( req, "GET ", 4 ) == 0;
+	const char *body = gzip ? corpus.gz : corpus.html;
+	size_t len = !get ? 0 : gzip ? corpus.gz_len : corpus.len;
+	keep = keep && get;
+	gzip = gzip && get;
+
+	char head[256];
+	int n = snprintf( head, sizeof( head ), "HTTP/1.1 %s\r\nContent-Type: text/html\r\nContent-Length: %zu\r\n%s%s\r\n",
+		get ? "200 OK" : "405 Method Not Allowed", len,
+		gzip ? "Content-Encoding: gzip\r\n" : "", keep ? "" : "Connection: close\r\n" );
+
+	if ( opts.latency_us > 0 ) {
+		usleep( opts.latency_us );
+	}
+	bool first = true;
+	if ( send_paced( s, head, n, &first ) < 0 || send_paced( s, body, len, &first ) < 0 ) {
+		return -1;
+	}
+	return keep;
+}
+
+// One thread per connection: requests are answered in order as their heads complete,
+// so pipelined ones queue up in buf.
+static void *serve( void *arg ) {
+	int s = ( intptr_t )arg;
+	char *buf = malloc( SERVER_REQ_MAX + 1 );
+	size_t have = 0;
+	int one = 1;
+	setsockopt( s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) ); // each fragment is its own segment
+	while ( buf ) {
+		buf[have] = '\0';
+		char *end = strstr( buf, "\r\n\r\n" );
+		if ( !end ) {
+			if ( have == SERVER_REQ_MAX ) {
+				break;
+			}
+			ssize_t got = recv( s, buf + have, SERVER_REQ_MAX - have, 0 );
+			if ( got <= 0 ) {
+				break;
+			}
+			have += got;
+			continue;
+		}
+		end[2] = '\0'; // keep the CRLF that ends the last header
+		int rc = respond( s, buf );
+		if ( rc <= 0 ) {
+			break;
+		}
+		size_t used = end + 4 - buf;
+		memmove( buf, buf + used, have - used );
+		have -= used;
+	}
+	free( buf );
+	close( s );
+	return NULL;
+}
+
+static size_t parse_size( const char *arg ) {
+	char *end;
+	size_t n = strtoull( arg, &end, 10 );
+	if ( *end == 'K' || *end == 'k' ) {
+		n <<= 10;
+	} else if ( *end == 'M' || *end == 'm' ) {
+		n <<= 20;
+	}
+	return n;
+}
+
+int main( int argc, char *argv[] ) {
+	int opt;
+	while ( ( opt = getopt( argc, argv, "p:s:d:t:S:f:D:l:z" ) ) != -1 ) {
+		switch ( opt ) {
+		case 'p': opts.port = atoi( optarg ); break;
+		case 's': opts.size = parse_size( optarg ); break;
+		case 'd': opts.density = atof( optarg ); break;
+		case 'S': opts.seed = strtoull( optarg, NULL, 10 ); break;
+		case 'f': opts.fragment = atoi( optarg ); break;
+		case 'D': opts.delay_us = atoi( optarg ); break;
+		case 'l': opts.latency_us = atoi( optarg ); break;
+		case 'z': opts.gzip = true; break;
+		case 't':
+			if ( opts.tag_cnt < SERVER_MAX_TAGS ) {
+				opts.tags[opts.tag_cnt++] = optarg;
+				break;
+			}
+			// fall through
+		default:
+			fprintf( stderr, "Usage: %s [-p port] [-s size[K|M]] [-d tags per KB] [-t tag ...] [-S seed] "
+				"[-f fragment bytes] [-D us between fragments] [-l us before replying] [-z]\n", argv[0] );
+			return 1;
+		}
+	}
+	if ( opts.tag_cnt == 0 ) {
+		opts.tags[opts.tag_cnt++] = "<h1>";
+	}
+	if ( opts.size == 0 || make_corpus( &corpus, &opts ) < 0 ) {
+		fprintf( stderr, "Could not build a corpus of %zu bytes with those tags\n", opts.size );
+		return 1;
+	}
+
+	int l = socket( AF_INET, SOCK_STREAM, 0 );
+	int one = 1;
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons( opts.port ), .sin_addr.s_addr = htonl( INADDR_ANY ) };
+	socklen_t alen = sizeof( addr );
+	setsockopt( l, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+	if ( l < 0 || bind( l, ( struct sockaddr * )&addr, sizeof( addr ) ) < 0 || listen( l, SOMAXCONN ) < 0 ||
+		getsockname( l, ( struct sockaddr * )&addr, &alen ) < 0 ) {
+		perror( "h1-server" );
+		return 1;
+	}
+	signal( SIGPIPE, SIG_IGN );
+
+	printf( "h1-server: port %d, %zu bytes", ntohs( addr.sin_port ), corpus.len );
+	if ( opts.gzip ) {
+		printf( " (%zu gzipped)", corpus.gz_len );
+	}
+	for ( int k = 0; k < opts.tag_cnt; k++ ) {
+		printf( ", %s %llu", opts.tags[k], ( unsigned long long )corpus.count[k] );
+	}
+	printf( "\n" );
+	fflush( stdout );
+
+	for ( ;; ) {
+		int s = accept( l, NULL, NULL );
+		pthread_t t;
+		if ( s < 0 ) {
+			continue;
+		}
+		if ( pthread_create( &t, NULL, serve, ( void * )( intptr_t )s ) != 0 ) {
+			close( s );
+			continue;
+		}
+		pthread_detach( t );
+	}
+}
@@ -0,0 +1,310 @@
+// Benchmark driver: starts ./h1-server on a free port, runs ./h1-counter against it at a
+// range of chunk sizes, checks every run's tag and byte counts against the corpus, and
+// writes the timings as JSON. Times are wall clock per h1-counter run, process start
+// included, so they cover the scanner and the socket helpers together.
+// Usage: ./h1bench [-s size[K|M]] [-d tags per KB] [-t tag ...] [-f fragment bytes]
+//                  [-D us between fragments] [-z] [-r runs] [-c chunk,chunk,...] [-o out.json]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "scan.h"
+
+#define BENCH_MAX_CHUNKS 32
+#define BENCH_OUT_MAX 65536     // h1-counter output kept per run
+
+struct bench_opts {
+	const char *size;
+	const char *density;
+	const char *tags[SCAN_MAX_PATTERNS];
+	int tag_cnt;
+	const char *fragment;
+	const char *delay_us;
+	bool gzip;
+	int runs;
+	int chunks[BENCH_MAX_CHUNKS];
+	int chunk_cnt;
+	const char *out;
+};
+
+// What the server says about its corpus
+struct corpus_info {
+	int port;
+	unsigned long long bytes;
+	unsigned long long count[SCAN_MAX_PATTERNS];
+};
+
+// One h1-counter run, as parsed from its output
+struct run_result {
+	double ms;
+	unsigned long long bytes, wire_bytes;
+	unsigned long long count[SCAN_MAX_PATTERNS];
+};
+
+static double now_ms( void ) {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Runs argv with its stdout in out (NUL-terminated). Returns the exit status, or -1.
+static int run_capture( char *const argv[], char *out, size_t out_len ) {
+	int fd[2];
+	if ( pipe( fd ) < 0 ) {
+		return -1;
+	}
+	pid_t pid = fork();
+	if ( pid < 0 ) {
+		return -1;
+	}
+	if ( pid == 0 ) {
+		dup2( fd[1], STDOUT_FILENO );
+		close( fd[0] );
+		close( fd[1] );
+		execv( argv[0], argv );
+		_exit( 127 );
+	}
+	close( fd[1] );
+	size_t have = 0;
+	ssize_t n;
+	while ( ( n = read( fd[0], out + have, out_len - 1 - have ) ) > 0 ) {
+		have += n;
+	}
+	out[have] = '\0';
+	close( fd[0] );
+	int status;
+	if ( waitpid( pid, &status, 0 ) < 0 ) {
+		return -1;
+	}
+	return WIFEXITED( status ) ? WEXITSTATUS( status ) : -1;
+}
+
+// Starts the server and reads its banner: "h1-server: port P, N bytes[ (G gzipped)],
+// tag count, ...". Returns its pid, or -1.
+static pid_t start_server( const struct bench_opts *o, struct corpus_info *ci ) {
+	char *argv[8 + 2 * SCAN_MAX_PATTERNS];
+	int argc = 0;
+	argv[argc++] = "./h1-server";
+	argv[argc++] = "-p0";
+	argv[argc++] = "-s";
+	argv[argc++] = ( char * )o->size;
+	argv[argc++] = "-d";
+	argv[argc++] = ( char * )o->density;
+	for ( int k = 0; k < o->tag_cnt; k++ ) {
+		argv[argc++] = "-t";
+		argv[argc++] = ( char * )o->tags[k];
+	}
+	argv[argc++] = "-f";
+	argv[argc++] = ( char * )o->fragment;
+	argv[argc++] = "-D";
+	argv[argc++] = ( char * )o->delay_us;
+	if ( o->gzip ) {
+		argv[argc++] = "-z";
+	}
+	argv[argc] = NULL;
+
+	int fd[2];
+	if ( pipe( fd ) < 0 ) {
+		return -1;
+	}
+	pid_t pid = fork();
+	if ( pid < 0 ) {
+		return -1;
+	}
+	if ( pid == 0 ) {
+		dup2( fd[1], STDOUT_FILENO );
+		close( fd[0] );
+		close( fd[1] );
+		execv( argv[0], argv );
+		_exit( 127 );
+	}
+	close( fd[1] );
+	FILE *f = fdopen( fd[0], "r" );
+	char line[4096];
+	bool ok = f && fgets( line, sizeof( line ), f ) && sscanf( line, "h1-server: port %d, %llu bytes", &ci->port, &ci->bytes ) == 2;
+	// The counts follow the tags in order; a tag may itself contain ", " or digits, so
+	// each is found after the previous one
+	char *p = line;
+	for ( int k = 0; ok && k < o->tag_cnt; k++ ) {
+		char key[SCAN_MAX_LEN + 4];
+		snprintf( key, sizeof( key ), ", %s ", o->tags[k] );
+		p = strstr( p, key );
+		ok = p && sscanf( p + strlen( key ), "%llu", &ci->count[k] ) == 1;
+		p = p ? p + strlen( key ) : p;
+	}
+	if ( f ) {
+		fclose( f ); // the server never writes again, so closing the pipe is harmless
+	}
+	if ( !ok ) {
+		kill( pid, SIGTERM );
+		waitpid( pid, NULL, 0 );
+		return -1;
+	}
+	return pid;
+}
+
+// Finds "Number of <what>: N" in out.
+static bool find_count( const char *out, const char *what, unsigned long long *n ) {
+	char key[SCAN_MAX_LEN + 32];
+	snprintf( key, sizeof( key ), "Number of %s: ", what );
+	const char *p = strstr( out, key );
+	return p && sscanf( p + strlen( key ), "%llu", n ) == 1;
+}
+
+// Runs h1-counter once at the given chunk size and checks what it counted.
+static int run_counter( const struct bench_opts *o, const struct corpus_info *ci, int chunk, struct run_result *r ) {
+	static char out[BENCH_OUT_MAX];
+	char url[64], chunk_arg[16];
+	char *argv[6 + SCAN_MAX_PATTERNS];
+	int argc = 0;
+	snprintf( url, sizeof( url ), "http://127.0.0.1:%d/", ci->port );
+	snprintf( chunk_arg, sizeof( chunk_arg ), "%d", chunk );
+	argv[argc++] = "./h1-counter";
+	argv[argc++] = "-U";
+	argv[argc++] = url;
+	argv[argc++] = chunk_arg;
+	for ( int k = 0; k < o->tag_cnt; k++ ) {
+		argv[argc++] = ( char * )o->tags[k];
+	}
+	argv[argc] = NULL;
+
+	double t = now_ms();
+	int status = run_capture( argv, out, sizeof( out ) );
+	r->ms = now_ms() - t;
+	if ( status != 0 || !find_count( out, "bytes", &r->bytes ) || !find_count( out, "bytes on the wire", &r->wire_bytes ) ) {
+		return -1;
+	}
+	for ( int k = 0; k < o->tag_cnt; k++ ) {
+		char what[SCAN_MAX_LEN + 8];
+		snprintf( what, sizeof( what ), "%s tags", o->tags[k] );
+		if ( !find_count( out, what, &r->count[k] ) || r->count[k] != ci->count[k] ) {
+			return -1;
+		}
+	}
+	return r->bytes == ci->bytes ? 0 : -1;
+}
+
+static int cmp_double( const void *a, const void *b ) {
+	double x = *( const double * )a, y = *( const double * )b;
+	return x < y ? -1 : x > y;
+}
+
+// Writes s as a JSON string.
+static void json_str( FILE *f, const char *s ) {
+	fputc( '"', f );
+	for ( ; *s; s++ ) {
+		if ( *s == '"' || *s == '\\' ) {
+			fprintf( f, "\\%c", *s );
+		} else if ( ( unsigned char )*s < 0x20 ) {
+			fprintf( f, "\\u%04x", *s );
+		} else {
+			fputc( *s, f );
+		}
+	}
+	fputc( '"', f );
+}
+
+int main( int argc, char *argv[] ) {
+	struct bench_opts o = { .size = "1M", .density = "2", .fragment = "0", .delay_us = "0", .runs = 5 };
+	static const int default_chunks[] = { 1, 16, 256, 1000, 4096, 65536 };
+	int opt;
+	while ( ( opt = getopt( argc, argv, "s:d:t:f:D:zr:c:o:" ) ) != -1 ) {
+		switch ( opt ) {
+		case 's': o.size = optarg; break;
+		case 'd': o.density = optarg; break;
+		case 'f': o.fragment = optarg; break;
+		case 'D': o.delay_us = optarg; break;
+		case 'z': o.gzip = true; break;
+		case 'r': o.runs = atoi( optarg ); break;
+		case 'o': o.out = optarg; break;
+		case 't':
+			if ( o.tag_cnt < SCAN_MAX_PATTERNS && strlen( optarg ) <= SCAN_MAX_LEN ) {
+				o.tags[o.tag_cnt++] = optarg;
+				break;
+			}
+			goto usage;
+		case 'c':
+			for ( char *c = strtok( optarg, "," ); c && o.chunk_cnt < BENCH_MAX_CHUNKS; c = strtok( NULL, "," ) ) {
+				o.chunks[o.chunk_cnt++] = atoi( c );
+			}
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if ( o.runs < 1 ) {
+		goto usage;
+	}
+	if ( o.tag_cnt == 0 ) {
+		o.tags[o.tag_cnt++] = "<h1>";
+	}
+	if ( o.chunk_cnt == 0 ) {
+		memcpy( o.chunks, default_chunks, sizeof( default_chunks ) );
+		o.chunk_cnt = sizeof( default_chunks ) / sizeof( default_chunks[0] );
+	}
+	for ( int i = 0; i < o.chunk_cnt; i++ ) {
+		if ( o.chunks[i] < 1 ) {
+			goto usage;
+		}
+	}
+
+	FILE *f = o.out ? fopen( o.out, "w" ) : stdout;
+	if ( !f ) {
+		perror( o.out );
+		return 1;
+	}
+	struct corpus_info ci = { 0 };
+	pid_t server = start_server( &o, &ci );
+	if ( server < 0 ) {
+		fprintf( stderr, "Could not start ./h1-server (run make h1-server first)\n" );
+		return 1;
+	}
+
+	fprintf( f, "{\n  \"corpus\": {\"bytes\": %llu, \"density_per_kb\": %s, \"fragment\": %s, \"delay_us\": %s, \"gzip\": %s, \"tags\": {",
+		ci.bytes, o.density, o.fragment, o.delay_us, o.gzip ? "true" : "false" );
+	for ( int k = 0; k < o.tag_cnt; k++ ) {
+		fprintf( f, "%s", k ? ", " : "" );
+		json_str( f, o.tags[k] );
+		fprintf( f, ": %llu", ci.count[k] );
+	}
+	fprintf( f, "}},\n  \"runs\": [\n" );
+
+	int failed = 0;
+	for ( int i = 0; i < o.chunk_cnt; i++ ) {
+		double ms[o.runs];
+		struct run_result r = { 0 };
+		bool ok = true;
+		double sum = 0;
+		for ( int n = 0; n < o.runs; n++ ) {
+			ok = run_counter( &o, &ci, o.chunks[i], &r ) == 0 && ok;
+			ms[n] = r.ms;
+			sum += r.ms;
+		}
+		qsort( ms, o.runs, sizeof( ms[0] ), cmp_double );
+		double median = o.runs % 2 ? ms[o.runs / 2] : ( ms[o.runs / 2 - 1] + ms[o.runs / 2] ) / 2;
+		double rate = median > 0 ? ( double )ci.bytes / ( 1 << 20 ) / ( median / 1e3 ) : 0;
+		failed += !ok;
+		fprintf( f, "    {\"chunk\": %d, \"runs\": %d, \"ok\": %s, \"wire_bytes\": %llu, \"min_ms\": %.3f, \"median_ms\": %.3f, "
+			"\"mean_ms\": %.3f, \"max_ms\": %.3f, \"mb_per_s\": %.1f}%s\n",
+			o.chunks[i], o.runs, ok ? "true" : "false", r.wire_bytes, ms[0], median, sum / o.runs, ms[o.runs - 1],
+			rate, i + 1 < o.chunk_cnt ? "," : "" );
+		fprintf( stderr, "chunk %6d: median %8.2f ms, %8.1f MB/s%s\n", o.chunks[i], median, rate, ok ? "" : ", WRONG COUNTS" );
+	}
+	fprintf( f, "  ]\n}\n" );
+
+	kill( server, SIGTERM );
+	waitpid( server, NULL, 0 );
+	if ( f != stdout ) {
+		fclose( f );
+	}
+	return failed ? 1 : 0;
+
+usage:
+	fprintf( stderr, "Usage: %s [-s size[K|M]] [-d tags per KB] [-t tag ...] [-f fragment bytes] [-D us between fragments] "
+		"[-z] [-r runs] [-c chunk,chunk,...] [-o out.json]\n", argv[0] );
+	return 1;
+}
@@ -0,0 +1,332 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "http.h"
+
+enum {
+	HTTP_STATUS,        // waiting for the status line
+	HTTP_HEADER,        // header lines until the blank one
+	HTTP_BODY,          // Content-Length bytes
+	HTTP_BODY_CLOSE,    // everything until the server closes
+	HTTP_CHUNK_SIZE,    // hex size line of the next chunk
+	HTTP_CHUNK_DATA,
+	HTTP_CHUNK_END,     // CRLF after a chunk's data
+	HTTP_TRAILER,       // trailer lines after the last chunk
+	HTTP_DONE
+};
+
+int http_parse_url( const char *url, char *host, size_t host_len, char *port, size_t port_len, const char **path ) {
+	const char *p = url;
+	if ( strncmp( p, "http://", 7 ) == 0 ) {
+		p += 7;
+	} else if ( strstr( p, "://" ) ) {
+		return -1; // https and friends need TLS
+	}
+	const char *slash = strchr( p, '/' );
+	size_t hp_len = slash ? ( size_t )( slash - p ) : strlen( p );
+	*path = slash ? slash : "/";
+
+	const char *h = p;
+	size_t h_len = hp_len;
+	const char *colon;
+	if ( *p == '[' ) { // [v6 literal]:port
+		const char *close = memchr( p, ']', hp_len );
+		if ( !close ) {
+			return -1;
+		}
+		h = p + 1;
+		h_len = close - h;
+		colon = close + 1 < p + hp_len && close[1] == ':' ? close + 1 : NULL;
+	} else {
+		colon = memchr( p, ':', hp_len );
+		if ( colon ) {
+			h_len = colon - p;
+		}
+	}
+	size_t port_chars = colon ? ( size_t )( p + hp_len - colon - 1 ) : 0;
+	if ( h_len == 0 || h_len >= host_len || ( colon && ( port_chars == 0 || port_chars >= port_len ) ) ) {
+		return -1;
+	}
+	memcpy( host, h, h_len );
+	host[h_len] = '\0';
+	if ( colon ) {
+		memcpy( port, colon + 1, port_chars );
+		port[port_chars] = '\0';
+	} else {
+		strcpy( port, "80" );
+	}
+	return 0;
+}
+
+void http_resp_init( struct http_resp *r, http_body_fn body, void *arg ) {
+	memset( r, 0, offsetof( struct http_resp, line ) );
+	r->state = HTTP_STATUS;
+	r->length = -1;
+	r->body = body;
+	r->arg = arg;
+}
+
+void http_resp_end( struct http_resp *r ) {
+	if ( r->z_live ) {
+		inflateEnd( &r->z );
+		r->z_live = false;
+	}
+}
+
+bool http_resp_done( const struct http_resp *r ) {
+	return r->state == HTTP_DONE;
+}
+
+// The body is over; a compressed one must have ended too, or it was cut short.
+static int finish( struct http_resp *r ) {
+	bool coded = r->encoding == HTTP_ENC_GZIP || r->encoding == HTTP_ENC_DEFLATE;
+	http_resp_end( r );
+	return coded && r->coded_bytes > 0 && !r->z_end ? -1 : 0;
+}
+
+int http_resp_eof( struct http_resp *r ) {
+	if ( r->state == HTTP_BODY_CLOSE ) {
+		r->state = HTTP_DONE;
+		return finish( r );
+	}
+	return r->state == HTTP_DONE ? 0 : -1;
+}
+
+// Case-insensitive match of a header name; returns its trimmed value or NULL.
+static const char *header_value( const char *line, const char *name ) {
+	size_t n = strlen( name );
+	if ( strncasecmp( line, name, n ) != 0 || line[n] != ':' ) {
+		return NULL;
+	}
+	line += n + 1;
+	while ( *line == ' ' || *line == '\t' ) {
+		line++;
+	}
+	return line;
+}
+
+// Whether a comma-separated header value lists token, ignoring case.
+static bool has_token( const char *value, const char *token ) {
+	size_t n = strlen( token );
+	while ( *value ) {
+		while ( *value == ' ' || *value == '\t' || *value == ',' ) {
+			value++;
+		}
+		size_t len = strcspn( value, ", \t" );
+		if ( len == n && strncasecmp( value, token, n ) == 0 ) {
+			return true;
+		}
+		value += len;
+	}
+	return false;
+}
+
+// Runs len bytes of compressed body through the inflater, passing on whatever comes out.
+// Returns -1 if the data is corrupt.
+static int inflate_body( struct http_resp *r, const unsigned char *data, size_t len ) {
+	r->z.next_in = ( unsigned char * )data;
+	r->z.avail_in = len;
+	while ( r->z.avail_in > 0 || !r->z_end ) {
+		if ( r->z_end ) {
+			// gzip allows several members back to back; after the end of anything else
+			// the rest is ignored
+			if ( r->encoding != HTTP_ENC_GZIP ) {
+				break;
+			}
+			inflateReset( &r->z );
+			r->z_end = false;
+		}
+		r->z.next_out = ( unsigned char * )r->out;
+		r->z.avail_out = sizeof( r->out );
+		int rc = inflate( &r->z, Z_NO_FLUSH );
+		if ( rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR ) {
+			return -1;
+		}
+		size_t n = sizeof( r->out ) - r->z.avail_out;
+		if ( n > 0 ) {
+			r->body( r->arg, r->out, n );
+			r->body_bytes += n;
+		}
+		if ( rc == Z_STREAM_END ) {
+			r->z_end = true;
+		} else if ( r->z.avail_in == 0 && r->z.avail_out > 0 ) {
+			break; // everything is in and out; wait for more
+		}
+	}
+	return 0;
+}
+
+// Hands a piece of the body on, decoding it first if it is compressed.
+static int deliver( struct http_resp *r, const char *data, size_t len ) {
+	r->coded_bytes += len;
+	if ( r->encoding != HTTP_ENC_GZIP && r->encoding != HTTP_ENC_DEFLATE ) {
+		r->body( r->arg, data, len );
+		r->body_bytes += len;
+		return 0;
+	}
+	if ( r->z_live ) {
+		return inflate_body( r, ( const unsigned char * )data, len );
+	}
+
+	int window = 15 + 16; // gzip framing
+	if ( r->encoding == HTTP_ENC_DEFLATE ) {
+		// "deflate" is meant to be zlib framed, but some servers send raw deflate; a zlib
+		// header is a multiple of 31 with method 8, which raw data rarely is
+		while ( r->sniff_len < 2 && len > 0 ) {
+			r->sniff[r->sniff_len++] = *data++;
+			len--;
+		}
+		if ( r->sniff_len < 2 ) {
+			return 0;
+		}
+		bool zlib = ( r->sniff[0] & 0x0f ) == 8 && ( r->sniff[0] << 8 | r->sniff[1] ) % 31 == 0;
+		window = zlib ? 15 : -15;
+	}
+	if ( inflateInit2( &r->z, window ) != Z_OK ) {
+		return -1;
+	}
+	r->z_live = true;
+	if ( r->sniff_len > 0 && inflate_body( r, r->sniff, r->sniff_len ) < 0 ) {
+		return -1;
+	}
+	return len > 0 ? inflate_body( r, ( const unsigned char * )data, len ) : 0;
+}
+
+// Headers are over: decide how the body is framed.
+static void begin_body( struct http_resp *r ) {
+	if ( r->status / 100 == 1 ) { // 100 Continue and friends: the real response follows
+		r->state = HTTP_STATUS;
+		r->chunked = false;
+		r->length = -1;
+	} else if ( r->status == 204 || r->status == 304 ) {
+		r->state = HTTP_DONE;
+	} else if ( r->chunked ) {
+		r->state = HTTP_CHUNK_SIZE;
+	} else if ( r->length >= 0 ) {
+		r->remaining = r->length;
+		r->state = r->length > 0 ? HTTP_BODY : HTTP_DONE;
+	} else {
+		r->state = HTTP_BODY_CLOSE;
+		r->keep_alive = false; // only the close marks the end
+	}
+}
+
+// Handles one complete line, CRLF already stripped. Returns -1 if it is malformed.
+static int take_line( struct http_resp *r, char *line ) {
+	const char *v;
+	char *end;
+	switch ( r->state ) {
+	case HTTP_STATUS:
+		if ( strncmp( line, "HTTP/1.", 7 ) != 0 || !isdigit( ( unsigned char )line[7] ) || line[8] != ' ' ) {
+			return -1;
+		}
+		r->keep_alive = line[7] != '0'; // persistent by default from HTTP/1.1 on
+		r->status = strtol( line + 9, &end, 10 );
+		if ( end != line + 12 ) {
+			return -1;
+		}
+		r->state = HTTP_HEADER;
+		return 0;
+
+	case HTTP_HEADER:
+		if ( *line == '\0' ) {
+			begin_body( r );
+		} else if ( ( v = header_value( line, "Content-Length" ) ) ) {
+			r->length = strtoll( v, &end, 10 );
+			if ( end == v || r->length < 0 ) {
+				return -1;
+			}
+		} else if ( ( v = header_value( line, "Content-Encoding" ) ) ) {
+			if ( has_token( v, "gzip" ) || has_token( v, "x-gzip" ) ) {
+				r->encoding = HTTP_ENC_GZIP;
+			} else if ( has_token( v, "deflate" ) ) {
+				r->encoding = HTTP_ENC_DEFLATE;
+			} else if ( !has_token( v, "identity" ) ) {
+				r->encoding = HTTP_ENC_OTHER;
+			}
+		} else if ( ( v = header_value( line, "Transfer-Encoding" ) ) ) {
+			r->chunked = has_token( v, "chunked" );
+		} else if ( ( v = header_value( line, "Connection" ) ) ) {
+			if ( has_token( v, "close" ) ) {
+				r->keep_alive = false;
+			} else if ( has_token( v, "keep-alive" ) ) {
+				r->keep_alive = true;
+			}
+		}
+		return 0;
+
+	case HTTP_CHUNK_SIZE:
+		r->remaining = strtoll( line, &end, 16 ); // chunk extensions after ';' are ignored
+		if ( end == line || r->remaining < 0 || ( *end && *end != ';' && *end != ' ' ) ) {
+			return -1;
+		}
+		r->state = r->remaining > 0 ? HTTP_CHUNK_DATA : HTTP_TRAILER;
+		return 0;
+
+	case HTTP_CHUNK_END:
+		if ( *line != '\0' ) {
+			return -1;
+		}
+		r->state = HTTP_CHUNK_SIZE;
+		return 0;
+
+	case HTTP_TRAILER:
+		if ( *line == '\0' ) {
+			r->state = HTTP_DONE;
+		}
+		return 0;
+	}
+	return -1;
+}
+
+long http_resp_feed( struct http_resp *r, const char *buf, size_t len ) {
+	size_t i = 0;
+	while ( i < len && r->state != HTTP_DONE ) {
+		if ( r->state == HTTP_BODY || r->state == HTTP_CHUNK_DATA || r->state == HTTP_BODY_CLOSE ) {
+			size_t n = len - i;
+			if ( r->state != HTTP_BODY_CLOSE && ( long long )n > r->remaining ) {
+				n = r->remaining;
+			}
+			if ( deliver( r, buf + i, n ) < 0 ) {
+				http_resp_end( r );
+				return -1;
+			}
+			i += n;
+			if ( r->state != HTTP_BODY_CLOSE && ( r->remaining -= n ) == 0 ) {
+				r->state = r->state == HTTP_BODY ? HTTP_DONE : HTTP_CHUNK_END;
+			}
+			continue;
+		}
+
+		// Everything else is line-oriented
+		const char *nl = memchr( buf + i, '\n', len - i );
+		size_t n = nl ? ( size_t )( nl - ( buf + i ) ) : len - i;
+		if ( r->line_len + n >= HTTP_MAX_LINE ) {
+			http_resp_end( r );
+			return -1;
+		}
+		memcpy( r->line + r->line_len, buf + i, n );
+		r->line_len += n;
+		i += n;
+		if ( !nl ) {
+			break; // the rest of the line is still on its way
+		}
+		i++;
+		if ( r->line_len > 0 && r->line[r->line_len - 1] == '\r' ) {
+			r->line_len--;
+		}
+		r->line[r->line_len] = '\0';
+		r->line_len = 0;
+		if ( take_line( r, r->line ) < 0 ) {
+			http_resp_end( r );
+			return -1;
+		}
+	}
+	r->wire_bytes += i;
+	if ( r->state == HTTP_DONE && finish( r ) < 0 ) {
+		return -1;
+	}
+	return i;
+}
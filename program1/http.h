@@ -0,0 +1,66 @@
+// Incremental HTTP/1.x response parser. Bytes are fed as they arrive; the body is
+// handed to a callback with Content-Length or chunked framing removed, and parsing stops
+// at the end of the response so pipelined responses can follow on the same connection.
+// A gzip or deflate Content-Encoding is undone on the fly, so the callback always sees
+// the page itself.
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <zlib.h>
+
+#define HTTP_MAX_LINE 8192 // longest status, header, or chunk-size line accepted
+#define HTTP_INFLATE_BUF 16384 // decoded bytes handed to the callback at a time
+
+enum { HTTP_ENC_IDENTITY, HTTP_ENC_GZIP, HTTP_ENC_DEFLATE, HTTP_ENC_OTHER };
+
+typedef void ( *http_body_fn )( void *arg, const char *data, size_t len );
+
+struct http_resp {
+	int state;
+	int status;
+	bool keep_alive;         // the connection may carry another response after this one
+	bool chunked;
+	long long length;        // Content-Length, or -1 if none was sent
+	long long remaining;     // bytes left in the body or current chunk
+	int encoding;            // Content-Encoding, HTTP_ENC_*; OTHER is passed on as sent
+	unsigned long long wire_bytes;  // everything consumed, framing and headers included
+	unsigned long long coded_bytes; // the body as sent, before any decoding
+	unsigned long long body_bytes;  // what reached the callback
+	http_body_fn body;
+	void *arg;
+	bool z_live;             // z holds an inflate stream that needs inflateEnd()
+	bool z_end;              // the compressed stream is complete
+	unsigned char sniff[2];  // start of a deflate body, to tell zlib from raw framing
+	int sniff_len;
+	z_stream z;
+	size_t line_len;
+	char line[HTTP_MAX_LINE];      // these two last, so resetting the rest stays cheap
+	char out[HTTP_INFLATE_BUF];
+};
+
+// Splits an http://host[:port]/path URL (the scheme and path are optional) into host,
+// port and path; the path points into url. Returns -1 if the URL is not plain http or
+// does not fit.
+int http_parse_url( const char *url, char *host, size_t host_len, char *port, size_t port_len, const char **path );
+
+// Prepares r for the next response on a connection; body( arg, ... ) gets its payload.
+void http_resp_init( struct http_resp *r, http_body_fn body, void *arg );
+
+// Releases the decoder of a response abandoned before it was done. Finished responses
+// release it themselves; calling this again is harmless.
+void http_resp_end( struct http_resp *r );
+
+// Parses up to len bytes of buf. Returns how many were consumed, which is fewer than len
+// once the response is complete (the rest starts the next response), or -1 if the
+// response is malformed, its compressed body included.
+long http_resp_feed( struct http_resp *r, const char *buf, size_t len );
+
+bool http_resp_done( const struct http_resp *r );
+
+// The peer closed the connection. Returns 0 if that ends the response, as it does for a
+// body with neither length nor chunking, or -1 if the response was cut short.
+int http_resp_eof( struct http_resp *r );
+
+#endif
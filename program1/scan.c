@@ -0,0 +1,348 @@
+#include <string.h>
+#include <stdbool.h>
+#include "scan.h"
+
+#if defined( __x86_64__ )
+#include <immintrin.h>
+#endif
+
+// The SIMD filter puts pattern k in bucket k % 8 and, for each of its first two bytes,
+// sets the bucket's bit under that byte's low and high nibble. A position is a candidate
+// when some bucket bit survives all four lookups; nibble mixes between patterns sharing
+// a bucket can pass too, which check() weeds out. A one-byte pattern accepts any second
+// byte. When every pattern starts with the same two bytes, as a lone <h1> does, two byte
+// compares do the same job for less (see scan_pair_avx2).
+static void filter_tables( struct scan *sc ) {
+	sc->same_pair = true;
+	for ( int k = 0; k < sc->npat; k++ ) {
+		if ( sc->len[k] == 1 || memcmp( sc->pat[k], sc->pat[0], 2 ) != 0 ) {
+			sc->same_pair = false;
+		}
+		unsigned char bit = 1u << ( k % 8 );
+		unsigned char c0 = sc->pat[k][0];
+		sc->nib[0][c0 & 15] |= bit;
+		sc->nib[1][c0 >> 4] |= bit;
+		for ( int x = 0; x < 16; x++ ) {
+			if ( sc->len[k] == 1 || x == ( ( unsigned char )sc->pat[k][1] & 15 ) ) {
+				sc->nib[2][x] |= bit;
+			}
+			if ( sc->len[k] == 1 || x == ( ( unsigned char )sc->pat[k][1] >> 4 ) ) {
+				sc->nib[3][x] |= bit;
+			}
+		}
+	}
+}
+
+int scan_init( struct scan *sc, const char *const *pats, int npat ) {
+	if ( npat < 1 || npat > SCAN_MAX_PATTERNS ) {
+		return -1;
+	}
+	memset( sc, 0, sizeof( *sc ) );
+	sc->npat = npat;
+	for ( int k = 0; k < npat; k++ ) {
+		size_t len = strlen( pats[k] );
+		if ( len == 0 || len > SCAN_MAX_LEN ) {
+			return -1;
+		}
+		sc->pat[k] = pats[k];
+		sc->len[k] = len;
+		unsigned char ones[4] = { 0 };
+		memset( ones, 0xff, len < 4 ? len : 4 );
+		memcpy( &sc->head[k], pats[k], len < 4 ? len : 4 );
+		memcpy( &sc->head_mask[k], ones, 4 ); // byte-wise, so it holds for either endianness
+		sc->by_first[( unsigned char )pats[k][0]] |= 1u << k;
+		if ( len > sc->maxlen ) {
+			sc->maxlen = len;
+		}
+	}
+	filter_tables( sc );
+	// A lone short tag like <h1>: comparing all its bytes in the vector loop settles every
+	// match, and with no prefix that is also a suffix no two matches can overlap.
+	size_t len = sc->len[0];
+	sc->lone = npat == 1 && len >= 2 && len <= 4;
+	for ( size_t b = 1; sc->lone && b < len; b++ ) {
+		if ( memcmp( pats[0], pats[0] + len - b, b ) == 0 ) {
+			sc->lone = false;
+		}
+	}
+	return 0;
+}
+
+// Tries every pattern starting with *p, which sits at absolute offset at. Only avail
+// bytes are known; a pattern no longer than seen lies wholly in bytes already scanned.
+static inline void check( struct scan *sc, const unsigned char *p, size_t avail, uint64_t at, size_t seen ) {
+	uint32_t bits = sc->by_first[*p];
+	uint32_t w = 0;
+	if ( avail >= 4 ) {
+		memcpy( &w, p, 4 );
+	} else {
+		memcpy( &w, p, avail );
+	}
+	while ( bits ) {
+		int k = __builtin_ctz( bits );
+		bits &= bits - 1;
+		size_t len = sc->len[k];
+		if ( len <= seen || len > avail || at < sc->done[k] || ( w & sc->head_mask[k] ) != sc->head[k] ) {
+			continue;
+		}
+		if ( len <= 4 || memcmp( p + 4, sc->pat[k] + 4, len - 4 ) == 0 ) {
+			sc->count[k]++;
+			sc->done[k] = at + len;
+		}
+	}
+}
+
+#if defined( __x86_64__ )
+// Positions the vector loops filter before verifying any candidates. Verifying can call
+// memcmp(), which clobbers every vector register, so keeping it out of the filter loop
+// lets the nibble tables stay in registers.
+#define SCAN_STRIDE 1024
+
+// Verifies the candidates a filter loop left in masks[], bit i of masks[b] standing for
+// position b * width + i of p, which sits at absolute offset base.
+static void check_masks( struct scan *sc, const unsigned char *p, size_t n, uint64_t base, const uint32_t *masks, int cnt, int width ) {
+	for ( int b = 0; b < cnt; b++ ) {
+		uint32_t mask = masks[b];
+		while ( mask ) {
+			size_t at = ( size_t )b * width + __builtin_ctz( mask );
+			mask &= mask - 1;
+			check( sc, p + at, n - at, base + at, 0 );
+		}
+	}
+}
+
+// Both loops look up all four nibble tables with pshufb, 16 or 32 positions at a time.
+// Each block reads one byte past its end for the second byte, so they stop short of n
+// and leave the last few positions to the scalar loop.
+__attribute__(( target( "ssse3" ) ))
+static size_t scan_ssse3( struct scan *sc, const unsigned char *p, size_t n ) {
+	__m128i lo0 = _mm_loadu_si128( ( const __m128i * )sc->nib[0] );
+	__m128i hi0 = _mm_loadu_si128( ( const __m128i * )sc->nib[1] );
+	__m128i lo1 = _mm_loadu_si128( ( const __m128i * )sc->nib[2] );
+	__m128i hi1 = _mm_loadu_si128( ( const __m128i * )sc->nib[3] );
+	__m128i low = _mm_set1_epi8( 15 );
+	uint32_t masks[SCAN_STRIDE / 16];
+	size_t i = 0;
+	while ( i + 17 <= n ) {
+		size_t start = i;
+		int cnt = 0;
+		for ( ; i + 17 <= n && cnt < SCAN_STRIDE / 16; i += 16 ) {
+			__m128i v0 = _mm_loadu_si128( ( const __m128i * )( p + i ) );
+			__m128i v1 = _mm_loadu_si128( ( const __m128i * )( p + i + 1 ) );
+			__m128i t0 = _mm_and_si128( _mm_shuffle_epi8( lo0, _mm_and_si128( v0, low ) ),
+				_mm_shuffle_epi8( hi0, _mm_and_si128( _mm_srli_epi16( v0, 4 ), low ) ) );
+			__m128i t1 = _mm_and_si128( _mm_shuffle_epi8( lo1, _mm_and_si128( v1, low ) ),
+				_mm_shuffle_epi8( hi1, _mm_and_si128( _mm_srli_epi16( v1, 4 ), low ) ) );
+			__m128i none = _mm_cmpeq_epi8( _mm_and_si128( t0, t1 ), _mm_setzero_si128() );
+			masks[cnt++] = ~( uint32_t )_mm_movemask_epi8( none ) & 0xffff;
+		}
+		check_masks( sc, p + start, n - start, sc->pos + start, masks, cnt, 16 );
+	}
+	return i;
+}
+
+__attribute__(( target( "avx2" ) ))
+static size_t scan_avx2( struct scan *sc, const unsigned char *p, size_t n ) {
+	__m256i lo0 = _mm256_broadcastsi128_si256( _mm_loadu_si128( ( const __m128i * )sc->nib[0] ) );
+	__m256i hi0 = _mm256_broadcastsi128_si256( _mm_loadu_si128( ( const __m128i * )sc->nib[1] ) );
+	__m256i lo1 = _mm256_broadcastsi128_si256( _mm_loadu_si128( ( const __m128i * )sc->nib[2] ) );
+	__m256i hi1 = _mm256_broadcastsi128_si256( _mm_loadu_si128( ( const __m128i * )sc->nib[3] ) );
+	__m256i low = _mm256_set1_epi8( 15 );
+	uint32_t masks[SCAN_STRIDE / 32];
+	size_t i = 0;
+	while ( i + 33 <= n ) {
+		size_t start = i;
+		int cnt = 0;
+		for ( ; i + 33 <= n && cnt < SCAN_STRIDE / 32; i += 32 ) {
+			__m256i v0 = _mm256_loadu_si256( ( const __m256i * )( p + i ) );
+			__m256i v1 = _mm256_loadu_si256( ( const __m256i * )( p + i + 1 ) );
+			__m256i t0 = _mm256_and_si256( _mm256_shuffle_epi8( lo0, _mm256_and_si256( v0, low ) ),
+				_mm256_shuffle_epi8( hi0, _mm256_and_si256( _mm256_srli_epi16( v0, 4 ), low ) ) );
+			__m256i t1 = _mm256_and_si256( _mm256_shuffle_epi8( lo1, _mm256_and_si256( v1, low ) ),
+				_mm256_shuffle_epi8( hi1, _mm256_and_si256( _mm256_srli_epi16( v1, 4 ), low ) ) );
+			__m256i none = _mm256_cmpeq_epi8( _mm256_and_si256( t0, t1 ), _mm256_setzero_si256() );
+			masks[cnt++] = ~( uint32_t )_mm256_movemask_epi8( none );
+		}
+		check_masks( sc, p + start, n - start, sc->pos + start, masks, cnt, 32 );
+	}
+	return i;
+}
+
+// When every pattern starts with the same two bytes, two compares are the whole filter and
+// candidates are verified as soon as a block turns one up: with a tag every few hundred
+// bytes, staging masks for check_masks() costs more than reloading two constants after a
+// memcmp(). 64 positions per round keep the loop branch rare on tag-free stretches, and a
+// last round overlapping the one before covers the tail, which at recv()-sized chunks is
+// otherwise a good share of the work.
+__attribute__(( target( "avx2" ) ))
+static inline uint64_t pair_mask_avx2( const unsigned char *p, __m256i want0, __m256i want1 ) {
+	__m256i a = _mm256_and_si256( _mm256_cmpeq_epi8( _mm256_loadu_si256( ( const __m256i * )p ), want0 ),
+		_mm256_cmpeq_epi8( _mm256_loadu_si256( ( const __m256i * )( p + 1 ) ), want1 ) );
+	__m256i b = _mm256_and_si256( _mm256_cmpeq_epi8( _mm256_loadu_si256( ( const __m256i * )( p + 32 ) ), want0 ),
+		_mm256_cmpeq_epi8( _mm256_loadu_si256( ( const __m256i * )( p + 33 ) ), want1 ) );
+	return ( uint32_t )_mm256_movemask_epi8( a ) | ( uint64_t )( uint32_t )_mm256_movemask_epi8( b ) << 32;
+}
+
+__attribute__(( target( "avx2" ) ))
+static size_t scan_pair_avx2( struct scan *sc, const unsigned char *p, size_t n ) {
+	__m256i want0 = _mm256_set1_epi8( sc->pat[0][0] );
+	__m256i want1 = _mm256_set1_epi8( sc->pat[0][1] );
+	size_t i = 0;
+	while ( i + 65 <= n || ( n >= 65 && i < n - 1 ) ) {
+		size_t at0 = i + 65 <= n ? i : n - 65;
+		uint64_t mask = pair_mask_avx2( p + at0, want0, want1 ) & ( ~0ull << ( i - at0 ) );
+		while ( mask ) {
+			size_t at = at0 + __builtin_ctzll( mask );
+			mask &= mask - 1;
+			check( sc, p + at, n - at, sc->pos + at, 0 );
+		}
+		i = at0 + 64;
+	}
+	return i;
+}
+
+// Match bits of the lone pattern for the 32 positions from q: a compare per pattern byte.
+// len is a constant at every call, so the unused compares fold away.
+__attribute__(( target( "avx2" ), always_inline ))
+static inline uint32_t lone_mask_avx2( const unsigned char *q, __m256i w0, __m256i w1, __m256i w2, __m256i w3, size_t len ) {
+	__m256i m = _mm256_and_si256( _mm256_cmpeq_epi8( _mm256_loadu_si256( ( const __m256i * )q ), w0 ),
+		_mm256_cmpeq_epi8( _mm256_loadu_si256( ( const __m256i * )( q + 1 ) ), w1 ) );
+	if ( len > 2 ) {
+		m = _mm256_and_si256( m, _mm256_cmpeq_epi8( _mm256_loadu_si256( ( const __m256i * )( q + 2 ) ), w2 ) );
+	}
+	if ( len > 3 ) {
+		m = _mm256_and_si256( m, _mm256_cmpeq_epi8( _mm256_loadu_si256( ( const __m256i * )( q + 3 ) ), w3 ) );
+	}
+	return _mm256_movemask_epi8( m );
+}
+
+// Counts a lone pattern with no verifying at all: each mask bit is a whole match, so a
+// round of 64 positions is a popcount, and the only branch left is the loop's own. A last
+// round overlapping the one before covers the tail, which at recv()-sized chunks would
+// otherwise be a good share of the work.
+__attribute__(( target( "avx2,popcnt" ), always_inline ))
+static inline size_t lone_loop_avx2( struct scan *sc, const unsigned char *p, size_t n, const size_t len ) {
+	const char *pat = sc->pat[0];
+	__m256i w0 = _mm256_set1_epi8( pat[0] ), w1 = _mm256_set1_epi8( pat[1] );
+	__m256i w2 = _mm256_set1_epi8( len > 2 ? pat[2] : 0 ), w3 = _mm256_set1_epi8( len > 3 ? pat[3] : 0 );
+	uint64_t count = 0;
+	size_t last = 0, i = 0;
+	for ( ; i + 63 + len <= n; i += 64 ) {
+		uint64_t mask = lone_mask_avx2( p + i, w0, w1, w2, w3, len ) |
+			( uint64_t )lone_mask_avx2( p + i + 32, w0, w1, w2, w3, len ) << 32;
+		count += __builtin_popcountll( mask );
+		last = mask ? i + 64 - __builtin_clzll( mask ) : last;
+	}
+	if ( i + len <= n && n >= 63 + len ) {
+		size_t at0 = n - 63 - len;
+		uint64_t mask = ( lone_mask_avx2( p + at0, w0, w1, w2, w3, len ) |
+			( uint64_t )lone_mask_avx2( p + at0 + 32, w0, w1, w2, w3, len ) << 32 ) & ( ~0ull << ( i - at0 ) );
+		count += __builtin_popcountll( mask );
+		last = mask ? at0 + 64 - __builtin_clzll( mask ) : last;
+		i = at0 + 64;
+	}
+	if ( count > 0 ) {
+		sc->count[0] += count;
+		sc->done[0] = sc->pos + last - 1 + len;
+	}
+	return i;
+}
+
+__attribute__(( target( "avx2,popcnt" ) ))
+static size_t scan_lone_avx2( struct scan *sc, const unsigned char *p, size_t n ) {
+	switch ( sc->len[0] ) {
+	case 2:
+		return lone_loop_avx2( sc, p, n, 2 );
+	case 3:
+		return lone_loop_avx2( sc, p, n, 3 );
+	default:
+		return lone_loop_avx2( sc, p, n, 4 );
+	}
+}
+
+__attribute__(( target( "ssse3" ) ))
+static size_t scan_pair_ssse3( struct scan *sc, const unsigned char *p, size_t n ) {
+	__m128i want0 = _mm_set1_epi8( sc->pat[0][0] );
+	__m128i want1 = _mm_set1_epi8( sc->pat[0][1] );
+	size_t i = 0;
+	for ( ; i + 33 <= n; i += 32 ) {
+		__m128i a = _mm_and_si128( _mm_cmpeq_epi8( _mm_loadu_si128( ( const __m128i * )( p + i ) ), want0 ),
+			_mm_cmpeq_epi8( _mm_loadu_si128( ( const __m128i * )( p + i + 1 ) ), want1 ) );
+		__m128i b = _mm_and_si128( _mm_cmpeq_epi8( _mm_loadu_si128( ( const __m128i * )( p + i + 16 ) ), want0 ),
+			_mm_cmpeq_epi8( _mm_loadu_si128( ( const __m128i * )( p + i + 17 ) ), want1 ) );
+		uint32_t mask = _mm_movemask_epi8( a ) | ( uint32_t )_mm_movemask_epi8( b ) << 16;
+		while ( mask ) {
+			size_t at = i + __builtin_ctz( mask );
+			mask &= mask - 1;
+			check( sc, p + at, n - at, sc->pos + at, 0 );
+		}
+	}
+	return i;
+}
+#endif
+
+// Counts the matches that start in p[0..n) and end by p[n]; sc->pos is p's offset.
+static void scan_range( struct scan *sc, const unsigned char *p, size_t n ) {
+	size_t i = 0;
+#if defined( __x86_64__ )
+	bool avx2 = __builtin_cpu_supports( "avx2" );
+	if ( avx2 || __builtin_cpu_supports( "ssse3" ) ) {
+		if ( sc->lone && avx2 ) {
+			i = scan_lone_avx2( sc, p, n );
+		} else if ( sc->same_pair ) {
+			i = avx2 ? scan_pair_avx2( sc, p, n ) : scan_pair_ssse3( sc, p, n );
+		} else {
+			i = avx2 ? scan_avx2( sc, p, n ) : scan_ssse3( sc, p, n );
+		}
+	}
+#else
+	if ( sc->npat == 1 ) { // a single leading byte: libc's memchr is vectorised already
+		const unsigned char *q;
+		while ( ( q = memchr( p + i, sc->pat[0][0], n - i ) ) != NULL ) {
+			i = q - p;
+			check( sc, q, n - i, sc->pos + i, 0 );
+			i++;
+		}
+		return;
+	}
+#endif
+	for ( ; i < n; i++ ) {
+		if ( sc->by_first[p[i]] ) {
+			check( sc, p + i, n - i, sc->pos + i, 0 );
+		}
+	}
+}
+
+void scan_feed( struct scan *sc, const void *buf, size_t len ) {
+	const unsigned char *p = buf;
+	size_t keep = sc->maxlen - 1;
+
+	// Matches that start in the carried tail and finish in this buffer. A match can
+	// reach at most keep bytes in, so that much of buf is enough to settle them.
+	if ( sc->carry_len > 0 ) {
+		unsigned char join[2 * ( SCAN_MAX_LEN - 1 )];
+		size_t c = sc->carry_len;
+		size_t take = len < keep ? len : keep;
+		memcpy( join, sc->carry, c );
+		memcpy( join + c, p, take );
+		for ( size_t i = 0; i < c; i++ ) {
+			if ( sc->by_first[join[i]] ) {
+				check( sc, join + i, c + take - i, sc->pos - c + i, c - i );
+			}
+		}
+	}
+
+	scan_range( sc, p, len );
+	sc->pos += len;
+
+	// Carry the last keep bytes of the stream; any of them may begin a match.
+	if ( len >= keep ) {
+		memcpy( sc->carry, p + len - keep, keep );
+		sc->carry_len = keep;
+	} else {
+		size_t old = sc->carry_len + len > keep ? keep - len : sc->carry_len;
+		memmove( sc->carry, sc->carry + sc->carry_len - old, old );
+		memcpy( sc->carry + old, p, len );
+		sc->carry_len = old + len;
+	}
+}
@@ -0,0 +1,42 @@
+// Streaming multi-pattern matcher for counting tags in an HTTP body that arrives in
+// arbitrary chunks. Matches split across chunk boundaries are found, NUL bytes are
+// ordinary data, and a SIMD filter on every pattern's first two bytes at once keeps the
+// common no-match path cheap.
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCAN_MAX_PATTERNS 16
+#define SCAN_MAX_LEN 64
+
+struct scan {
+	int npat;
+	size_t maxlen;                      // longest pattern
+	const char *pat[SCAN_MAX_PATTERNS];
+	size_t len[SCAN_MAX_PATTERNS];
+	uint32_t head[SCAN_MAX_PATTERNS];      // first four bytes of each pattern, as loaded
+	uint32_t head_mask[SCAN_MAX_PATTERNS]; // which of them a shorter pattern has
+	uint64_t count[SCAN_MAX_PATTERNS];  // non-overlapping matches so far, per pattern
+	uint64_t done[SCAN_MAX_PATTERNS];   // absolute offset the last counted match ended at
+	unsigned char nib[4][16];           // filter buckets by low/high nibble of bytes 0 and 1
+	bool same_pair;                     // all patterns start with the same two bytes
+	bool lone;                          // one 2-4 byte pattern that cannot overlap itself
+	uint32_t by_first[256];             // bit k set if pattern k starts with this byte
+	uint64_t pos;                       // absolute offset of the next byte fed
+	unsigned char carry[SCAN_MAX_LEN - 1]; // tail of the stream a match may still start in
+	size_t carry_len;
+};
+
+// Prepares sc to count npat patterns; they are not copied and must outlive sc.
+// Returns -1 if there are too many patterns, or one is empty or longer than SCAN_MAX_LEN.
+int scan_init( struct scan *sc, const char *const *pats, int npat );
+
+// Scans the next len bytes of the stream. Each match is counted in the call that
+// delivers its last byte; like strstr() stepping past each hit, matches of the same
+// pattern never overlap.
+void scan_feed( struct scan *sc, const void *buf, size_t len );
+
+#endif
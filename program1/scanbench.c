@@ -0,0 +1,92 @@
+// Microbenchmark: tag counting throughput of the streaming scanner against the strstr()
+// per chunk loop h1-counter used before, over a synthetic HTML body held in memory.
+// Usage: ./scanbench [MB per measurement]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "scan.h"
+
+static const char *page =
+	"<div class=\"post\"><a href=\"/p/1\">link</a><span>text</span>\n"
+	"<h1>Heading</h1><p>Some <b>bold</b> and <i>italic</i> words.</p>\n"
+	"<ul><li>one</li><li>two</li></ul><h2>Sub</h2><img src=\"x.png\">\n";
+
+static double now_s( void ) {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The old loop: NUL-terminate each chunk, as recv() into a chunk_size+1 buffer did, and
+// strstr() for the tag.
+static unsigned long long count_strstr( char *body, size_t len, size_t chunk ) {
+	unsigned long long cnt = 0;
+	for ( size_t off = 0; off < len; off += chunk ) {
+		size_t n = len - off < chunk ? len - off : chunk;
+		char saved = body[off + n];
+		body[off + n] = '\0';
+		for ( char *p = body + off; ( p = strstr( p, "<h1>" ) ) != NULL; p += 4 ) {
+			cnt++;
+		}
+		body[off + n] = saved;
+	}
+	return cnt;
+}
+
+static unsigned long long count_scan( struct scan *sc, char *body, size_t len, size_t chunk ) {
+	for ( size_t off = 0; off < len; off += chunk ) {
+		size_t n = len - off < chunk ? len - off : chunk;
+		scan_feed( sc, body + off, n );
+	}
+	return sc->count[0];
+}
+
+// Best of three passes over `rounds` copies of the cache-resident body, in MB/s; the
+// data a crawl scans has just been recv()d, so it is warm too.
+static double run( int kind, char *body, size_t len, size_t chunk, int rounds, const char *const *tags, int ntags, unsigned long long *cnt ) {
+	double best = 0;
+	for ( int pass = 0; pass < 3; pass++ ) {
+		struct scan sc;
+		scan_init( &sc, tags, ntags );
+		*cnt = 0;
+		double t = now_s();
+		for ( int r = 0; r < rounds; r++ ) {
+			*cnt = kind == 0 ? *cnt + count_strstr( body, len, chunk ) : count_scan( &sc, body, len, chunk );
+		}
+		t = now_s() - t;
+		double rate = ( double )len * rounds / ( 1 << 20 ) / t;
+		best = rate > best ? rate : best;
+	}
+	return best;
+}
+
+int main( int argc, char *argv[] ) {
+	size_t mb = argc > 1 ? strtoul( argv[1], NULL, 10 ) : 4096;
+	size_t len = 1 << 20;
+	int rounds = mb;
+	size_t plen = strlen( page );
+	char *body = malloc( len + 1 );
+	if ( !body ) {
+		perror( "malloc" );
+		return 1;
+	}
+	for ( size_t off = 0; off < len; off += plen ) {
+		memcpy( body + off, page, len - off < plen ? len - off : plen );
+	}
+
+	const char *one[] = { "<h1>" };
+	const char *four[] = { "<h1>", "<h2>", "<img", "<a " };
+	size_t chunks[] = { 1000, 1001, 65536 };
+	printf( "%-22s %8s %10s %12s\n", "scanner", "chunk", "MB/s", "<h1> count" );
+	for ( size_t c = 0; c < sizeof( chunks ) / sizeof( chunks[0] ); c++ ) {
+		unsigned long long n;
+		double rate = run( 0, body, len, chunks[c], rounds, one, 1, &n );
+		printf( "%-22s %8zu %10.0f %12llu\n", "strstr per chunk", chunks[c], rate, n );
+		rate = run( 1, body, len, chunks[c], rounds, one, 1, &n );
+		printf( "%-22s %8zu %10.0f %12llu\n", "scan, 1 tag", chunks[c], rate, n );
+		rate = run( 1, body, len, chunks[c], rounds, four, 4, &n );
+		printf( "%-22s %8zu %10.0f %12llu\n", "scan, 4 tags", chunks[c], rate, n );
+	}
+	return 0;
+}
@@ -0,0 +1,37 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "soc.h"
+
+int send_data_to_soc(int s, const char *buf, int *len) {
+    int total = 0;        // how many bytes we've sent
+    int bytesleft = *len; // how many we have left to send
+    int n = 0;
+    while(total < *len) {
+        n = send(s, buf+total, bytesleft, 0);
+        if (n == -1) { 
+			break; 
+		}
+        total += n;
+        bytesleft -= n;
+    }
+    *len = total; // return number actually sent here
+    return (n == -1) ? -1 : 0; // here we'll return -1 if failure, 0 if good
+}
+
+int recv_data_from_soc(int s, char *buf, int *len) {
+    int total=0;
+    int bytesleft = *len;
+    int n = 0;
+
+    while(total < *len){
+        n = recv(s, buf + total, bytesleft,0);
+        if (n <= 0) { 
+			break; 
+		}
+        total += n;
+        bytesleft -= n;
+    }
+    *len = total; // return number actually sent here
+    return (n < 0) ? -1 : 0; // return -1 on failure, 0 on success
+}
+
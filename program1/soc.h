@@ -0,0 +1,13 @@
+// Blocking send/recv loops shared by the single-page and crawl modes of h1-counter.
+#ifndef SOC_H
+#define SOC_H
+
+// Sends all *len bytes of buf; *len is set to the number actually sent.
+// Returns -1 on failure, 0 on success.
+int send_data_to_soc( int s, const char *buf, int *len );
+
+// Receives until *len bytes arrived or the peer closed; *len is set to the number
+// actually received, 0 at end of stream. Returns -1 on failure, 0 on success.
+int recv_data_from_soc( int s, char *buf, int *len );
+
+#endif
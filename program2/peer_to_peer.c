@@ -8,8 +8,8 @@
 #include <dirent.h>
 #include <arpa/inet.h>
 #include <stdint.h>  
+#include "connect.h"
 
-int lookup_and_connect( const char *host, const char *service );
 int send_data_to_soc( int s, const char *buf, int *len );
 int recv_data_from_soc( int s, char *buf, int *len );
 
@@ -200,37 +200,6 @@ int main( int argc, char *argv[] ) {
     return 0;
 }
 
-int lookup_and_connect( const char *host, const char *service ) {
-	struct addrinfo hints;
-	struct addrinfo *rp, *result;
-	int s;
-	memset( &hints, 0, sizeof( hints ) );
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = 0;
-	hints.ai_protocol = 0;
-	if ( ( s = getaddrinfo( host, service, &hints, &result ) ) != 0 ) {
-		fprintf( stderr, "stream-talk-client: getaddrinfo: %s\n", gai_strerror( s ) );
-		return -1;
-	}
-	for ( rp = result; rp != NULL; rp = rp->ai_next ) {
-		if ( ( s = socket( rp->ai_family, rp->ai_socktype, rp->ai_protocol ) ) == -1 ) {
-			continue;
-		}
-		if ( connect( s, rp->ai_addr, rp->ai_addrlen ) != -1 ) {
-			break;
-		}
-		close( s );
-	}
-	if ( rp == NULL ) {
-		perror( "stream-talk-client: connect" );
-		return -1;
-	}
-	freeaddrinfo( result );
-
-	return s;
-}
-
 // function used in last program
 int send_data_to_soc(int s, const char *buf, int *len) {
     int tot = 0;
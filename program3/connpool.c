@@ -0,0 +1,78 @@
+ #include <string.h>
+ #include <unistd.h>
+ #include <errno.h>
+ #include <time.h>
+ #include <pthread.h>
+ #include <sys/socket.h>
+ #include "connpool.h"
+
+ #define CONNPOOL_MAX 64 // idle connections kept across all owners
+
+ struct idle_conn {
+     struct sockaddr_in addr;
+     int sd;
+     time_t since;
+ };
+
+ static struct idle_conn idle[CONNPOOL_MAX];
+ static int idle_cnt;
+ static pthread_mutex_t idle_mu = PTHREAD_MUTEX_INITIALIZER;
+
+ static bool same_owner( const struct sockaddr_in *a, const struct sockaddr_in *b ) {
+     return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+ }
+
+ // Removes entry i by moving the last one into its place. Called with the lock held.
+ static void idle_drop( int i ) {
+     idle[i] = idle[--idle_cnt];
+ }
+
+ // An idle connection has nothing to read; EOF or an error means the owner hung up.
+ static bool still_open( int sd ) {
+     char b;
+     int n = recv( sd, &b, 1, MSG_PEEK | MSG_DONTWAIT );
+     return n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK );
+ }
+
+ int connpool_get( const struct sockaddr_in *addr, bool *reused ) {
+     time_t now = time( NULL );
+     int sd = -1;
+     pthread_mutex_lock( &idle_mu );
+     for ( int i=idle_cnt-1; i>=0; i-- ) { // newest first, so stale ones age out
+         if ( now-idle[i].since > CONNPOOL_IDLE ) {
+             close( idle[i].sd );
+             idle_drop( i );
+         } else if ( sd < 0 && same_owner( &idle[i].addr, addr ) ) {
+             int cand = idle[i].sd;
+             idle_drop( i );
+             if ( still_open( cand ) ) {
+                 sd = cand;
+             } else {
+                 close( cand );
+             }
+         }
+     }
+     pthread_mutex_unlock( &idle_mu );
+     *reused = sd >= 0;
+     if ( sd >= 0 ) {
+         return sd;
+     }
+     sd = socket( AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+     if ( sd >= 0 && connect( sd, ( const struct sockaddr * )addr, sizeof( *addr ) ) == -1 ) {
+         close( sd );
+         sd = -1;
+     }
+     return sd;
+ }
+
+ void connpool_put( const struct sockaddr_in *addr, int sd ) {
+     pthread_mutex_lock( &idle_mu );
+     if ( idle_cnt < CONNPOOL_MAX ) {
+         idle[idle_cnt++] = ( struct idle_conn ){ *addr, sd, time( NULL ) };
+         sd = -1;
+     }
+     pthread_mutex_unlock( &idle_mu );
+     if ( sd >= 0 ) {
+         close( sd );
+     }
+ }
@@ -0,0 +1,19 @@
+ // Idle peer connections kept for reuse, so repeated FETCHes from one owner skip the TCP
+ // handshake and slow start. Only connections speaking the length-framed extensions can
+ // be pooled; a plain FETCH ends with the server closing.
+ #ifndef CONNPOOL_H
+ #define CONNPOOL_H
+
+ #include <stdbool.h>
+ #include <netinet/in.h>
+
+ #define CONNPOOL_IDLE 30 // seconds an unused connection is kept; seeders drop theirs at 60
+
+ // Returns a connection to addr: a pooled one if a live one is idle (*reused set), otherwise
+ // a new one. -1 if connecting fails.
+ int connpool_get( const struct sockaddr_in *addr, bool *reused );
+
+ // Hands back a connection that is between requests. It is closed if the pool is full.
+ void connpool_put( const struct sockaddr_in *addr, int sd );
+
+ #endif
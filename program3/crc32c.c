@@ -0,0 +1,53 @@
+ #include <string.h>
+ #include <stdbool.h>
+ #include <pthread.h>
+ #include "crc32c.h"
+
+ static uint32_t crc_table[256];
+ static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT; // swarm workers checksum at once
+
+ static void crc_table_fill( void ) {
+     for ( uint32_t i=0; i<256; i++ ) {
+         uint32_t c = i;
+         for ( int k=0; k<8; k++ ) {
+             c = c & 1 ? c>>1 ^ 0x82f63b78 : c>>1; // reflected Castagnoli polynomial
+         }
+         crc_table[i] = c;
+     }
+ }
+
+ static uint32_t crc32c_sw( uint32_t crc, const unsigned char *p, size_t len ) {
+     pthread_once( &crc_table_once, crc_table_fill );
+     while ( len-- > 0 ) {
+         crc = crc>>8 ^ crc_table[( crc ^ *p++ ) & 0xff];
+     }
+     return crc;
+ }
+
+ #if defined( __x86_64__ )
+ // 8 bytes per instruction; roughly a cycle each once the pipeline is full.
+ __attribute__(( target( "sse4.2" ) ))
+ static uint32_t crc32c_hw( uint32_t crc, const unsigned char *p, size_t len ) {
+     uint64_t c = crc;
+     for ( ; len >= 8; p += 8, len -= 8 ) {
+         uint64_t v;
+         memcpy( &v, p, 8 );
+         c = __builtin_ia32_crc32di( c, v );
+     }
+     crc = ( uint32_t )c;
+     while ( len-- > 0 ) {
+         crc = __builtin_ia32_crc32qi( crc, *p++ );
+     }
+     return crc;
+ }
+ #endif
+
+ uint32_t crc32c( uint32_t crc, const void *buf, size_t len ) {
+     crc = ~crc;
+ #if defined( __x86_64__ )
+     if ( __builtin_cpu_supports( "sse4.2" ) ) {
+         return ~crc32c_hw( crc, buf, len );
+     }
+ #endif
+     return ~crc32c_sw( crc, buf, len );
+ }
@@ -0,0 +1,12 @@
+ // CRC32C (Castagnoli), the block checksum resumable downloads are verified with.
+ #ifndef CRC32C_H
+ #define CRC32C_H
+
+ #include <stddef.h>
+ #include <stdint.h>
+
+ // Continues crc over buf; start a new checksum with crc = 0. Uses the SSE4.2 crc32
+ // instruction when the CPU has it.
+ uint32_t crc32c( uint32_t crc, const void *buf, size_t len );
+
+ #endif
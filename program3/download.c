@@ -0,0 +1,153 @@
+ #define _GNU_SOURCE // splice(), fallocate(), F_SETPIPE_SZ
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <unistd.h>
+ #include <fcntl.h>
+ #include <errno.h>
+ #include <stdbool.h>
+ #include <sys/socket.h>
+ #include "download.h"
+
+ #define PREALLOC_MIN ( 1<<20 )  // first extent reserved when the size isn't known
+ #define PREALLOC_MAX ( 64<<20 ) // the extent doubles up to this
+
+ static size_t dl_buf = DOWNLOAD_BUF_DEFAULT;
+
+ void download_set_buffer( size_t bytes ) {
+     dl_buf = bytes < 4096 ? 4096 : bytes;
+ }
+
+ // Reserves disk blocks ahead of the write position so a long download doesn't fragment the
+ // file or hit ENOSPC halfway. Unknown sizes are reserved in growing extents past EOF
+ // (KEEP_SIZE) and whatever is left over is trimmed at the end.
+ struct prealloc {
+     bool on;
+     off_t end;  // reserved up to here
+     off_t step;
+ };
+
+ static void prealloc_init( struct prealloc *pa, int fd, off_t off, long long len ) {
+     pa->on = true;
+     pa->end = off;
+     pa->step = PREALLOC_MIN;
+     if ( len > 0 ) {
+         pa->on = false; // one reservation covers the whole file
+         if ( fallocate( fd, 0, off, len ) == 0 ) {
+             pa->end = off+len;
+         }
+     }
+ }
+
+ static void prealloc_ahead( struct prealloc *pa, int fd, off_t pos ) {
+     if ( !pa->on || pos+( off_t )dl_buf <= pa->end ) {
+         return;
+     }
+     if ( fallocate( fd, FALLOC_FL_KEEP_SIZE, pa->end, pa->step ) == -1 ) {
+         pa->on = false; // file system can't, or the disk is full: just write
+         return;
+     }
+     pa->end += pa->step;
+     if ( pa->step < PREALLOC_MAX ) {
+         pa->step *= 2;
+     }
+ }
+
+ static size_t want( long long len, long long done ) {
+     return len < 0 || len-done > ( long long )dl_buf ? dl_buf : ( size_t )( len-done );
+ }
+
+ // socket -> pipe -> file: the data never enters user space. Returns bytes written, or -1;
+ // *fallback is set if the socket or file can't splice() and nothing was consumed yet.
+ static long long download_splice( int sd, int fd, off_t off, long long len, struct prealloc *pa, bool *fallback ) {
+     int pfd[2];
+     if ( pipe2( pfd, O_CLOEXEC ) == -1 ) {
+         *fallback = true;
+         return 0;
+     }
+     fcntl( pfd[1], F_SETPIPE_SZ, ( int )dl_buf ); // best effort, capped by pipe-max-size
+     long long done = 0;
+     while ( len < 0 || done < len ) {
+         prealloc_ahead( pa, fd, off+done );
+         ssize_t in = splice( sd, NULL, pfd[1], NULL, want( len, done ), SPLICE_F_MOVE | SPLICE_F_MORE );
+         if ( in < 0 && errno == EINTR ) {
+             continue;
+         }
+         if ( in < 0 && done == 0 && ( errno == EINVAL || errno == ENOSYS ) ) {
+             *fallback = true;
+             break;
+         }
+         if ( in <= 0 ) {
+             done = in < 0 ? -1 : done;
+             break;
+         }
+         while ( in > 0 ) {
+             loff_t at = off+done;
+             ssize_t out = splice( pfd[0], NULL, fd, &at, in, SPLICE_F_MOVE | SPLICE_F_MORE );
+             if ( out < 0 && errno == EINTR ) {
+                 continue;
+             }
+             if ( out <= 0 ) {
+                 // Bytes stuck in the pipe are lost, so no fallback past this point.
+                 close( pfd[0] );
+                 close( pfd[1] );
+                 return -1;
+             }
+             in -= out;
+             done += out;
+         }
+     }
+     close( pfd[0] );
+     close( pfd[1] );
+     return done;
+ }
+
+ static long long download_copy( int sd, int fd, off_t off, long long len, struct prealloc *pa ) {
+     char *buf = malloc( dl_buf );
+     if ( buf == NULL ) {
+         return -1;
+     }
+     long long done = 0;
+     while ( len < 0 || done < len ) {
+         prealloc_ahead( pa, fd, off+done );
+         ssize_t n = recv( sd, buf, want( len, done ), 0 );
+         if ( n < 0 && errno == EINTR ) {
+             continue;
+         }
+         if ( n <= 0 ) {
+             done = n < 0 ? -1 : done;
+             break;
+         }
+         for ( ssize_t w = 0; w < n; ) {
+             ssize_t out = pwrite( fd, buf+w, n-w, off+done+w );
+             if ( out < 0 && errno == EINTR ) {
+                 continue;
+             }
+             if ( out < 0 ) {
+                 free( buf );
+                 return -1;
+             }
+             w += out;
+         }
+         done += n;
+     }
+     free( buf );
+     return done;
+ }
+
+ long long download_to_fd( int sd, int fd, off_t off, long long len ) {
+     struct prealloc pa;
+     prealloc_init( &pa, fd, off, len );
+     bool fallback = false;
+     long long done = download_splice( sd, fd, off, len, &pa, &fallback );
+     if ( fallback ) {
+         done = download_copy( sd, fd, off, len, &pa );
+     }
+     if ( done >= 0 && len < 0 && pa.end > off+done ) {
+         // Give back the unused reservation (and anything stale past the new end). A known
+         // length may be one range of a larger file, so that is left alone.
+         if ( ftruncate( fd, off+done ) == -1 ) {
+             return -1;
+         }
+     }
+     return done;
+ }
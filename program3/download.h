@@ -0,0 +1,19 @@
+ // FETCH download path: moves a peer's reply body into a file with as few syscalls and
+ // copies as the kernel allows.
+ #ifndef DOWNLOAD_H
+ #define DOWNLOAD_H
+
+ #include <stddef.h>
+ #include <sys/types.h>
+
+ #define DOWNLOAD_BUF_DEFAULT ( 1<<20 )
+
+ // Bytes moved per syscall: the pipe size for splice(), the buffer size otherwise.
+ void download_set_buffer( size_t bytes );
+
+ // Copies from sd into fd starting at file offset off, until len bytes arrived or, with
+ // len < 0, the sender closes. Space is preallocated ahead of the writes. Returns the number
+ // of bytes written, or -1 on error.
+ long long download_to_fd( int sd, int fd, off_t off, long long len );
+
+ #endif
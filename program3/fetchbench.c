@@ -0,0 +1,178 @@
+ // Benchmark: FETCH throughput and CPU per GB on both ends of a transfer. The seeder is
+ // measured with sendfile() against the buffered read()+send() path, the downloader with
+ // download_to_fd() against the old 512-byte recv()+fwrite() loop. The server runs in a
+ // child process so each side's CPU time can be read back separately.
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <signal.h>
+ #include <fcntl.h>
+ #include <errno.h>
+ #include <time.h>
+ #include <stdint.h>
+ #include <stdbool.h>
+ #include <sys/types.h>
+ #include <sys/socket.h>
+ #include <sys/resource.h>
+ #include <sys/wait.h>
+ #include <netinet/in.h>
+ #include <arpa/inet.h>
+ #include "serve.h"
+ #include "download.h"
+
+ #define BENCH_FILE "bench.bin"
+ #define RECV_BUF ( 1<<20 )
+
+ enum sink { SINK_DISCARD, SINK_FWRITE_512, SINK_DOWNLOAD }; // what the client does with the data
+ static const char *sink_names[] = { "discard", "fwrite512", "download" };
+
+ double now_sec( void ) {
+     struct timespec ts;
+     clock_gettime( CLOCK_MONOTONIC, &ts );
+     return ts.tv_sec + ts.tv_nsec/1e9;
+ }
+
+ double cpu_sec( const struct rusage *ru ) {
+     return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec/1e6 + ru->ru_stime.tv_sec + ru->ru_stime.tv_usec/1e6;
+ }
+
+ // Downloads BENCH_FILE once into out (or nowhere). Returns the file bytes received.
+ long long fetch_once( int port, char *buf, enum sink sink, const char *out ) {
+     int s = socket( AF_INET, SOCK_STREAM, 0 );
+     struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons( port ), .sin_addr.s_addr = htonl( INADDR_LOOPBACK ) };
+     if ( s < 0 || connect( s, ( struct sockaddr * )&addr, sizeof( addr ) ) == -1 ) {
+         perror( "connect" );
+         exit( 1 );
+     }
+     const char req[] = "\x03" BENCH_FILE;
+     if ( send( s, req, sizeof( req ), 0 ) != sizeof( req ) ) {
+         perror( "send" );
+         exit( 1 );
+     }
+     char code;
+     if ( recv( s, &code, 1, MSG_WAITALL ) != 1 ) {
+         fprintf( stderr, "no response code\n" );
+         exit( 1 );
+     }
+     long long got = 0;
+     int n;
+     if ( sink == SINK_DISCARD ) {
+         while ( ( n = recv( s, buf, RECV_BUF, 0 ) ) > 0 || ( n < 0 && errno == EINTR ) ) {
+             got += n > 0 ? n : 0;
+         }
+     } else if ( sink == SINK_FWRITE_512 ) {
+         FILE *f = fopen( out, "wb" );
+         while ( f != NULL && ( ( n = recv( s, buf, 512, 0 ) ) > 0 || ( n < 0 && errno == EINTR ) ) ) {
+             got += n > 0 ? fwrite( buf, 1, n, f ) : 0;
+         }
+         if ( f == NULL || fclose( f ) != 0 ) {
+             perror( out );
+             exit( 1 );
+         }
+     } else {
+         int fd = open( out, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+         got = fd < 0 ? -1 : download_to_fd( s, fd, 0, -1 );
+         if ( got < 0 || close( fd ) != 0 ) {
+             perror( out );
+             exit( 1 );
+         }
+     }
+     close( s );
+     return got;
+ }
+
+ void run( const char *dir, bool buffered, enum sink sink, long long file_bytes, int rounds ) {
+     int fds[2];
+     if ( pipe( fds ) == -1 ) {
+         perror( "pipe" );
+         exit( 1 );
+     }
+     pid_t pid = fork();
+     if ( pid == 0 ) {
+         close( fds[0] );
+         fetch_server_buffered( buffered );
+         int port = fetch_server_start( dir, 0 );
+         if ( write( fds[1], &port, sizeof( port ) ) != sizeof( port ) || port < 0 ) {
+             _exit( 1 );
+         }
+         while ( true ) {
+             pause();
+         }
+     }
+     close( fds[1] );
+     int port = -1;
+     if ( read( fds[0], &port, sizeof( port ) ) != sizeof( port ) || port < 0 ) {
+         fprintf( stderr, "server did not start\n" );
+         exit( 1 );
+     }
+     close( fds[0] );
+
+     char out[80];
+     snprintf( out, sizeof( out ), "%s/download.bin", dir );
+     char *buf = malloc( RECV_BUF );
+     fetch_once( port, buf, SINK_DISCARD, out ); // warm the page cache
+     struct rusage self0, self1;
+     getrusage( RUSAGE_SELF, &self0 );
+     double t = now_sec();
+     long long total = 0;
+     for ( int i=0; i<rounds; i++ ) {
+         long long got = fetch_once( port, buf, sink, out );
+         if ( got != file_bytes ) {
+             fprintf( stderr, "short transfer: %lld of %lld bytes\n", got, file_bytes );
+             exit( 1 );
+         }
+         total += got;
+     }
+     double el = now_sec()-t;
+     getrusage( RUSAGE_SELF, &self1 );
+     free( buf );
+     unlink( out );
+
+     kill( pid, SIGTERM );
+     int status;
+     struct rusage ru;
+     wait4( pid, &status, 0, &ru );
+     double gb = total/1e9;
+     printf( "%-9s %-10s %8.2f GB %8.0f MB/s %10.3f %10.3f\n", buffered ? "buffered" : "sendfile", sink_names[sink],
+             gb, total/1e6/el, cpu_sec( &ru )/gb, ( cpu_sec( &self1 )-cpu_sec( &self0 ) )/gb );
+ }
+
+ int main( int argc, char *argv[] ) {
+     long long mb = argc > 1 ? atoll( argv[1] ) : 256; // file size
+     int rounds = argc > 2 ? atoi( argv[2] ) : 16;      // downloads per mode
+     if ( argc > 3 || mb < 1 || rounds < 1 ) {
+         fprintf( stderr, "Usage: %s [file MB] [downloads]\n", argv[0] );
+         exit( 1 );
+     }
+
+     char dir[] = "/tmp/fetchbench.XXXXXX";
+     if ( mkdtemp( dir ) == NULL ) {
+         perror( "mkdtemp" );
+         exit( 1 );
+     }
+     char path[64];
+     snprintf( path, sizeof( path ), "%s/" BENCH_FILE, dir );
+     int fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+     char chunk[65536];
+     for ( size_t i=0; i<sizeof( chunk ); i++ ) {
+         chunk[i] = ( char )( i*131 );
+     }
+     for ( long long left = mb<<20; left > 0; left -= sizeof( chunk ) ) {
+         if ( fd < 0 || write( fd, chunk, sizeof( chunk ) ) != sizeof( chunk ) ) {
+             perror( path );
+             exit( 1 );
+         }
+     }
+     close( fd );
+
+     printf( "%-9s %-10s %11s %13s %10s %10s\n", "server", "client", "moved", "rate", "srv s/GB", "cli s/GB" );
+     run( dir, true, SINK_DISCARD, mb<<20, rounds );
+     run( dir, false, SINK_DISCARD, mb<<20, rounds );
+     run( dir, false, SINK_FWRITE_512, mb<<20, rounds );
+     run( dir, false, SINK_DOWNLOAD, mb<<20, rounds );
+
+     unlink( path );
+     rmdir( dir );
+     return 0;
+ }
@@ -0,0 +1,47 @@
+ // Peer-to-peer wire protocol. FETCH (0x03) is the course protocol: name in, response code
+ // and the whole file out, then the server closes. The extensions below keep the connection
+ // open and put an explicit length in every reply, so one connection can carry many of them.
+ #ifndef P2P_H
+ #define P2P_H
+
+ #include <stdint.h>
+
+ #define P2P_FETCH 0x03 // name\0 -> code, file bytes until close
+ #define P2P_INFO  0x10 // name\0 -> code, size(8)
+ #define P2P_RANGE 0x11 // offset(8) length(8) name\0 -> code, length(8), that many file bytes
+ #define P2P_SUMS  0x12 // name\0 -> code, size(8), block(4), count(4), count CRC32C(4) of each block
+
+ #define P2P_OK 0
+ #define P2P_NO_FILE 1
+
+ #define P2P_MAX_NAME 100
+ #define P2P_BLOCK ( 256<<10 ) // checksum granularity for SUMS
+
+ // Multi-byte fields go big-endian like everything else on the wire.
+ static inline void p2p_put32( unsigned char *p, uint32_t v ) {
+     p[0] = v>>24;
+     p[1] = v>>16;
+     p[2] = v>>8;
+     p[3] = v;
+ }
+
+ static inline uint32_t p2p_get32( const unsigned char *p ) {
+     return ( uint32_t )p[0]<<24 | p[1]<<16 | p[2]<<8 | p[3];
+ }
+
+ static inline void p2p_put64( unsigned char *p, uint64_t v ) {
+     for ( int i=7; i>=0; i-- ) {
+         p[i] = ( unsigned char )v;
+         v >>= 8;
+     }
+ }
+
+ static inline uint64_t p2p_get64( const unsigned char *p ) {
+     uint64_t v = 0;
+     for ( int i=0; i<8; i++ ) {
+         v = v<<8 | p[i];
+     }
+     return v;
+ }
+
+ #endif
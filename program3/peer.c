@@ -9,25 +9,101 @@
  #include <arpa/inet.h>
  #include <stdint.h>  
  #include <stdbool.h>
+ #include <stdatomic.h>
+ #include <limits.h>
+ #include <fcntl.h>
+ #include <errno.h>
+ #include <pthread.h>
+ #include <sys/inotify.h>
+ #include <sys/stat.h>
+ #include <sys/time.h>
+ #include <poll.h>
+ #include "connect.h"
+ #include "serve.h"
+ #include "download.h"
+ #include "swarm.h"
+ #include "p2p.h"
  
- int lookup_and_connect( const char *host, const char *service );
  int send_data_to_soc( int s, const char *buf, int *len );
  int recv_data_from_soc( int s, char *buf, int *len );
- 
+ int batch_search( int sock, const char *list_path );
+ int req_add( int sock, const void *buf, int len );
+ int req_flush( int sock );
+ int reg_recv( int sock, char *buf, int len );
+ int send_join( int sock, int peer_id );
+ int send_publish( int sock );
+ int watch_start( int sock );
+ int send_search( int sock, unsigned char op, const char *name );
+ int read_search_reply( int sock );
+ int read_owners_reply( int sock, char *owners, int *cnt );
+ int fetch_from_owners( const char *name, const char *owners, int cnt );
+ int run_script( int sock, FILE *in, int depth, int peer_id );
+
+ #define BATCH_NAMES 1024 // names per batch SEARCH frame
+ #define BATCH_WINDOW 8   // batch frames sent before we wait for the oldest answer
+ #define MAX_OWNERS 32    // most owners a SEARCH_ALL reply lists
+ #define REQ_BUF 65536    // requests are batched into one send until we have to wait
+ #define PUB_FRAME ( 1<<20 ) // name bytes per PUBLISH/PUB_ADD/PUB_DEL frame before starting another
+ #define WATCH_BUF 65536  // inotify events taken per read()
+ #define REG_TIMEOUT 10   // seconds to wait for a registry answer before giving up on it
+
+ const unsigned char join_bytes = 0x00; 
+ const unsigned char pub_bytes = 0x01; 
+ const unsigned char search_bytes = 0x02; 
+ const unsigned char search_all_bytes = 0x06; 
+ const unsigned char register_bytes = 0x04; 
+ const unsigned char pub_add_bytes = 0x08; // count + names to add to what we published
+ const unsigned char pub_del_bytes = 0x09; // count + names to take off it
+
+ static int serve_port = -1; // port our FETCH server listens on, -1 if it isn't running
+ static bool search_all = false; // -x: FETCH asks for every owner with SEARCH_ALL, which not every registry has
+
+ static char req_buf[REQ_BUF]; // registry requests not written to the socket yet
+ static int req_len = 0;
+ static pthread_mutex_t req_mu = PTHREAD_MUTEX_INITIALIZER; // the WATCH thread queues requests too
+ static int watch_fd = -1; // inotify on SharedFiles once WATCH has started
+ static pthread_t watch_tid;
+ static _Atomic bool watch_over; // the watcher has exited; the next WATCH reaps it and starts over
+
+ // A PUBLISH, PUB_ADD or PUB_DEL frame being filled: op, count, then NUL-terminated names.
+ struct name_frame {
+     unsigned char *buf;
+     int len, cap;
+     uint32_t cnt;
+ };
+
  int main( int argc, char *argv[] ) {
-    const unsigned char join_bytes = 0x00; 
-    const unsigned char pub_bytes = 0x01; 
-    const unsigned char search_bytes = 0x02; 
- 
+    const char *script = NULL; // -s: run commands from this file ("-" for stdin) instead of prompting
+    int depth = 1;             // -k: requests allowed in flight while running a script
+    int listen_port = 0;       // -p: port to serve FETCH on, 0 lets the kernel pick
+    int opt;
+    while ( ( opt = getopt( argc, argv, "s:k:p:b:x" ) ) != -1 ) {
+        if ( opt == 's' ) {
+            script = optarg;
+        } else if ( opt == 'k' && atoi( optarg ) > 0 ) {
+            depth = atoi( optarg );
+        } else if ( opt == 'p' && atoi( optarg ) >= 0 && atoi( optarg ) < 65536 ) {
+            listen_port = atoi( optarg );
+        } else if ( opt == 'b' && atoi( optarg ) > 0 ) { // -b: FETCH download buffer in KB
+            download_set_buffer( ( size_t )atoi( optarg )*1024 );
+        } else if ( opt == 'x' ) {
+            search_all = true;
+        } else {
+            fprintf( stderr, "Invalid arguments provided\n" );
+            exit( 1 );
+        }
+    }
+
     // Check that we received exactly three arguments
-    if ( argc != 4 ) {
+    if ( argc-optind != 3 ) {
         fprintf( stderr, "Invalid arguments provided\n" );
+        fprintf( stderr, "Usage: %s [-s script|-] [-k depth] [-p port] [-b KB] [-x] <registry host> <registry port> <peer id>\n", argv[0] );
         exit( 1 );
     }
  
-    const char *reg_host=argv[1]; //Registry host 
-    const char *reg_port=argv[2]; //Registry port number
-    int peer_id=atoi( argv[3] ); //Peer ID (string converted to int because command line argument is text and we need int)
+    const char *reg_host=argv[optind]; //Registry host 
+    const char *reg_port=argv[optind+1]; //Registry port number
+    int peer_id=atoi( argv[optind+2] ); //Peer ID (string converted to int because command line argument is text and we need int)
 
     // Connect to the registry using the provided host and port.
     // This function deals with the host, creates a socket, and connects.
@@ -37,6 +113,29 @@
         fprintf( stderr,"Error: could not connect to registry.\n" );
         exit( 1 );
     }
+    // A registry that ignores a request must not hang us. A reply that times out may still
+    // arrive and would be taken for the next one, so a timeout ends the session.
+    struct timeval reg_timeout = { REG_TIMEOUT, 0 };
+    setsockopt( sock_dir, SOL_SOCKET, SO_RCVTIMEO, &reg_timeout, sizeof( reg_timeout ) );
+
+    // Serve our SharedFiles to other peers in the background; JOIN then registers this port.
+    serve_port = fetch_server_start( "SharedFiles", ( uint16_t )listen_port );
+    if ( serve_port < 0 ) {
+        fprintf( stderr, "Warning: not serving FETCH requests, JOIN will not register a port.\n" );
+    } else if ( script == NULL ) {
+        printf( "Serving FETCH requests on port %d\n", serve_port );
+    }
+
+    if ( script != NULL ) {
+        FILE *in = strcmp( script, "-" ) == 0 ? stdin : fopen( script, "r" );
+        if ( in == NULL ) {
+            perror( script );
+            exit( 1 );
+        }
+        int rc = run_script( sock_dir, in, depth, peer_id );
+        close( sock_dir );
+        return rc == 0 ? 0 : 1;
+    }
 
     // Buffer for storing user commands input
     char user_input[256];
@@ -61,17 +160,7 @@
 
         // join section
         else if ( strcmp( user_input,"JOIN" )==0 ) {
-            // Builds the join packet
-            char joinRequest[5];  
-            joinRequest[0]=join_bytes;  // Set the byte (0x00 for join)
-
-            // Convert the peer_id (int) to network byte order and copy it into the packet
-            uint32_t peer_ID_net=htonl(( uint32_t )peer_id );
-            memcpy( joinRequest+1,&peer_ID_net,sizeof( peer_ID_net ));
-
-            // Prepare to send the 5-byte JOIN packet in one go
-            int joinLength = 5;
-            if ( send_data_to_soc( sock_dir,joinRequest,&joinLength )==-1 ) {
+            if ( send_join( sock_dir,peer_id )==-1 || req_flush( sock_dir )==-1 ) {
                 perror( "send JOIN" );  // error if sending fails
                 close( sock_dir );        // Close the socket if error
                 exit( 1 );
@@ -82,53 +171,29 @@
 
         // publish section
         else if ( strcmp( user_input,"PUBLISH" )==0 ) {
-            // 1 byte action, 4 bytes file count, then file names
-            unsigned char request_from_pub[1200];
-            request_from_pub[0]=pub_bytes;
-
-            int count_position=1; // Position of file count in the packet
-            int file_start=5;  // Where file names will start
-            uint32_t count_file=0;
-
-            // Open "SharedFiles" 
-            DIR *dirctry = opendir( "SharedFiles" );
-            if ( dirctry==NULL ) { //if it hits null then it fails
-                perror( "Failed to open" );
+            int count_file = send_publish( sock_dir );
+            if ( count_file==-2 ) { // SharedFiles could not be read, nothing was sent
                 continue;
             }
-
-            // Traverse the directory to find regular files
-            struct dirent *dir_pointing_to;
-            while (( dir_pointing_to=readdir( dirctry ))!=NULL ) {
-                // Only consider regular files, i.e. ignoring 
-                if ( dir_pointing_to->d_type==DT_REG ) {
-                    // Copy the file name (plus null terminator) into the packet
-                    int len_name = strlen( dir_pointing_to->d_name ) +1;
-                    // Check to see if adding this filename won't exceed the packet's max size 
-                    if ( file_start+len_name>1200 ) {
-                        fprintf( stderr,"PUBLISH packet exceeds maximum size.\n" );
-                        break;
-                    }
-                    // Copy the file name and its null terminator into the packet at the current index
-                    snprintf(( char * )request_from_pub+file_start,sizeof( request_from_pub )-file_start,"%s%c",dir_pointing_to->d_name,'\0' );
-                    file_start += len_name;
-                    count_file++;
-                }
-            }
-            closedir( dirctry );
-
-            // Convert count_file to network order and store it in the packet
-            uint32_t count_net_file=htonl( count_file );
-            memcpy( request_from_pub+count_position, &count_net_file, sizeof( count_net_file ) );
-            // The total size of the publish packet
-            int length_of_publish = file_start;
-            // Send the packet in one go
-            if ( send_data_to_soc(sock_dir, ( const char * )request_from_pub,&length_of_publish )==-1 ) {
+            if ( count_file==-1 || req_flush( sock_dir )==-1 ) {
                 perror( "send PUBLISH" );
                 close( sock_dir );
                 exit( 1 );
             }
-            printf( "PUBLISH request sent with %u file(s).\n", count_file );
+            printf( "PUBLISH request sent with %d file(s).\n", count_file );
+        }
+
+        // watch section: publish once, then send only what changes in SharedFiles
+        else if ( strcmp( user_input,"WATCH" )==0 ) {
+            int count_file = watch_start( sock_dir );
+            if ( count_file==-1 ) {
+                perror( "WATCH: send PUBLISH" );
+                close( sock_dir );
+                exit( 1 );
+            }
+            if ( count_file>=0 ) {
+                printf( "PUBLISH request sent with %d file(s), watching SharedFiles for changes.\n", count_file );
+            }
         }
 
         // SEARCH SECTION
@@ -142,62 +207,32 @@
             }
             name_of_file[strcspn( name_of_file, "\n" )] = '\0'; // Remove the newline character
 
-            // finding length of the file name
-            int name_of_file_length = strlen( name_of_file ) + 1;
-            int request_length = 1 + name_of_file_length; // Total length of the search packet
-            unsigned char *search_packet = malloc( request_length ); // allocating memory for the search packet.
-            if ( search_packet == NULL ) {
-                perror( "malloc" );
-                continue;
-            }
-            search_packet[0] = search_bytes; // Set the first byte to search action
-            memcpy( search_packet+1, name_of_file, name_of_file_length ); //copy the file into the packet
-
             //send all of the search in one go
-            if ( send_data_to_soc( sock_dir,( const char * )search_packet, &request_length )==-1 ) {
+            if ( send_search( sock_dir,search_bytes,name_of_file )==-1 ) {
                 perror( "send SEARCH" );
-                free( search_packet );
                 close( sock_dir );
                 exit( 1 );
             }
-            free( search_packet );
-
-            // Expect 10-byte response: 4 bytes peer_id, 4 bytes IPv4, 2 bytes port
-            char search_response[10];
-            int length_response = 10;
-            if ( recv_data_from_soc( sock_dir,search_response,&length_response )==-1 ) { // if the recieving search fails it returns -1
-                perror( "recv SEARCH response" );
-                continue;
+            if ( read_search_reply( sock_dir )==-1 ) { // lost or late: later answers would be misread
+                close( sock_dir );
+                exit( 1 );
             }
-            if ( length_response<10 ) { // Check if the full response was received.
-                fprintf( stderr, "Incomplete SEARCH response\n" );
+        }
+
+        // batch search section: resolve every name listed in a file, many per round trip
+        else if ( strcmp( user_input,"BATCH" )==0 ) {
+            printf( "Enter a file listing names: " );
+            char list_path[256];
+            if ( fgets( list_path,sizeof( list_path ),stdin )==NULL ) {
                 continue;
             }
-
-            // Parse the response, Extract peer_id
-            uint32_t peer_ID_of_res;
-            memcpy( &peer_ID_of_res,search_response,4 );
-            peer_ID_of_res = ntohl( peer_ID_of_res );
-
-            struct in_addr addr; // Extract the IPv4 address
-            memcpy( &addr,search_response+4,4 );
-
-            uint16_t respPort; // Extract the port number
-            memcpy( &respPort,search_response+8,2 );
-            respPort = ntohs( respPort );
-
-            char ipStr[INET_ADDRSTRLEN]; // Converts the IP to string
-            inet_ntop( AF_INET,&addr,ipStr,sizeof( ipStr ) );
-
-            // Check if file wasn't found
-            if ( peer_ID_of_res==0 && addr.s_addr==0 && respPort==0 ) {
-                printf( "File not indexed by registry.\n" );
-            } else {
-                printf( "File found at\nPeer %u\n%s:%u\n",peer_ID_of_res,ipStr,respPort );
+            list_path[strcspn( list_path, "\n" )] = '\0';
+            if ( batch_search( sock_dir,list_path )==-1 ) {
+                close( sock_dir );
+                exit( 1 );
             }
         }
 
-
         else if ( strcmp( user_input,"FETCH" ) ==0 ) {
             printf( "Enter a file: " );
             char user_file[100]; //buffer storing the user filename
@@ -207,167 +242,697 @@
                 continue;
             }
             user_file[strcspn( user_file, "\n" )] = '\0';
-            unsigned char search_req[101]; // Building search request to send to registry:
-            search_req[0] = 0x02; 
-            int file_len = strlen( user_file ) +1; //gets the length of the filename, including its null terminator
-            memcpy( search_req+1,user_file,file_len ); // Copy the filename into search request
-
-            int s_len = 1 + file_len;
-            // Send search request to the registry
-            if ( send_data_to_soc( sock_dir, ( char* )search_req,&s_len ) ==-1 ) {
+
+            // with -x an extended search, the registry lists every owner it knows
+            if ( send_search( sock_dir,search_all ? search_all_bytes : search_bytes,user_file ) ==-1 ) {
                 perror("send SEARCH");
-                continue;
+                close( sock_dir );
+                exit( 1 );
             }
-
-            char resp[10];
-            int r_len = 10;
-            //either fewer than 10 bytes read or there's an error
-            if ( recv_data_from_soc( sock_dir,resp,&r_len ) ==-1||r_len<10 ) {
-                fprintf( stderr, "SEARCH response error\n" );
-                continue;
+            char owners[MAX_OWNERS*10];
+            int owner_cnt;
+            if ( read_owners_reply( sock_dir,owners,&owner_cnt )==-1 ) { // as for SEARCH
+                close( sock_dir );
+                exit( 1 );
             }
+            fetch_from_owners( user_file,owners,owner_cnt );
+        }
+    }
 
-            uint32_t peer_id; 
-            memcpy( &peer_id, resp, 4 );
-            //This extracts the peer ID
-            peer_id = ntohl( peer_id );
+    return 0;
+}
+ 
+ // Queues a registry request. Requests go out together when a reply has to be waited for
+ // (see reg_recv) or the buffer fills, so a pipelined run costs few send() calls.
+ // A frame is queued whole under req_mu, so frames from the WATCH thread never split one
+ // from the main thread.
+ static int req_flush_locked( int sock ) {
+     int len = req_len;
+     req_len = 0;
+     return len == 0 ? 0 : send_data_to_soc( sock, req_buf, &len );
+ }
 
-            struct in_addr addr;
-            //This extracts the IP address
-            memcpy( &addr,resp+4,4 );
+ int req_add( int sock, const void *buf, int len ) {
+     int rc = 0;
+     pthread_mutex_lock( &req_mu );
+     if ( req_len + len > REQ_BUF ) {
+         rc = req_flush_locked( sock );
+     }
+     if ( rc == 0 && len > REQ_BUF ) { // too big to batch, send it as is
+         rc = send_data_to_soc( sock, buf, &len );
+     } else if ( rc == 0 ) {
+         memcpy( req_buf+req_len, buf, len );
+         req_len += len;
+     }
+     pthread_mutex_unlock( &req_mu );
+     return rc;
+ }
 
-            uint16_t port;
-            memcpy( &port,resp+8,2 );
-            //This extracts the port
-            port = ntohs( port );
+ int req_flush( int sock ) {
+     pthread_mutex_lock( &req_mu );
+     int rc = req_flush_locked( sock );
+     pthread_mutex_unlock( &req_mu );
+     return rc;
+ }
 
-            // If the peer_id, address, + port are all 0, the registry didn't find any peer with this file.
-            if ( !peer_id && !addr.s_addr && !port ) {
-                printf( "File not indexed by registry.\n" );
-                continue;
-            }
+ // Reads exactly len reply bytes from the registry after pushing out queued requests.
+ int reg_recv( int sock, char *buf, int len ) {
+     if ( req_flush( sock ) == -1 ) {
+         return -1;
+     }
+     int got = len;
+     if ( recv_data_from_soc( sock, buf, &got ) == -1 || got < len ) {
+         return -1;
+     }
+     return 0;
+ }
 
-            // Converts the binary into text
-            char ip_str[INET_ADDRSTRLEN];
-            if ( !inet_ntop( AF_INET,&addr,ip_str,sizeof( ip_str ))) {
-                perror( "inet_ntop" );
-                continue;
-            }
+ // Sends JOIN, or REGISTER when our FETCH server is up so the registry hands out the
+ // address we actually listen on: 0x04, peer id, IPv4 address and port, all big-endian.
+ int send_join( int sock, int peer_id ) {
+     if ( serve_port >= 0 ) {
+         struct sockaddr_in self;
+         socklen_t self_len = sizeof( self );
+         if ( getsockname( sock, ( struct sockaddr * )&self, &self_len ) == 0 && self.sin_family == AF_INET ) {
+             char reg[11];
+             uint32_t id_n = htonl( ( uint32_t )peer_id );
+             uint16_t port_n = htons( ( uint16_t )serve_port );
+             reg[0] = register_bytes;
+             memcpy( reg+1, &id_n, 4 );
+             memcpy( reg+5, &self.sin_addr, 4 ); // the address the registry sees us on
+             memcpy( reg+9, &port_n, 2 );
+             return req_add( sock, reg, 11 );
+         }
+     }
+     // Builds the join packet
+     char joinRequest[5];  
+     joinRequest[0]=join_bytes;  // Set the byte (0x00 for join)
+
+     // Convert the peer_id (int) to network byte order and copy it into the packet
+     uint32_t peer_ID_net=htonl(( uint32_t )peer_id );
+     memcpy( joinRequest+1,&peer_ID_net,sizeof( peer_ID_net ));
+     return req_add( sock, joinRequest, 5 );
+ }
 
-            // Converts the port into a string
-            char port_strs[16];
-            snprintf( port_strs,sizeof( port_strs ),"%u",port );
+ // Starts an empty frame for op.
+ static void frame_start( struct name_frame *f, unsigned char op ) {
+     f->len = 5;
+     f->cnt = 0;
+     if ( f->buf != NULL ) {
+         f->buf[0] = op;
+     }
+ }
 
-            // connects to peer 
-            int peer =lookup_and_connect( ip_str, port_strs );
-            if ( peer<0 ){
-                fprintf( stderr, "Could not connect to peer" );
-                continue;
-            }
+ // Queues f and starts the next frame. A PUBLISH is sent even when empty, since it clears
+ // the registry's list; what follows it in the same list goes out as PUB_ADD.
+ static int frame_send( int sock, struct name_frame *f ) {
+     if ( f->buf == NULL || ( f->cnt == 0 && f->buf[0] != pub_bytes ) ) {
+         return 0;
+     }
+     uint32_t cnt_net = htonl( f->cnt );
+     memcpy( f->buf+1, &cnt_net, 4 );
+     int rc = req_add( sock, f->buf, f->len );
+     frame_start( f, f->buf[0] == pub_bytes ? pub_add_bytes : f->buf[0] );
+     return rc;
+ }
 
-            // this builds the fetch request
-            unsigned char fetch_reqst[101];
-            fetch_reqst[0] =0x03; // Set first byte to 0x03, this indicate a fetch
-            memcpy( fetch_reqst+1,user_file,file_len );
-            int f_len =1+file_len;
+ // Appends name to f, sending f first when it is full. Names the registry would refuse
+ // (over 100 bytes) are skipped. Returns 1 if name was added, 0 if skipped, -1 on error.
+ static int frame_name( int sock, struct name_frame *f, unsigned char op, const char *name ) {
+     int len_name = strlen( name )+1;
+     if ( len_name > 101 ) {
+         fprintf( stderr, "Not publishing %.20s...: name too long\n", name );
+         return 0;
+     }
+     if ( f->len+len_name > PUB_FRAME && f->cnt > 0 && frame_send( sock, f ) == -1 ) {
+         return -1;
+     }
+     if ( f->len+len_name > f->cap ) {
+         int cap = f->cap ? f->cap*2 : 4096;
+         unsigned char *grown = realloc( f->buf, cap );
+         if ( grown == NULL ) {
+             return -1;
+         }
+         if ( f->buf == NULL ) { // first name, frame_start had nowhere to put the op
+             grown[0] = op;
+         }
+         f->buf = grown;
+         f->cap = cap;
+     }
+     memcpy( f->buf+f->len, name, len_name );
+     f->len += len_name;
+     f->cnt++;
+     return 1;
+ }
 
-            // Send the FETCH request to the connected peer 
-            if ( send_data_to_soc( peer, ( char* )fetch_reqst,&f_len ) ==-1 ) {
-                perror( "send the fetch out" );
-                close( peer );
-                continue;
-            }
+ // Lists the regular files in SharedFiles in a PUBLISH, continued in PUB_ADD frames when the
+ // list is long. Returns how many were sent, -1 if the send failed, or -2 if the directory
+ // can't be read.
+ int send_publish( int sock ) {
+     // Open "SharedFiles" 
+     DIR *dirctry = opendir( "SharedFiles" );
+     if ( dirctry==NULL ) { //if it hits null then it fails
+         perror( "Failed to open" );
+         return -2;
+     }
 
-            unsigned char code;
-            int c_len = 1;
+     struct name_frame f = { NULL, 0, 0, 0 };
+     frame_start( &f, pub_bytes );
+     int count_file = 0, rc = 0;
+     // Traverse the directory to find regular files
+     struct dirent *dir_pointing_to;
+     while ( rc != -1 && ( dir_pointing_to=readdir( dirctry ))!=NULL ) {
+         // Only consider regular files, i.e. ignoring 
+         if ( dir_pointing_to->d_type==DT_REG ) {
+             rc = frame_name( sock, &f, pub_bytes, dir_pointing_to->d_name );
+             count_file += rc == 1;
+         }
+     }
+     closedir( dirctry );
 
-            // Receive the response code from the peer; if there's an error or we got 0 bytes, report it
-            if ( recv_data_from_soc( peer,( char* )&code,&c_len )==-1||c_len<1 ) {
-                fprintf( stderr, "fetch response error\n" );
-                close( peer );
-                continue;
-            }
-            FILE *file_point = fopen( user_file,"wb" ); //opens the file
+     if ( rc != -1 && f.buf == NULL ) { // nothing to list, the PUBLISH is just op and count
+         unsigned char empty[5] = { pub_bytes, 0, 0, 0, 0 };
+         rc = req_add( sock, empty, 5 );
+     } else if ( rc != -1 ) {
+         rc = frame_send( sock, &f );
+     }
+     free( f.buf );
+     return rc == -1 ? -1 : count_file;
+ }
 
-            if ( file_point==NULL ) {
-                perror( "fopen" ); //if it fails
-                close( peer );
-                continue;
-            }
-        
-            char buffer_for_peer[512];
-            // This doesn't stop reading the data from socket till there's none left
-            while ( true ) {
-                int bytes_expected = sizeof( buffer_for_peer );
-                //if there's no more data or a weird error happens then break out
-                if (recv_data_from_soc( peer,buffer_for_peer,&bytes_expected ) ==-1 || bytes_expected ==0 )
-                    break;
-                fwrite( buffer_for_peer,1,bytes_expected,file_point ); // Whatever bytes we're successful, write it to the file
-            }
-        
-            fclose( file_point );
-            close( peer );
-            printf("File found at Peer %u %s:%u. file saved \"%s\".\n",peer_id, ip_str, port, user_file );
+ // Sends the files added to and removed from SharedFiles as PUB_ADD and PUB_DEL frames, one
+ // read() of events at a time, so the registry sees work in proportion to the change rather
+ // than the directory. The events are sent in order, switching frames when the kind changes.
+ // Whether SharedFiles/name is a regular file with other links. A new file is published once
+ // it is closed after writing; a hard link to a finished one only ever shows up as created.
+ static bool linked( const char *name ) {
+     char path[sizeof( "SharedFiles/" )+NAME_MAX];
+     struct stat st;
+     snprintf( path, sizeof( path ), "SharedFiles/%s", name );
+     return lstat( path, &st ) == 0 && S_ISREG( st.st_mode ) && st.st_nlink > 1;
+ }
+
+ static void *watch_loop( void *arg ) {
+     int sock = ( int )( intptr_t )arg;
+     static char events[WATCH_BUF] __attribute__(( aligned( __alignof__( struct inotify_event ) ) ));
+     struct name_frame f = { NULL, 0, 0, 0 };
+     while ( 1 ) {
+         ssize_t n = read( watch_fd, events, sizeof( events ) );
+         if ( n < 0 && errno == EINTR ) {
+             continue;
+         }
+         if ( n <= 0 ) {
+             perror( "WATCH read" );
+             break;
+         }
+         int added = 0, removed = 0, rc = 0, listed = 0;
+         bool resync = false, gone = false;
+         const struct inotify_event *ev;
+         for ( char *p = events; p < events+n && rc != -1; p += sizeof( *ev )+ev->len ) {
+             ev = ( const struct inotify_event * )p;
+             if ( ev->mask & IN_Q_OVERFLOW ) { // events were lost, only a full list is right now
+                 resync = true;
+             } else if ( ev->mask & ( IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED ) ) {
+                 gone = true;
+             } else if ( ev->len > 0 && !( ev->mask & IN_ISDIR ) && ( !( ev->mask & IN_CREATE ) || linked( ev->name ) ) ) {
+                 unsigned char op = ev->mask & ( IN_DELETE | IN_MOVED_FROM ) ? pub_del_bytes : pub_add_bytes;
+                 if ( f.buf == NULL || f.buf[0] != op ) {
+                     rc = frame_send( sock, &f );
+                     frame_start( &f, op );
+                 }
+                 if ( rc != -1 ) {
+                     rc = frame_name( sock, &f, op, ev->name );
+                 }
+                 added += rc == 1 && op == pub_add_bytes;
+                 removed += rc == 1 && op == pub_del_bytes;
+             }
+         }
+         if ( resync && rc != -1 ) {
+             frame_start( &f, pub_add_bytes );
+             listed = send_publish( sock );
+             rc = listed < 0 ? listed : 0;
+             gone |= listed == -2;
+         } else if ( rc != -1 ) {
+             rc = frame_send( sock, &f );
+         }
+         if ( rc != -1 ) {
+             rc = req_flush( sock );
+         }
+         if ( rc == -1 ) {
+             perror( "WATCH send" );
+             break;
+         }
+         if ( resync && listed >= 0 ) {
+             printf( "Published change: lost track of SharedFiles, sent all %d file(s) again.\n", listed );
+         } else if ( added+removed > 0 ) {
+             printf( "Published change: added %d, removed %d file(s).\n", added, removed );
+         }
+         fflush( stdout );
+         if ( gone ) {
+             fprintf( stderr, "SharedFiles went away, no longer watching it.\n" );
+             break;
+         }
+     }
+     free( f.buf );
+     watch_over = true;
+     return NULL;
+ }
 
-            
-            
-            
+ // Starts watching SharedFiles, then PUBLISHes it in full; from then on a thread sends only
+ // the changes. The watch goes first so nothing slips in between; a change seen both ways is
+ // harmless, as the registry ignores adding a name twice or removing one it doesn't have.
+ // Returns what send_publish does, or -2 if the watch could not be set up.
+ int watch_start( int sock ) {
+     if ( watch_fd >= 0 && !watch_over ) {
+         fprintf( stderr, "Already watching SharedFiles.\n" );
+         return -2;
+     }
+     if ( watch_fd >= 0 ) { // the last watcher stopped, e.g. SharedFiles was replaced
+         pthread_join( watch_tid, NULL );
+         close( watch_fd );
+         watch_over = false;
+     }
+     watch_fd = inotify_init1( IN_CLOEXEC );
+     if ( watch_fd < 0 || inotify_add_watch( watch_fd, "SharedFiles", IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE |
+                                             IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF |
+                                             IN_ONLYDIR ) < 0 ) {
+         perror( "WATCH SharedFiles" );
+         if ( watch_fd >= 0 ) {
+             close( watch_fd );
+         }
+         watch_fd = -1;
+         return -2;
+     }
+     int count_file = send_publish( sock );
+     if ( count_file < 0 || req_flush( sock ) == -1 ) {
+         close( watch_fd );
+         watch_fd = -1;
+         return count_file == -2 ? -2 : -1;
+     }
+     if ( pthread_create( &watch_tid, NULL, watch_loop, ( void * )( intptr_t )sock ) != 0 ) {
+         fprintf( stderr, "WATCH: could not start the watcher thread\n" );
+         close( watch_fd );
+         watch_fd = -1;
+     }
+     return count_file;
+ }
 
-        }
+ // Queues a SEARCH (or SEARCH_ALL) for name; names longer than 100 bytes are cut short.
+ int send_search( int sock, unsigned char op, const char *name ) {
+     unsigned char search_packet[102];
+     int name_len = strnlen( name, 100 );
+     search_packet[0] = op; // Set the first byte to search action
+     memcpy( search_packet+1, name, name_len ); //copy the file into the packet
+     search_packet[1+name_len] = '\0';
+     return req_add( sock, search_packet, name_len+2 );
+ }
 
+ // Reads one 10-byte SEARCH answer and prints it. Returns -1 if the reply didn't arrive.
+ int read_search_reply( int sock ) {
+     // Expect 10-byte response: 4 bytes peer_id, 4 bytes IPv4, 2 bytes port
+     char search_response[10];
+     if ( reg_recv( sock,search_response,10 )==-1 ) {
+         fprintf( stderr, "Incomplete SEARCH response\n" );
+         return -1;
+     }
 
+     // Parse the response, Extract peer_id
+     uint32_t peer_ID_of_res;
+     memcpy( &peer_ID_of_res,search_response,4 );
+     peer_ID_of_res = ntohl( peer_ID_of_res );
 
-    }
+     struct in_addr addr; // Extract the IPv4 address
+     memcpy( &addr,search_response+4,4 );
 
-    return 0;
-}
- 
- 
- 
- 
- 
- 
- 
- 
- 
- 
- //code given
- int lookup_and_connect( const char *host, const char *service ) {
- 	struct addrinfo hints;
- 	struct addrinfo *rp, *result;
- 	int s;
- 	memset( &hints, 0, sizeof( hints ) );
- 	hints.ai_family = AF_INET;
- 	hints.ai_socktype = SOCK_STREAM;
- 	hints.ai_flags = 0;
- 	hints.ai_protocol = 0;
- 	if ( ( s = getaddrinfo( host, service, &hints, &result ) ) != 0 ) {
- 		fprintf( stderr, "stream-talk-client: getaddrinfo: %s\n", gai_strerror( s ) );
- 		return -1;
- 	}
- 	for ( rp = result; rp != NULL; rp = rp->ai_next ) {
- 		if ( ( s = socket( rp->ai_family, rp->ai_socktype, rp->ai_protocol ) ) == -1 ) {
- 			continue;
- 		}
- 		if ( connect( s, rp->ai_addr, rp->ai_addrlen ) != -1 ) {
- 			break;
- 		}
- 		close( s );
- 	}
- 	if ( rp == NULL ) {
- 		perror( "stream-talk-client: connect" );
- 		return -1;
- 	}
- 	freeaddrinfo( result );
- 
- 	return s;
+     uint16_t respPort; // Extract the port number
+     memcpy( &respPort,search_response+8,2 );
+     respPort = ntohs( respPort );
+
+     char ipStr[INET_ADDRSTRLEN]; // Converts the IP to string
+     inet_ntop( AF_INET,&addr,ipStr,sizeof( ipStr ) );
+
+     // Check if file wasn't found
+     if ( peer_ID_of_res==0 && addr.s_addr==0 && respPort==0 ) {
+         printf( "File not indexed by registry.\n" );
+     } else {
+         printf( "File found at\nPeer %u\n%s:%u\n",peer_ID_of_res,ipStr,respPort );
+     }
+     return 0;
  }
- 
+
+ // Reads the owners for a FETCH. A SEARCH_ALL answer is a 2-byte owner count, then a 10-byte
+ // id/ip/port record per owner; without -x the lookup was a plain SEARCH, whose one record
+ // is all zeros when nobody has the file.
+ int read_owners_reply( int sock, char *owners, int *cnt ) {
+     if ( !search_all ) {
+         if ( reg_recv( sock,owners,10 )==-1 ) {
+             fprintf( stderr, "SEARCH response error\n" );
+             return -1;
+         }
+         static const char none[10];
+         *cnt = memcmp( owners,none,10 ) != 0;
+         return 0;
+     }
+     uint16_t owner_cnt;
+     if ( reg_recv( sock,( char* )&owner_cnt,2 )==-1 ) {
+         fprintf( stderr, "SEARCH response error\n" );
+         return -1;
+     }
+     owner_cnt = ntohs( owner_cnt );
+     *cnt = 0;
+     if ( owner_cnt==0 ) { // not indexed, no records follow
+         return 0;
+     }
+     if ( owner_cnt>MAX_OWNERS || reg_recv( sock,owners,owner_cnt*10 )==-1 ) {
+         fprintf( stderr, "SEARCH response error\n" );
+         return -1;
+     }
+     *cnt = owner_cnt;
+     return 0;
+ }
+
+ // Downloads name in ranges from every owner at once when they support it; otherwise from
+ // the first owner that accepts a connection. The registry puts the owner it wants us to
+ // use first, so trying them in order spreads the load.
+ int fetch_from_owners( const char *user_file, const char *owners, int owner_cnt ) {
+     // If nobody has it, the registry didn't find any peer with this file.
+     if ( owner_cnt==0 ) {
+         printf( "File not indexed by registry.\n" );
+         return -1;
+     }
+     if ( strlen( user_file ) > P2P_MAX_NAME ) {
+         fprintf( stderr, "File name longer than %d bytes\n", P2P_MAX_NAME );
+         return -1;
+     }
+
+     int swarm_rc = swarm_fetch( user_file, owners, owner_cnt );
+     if ( swarm_rc!=SWARM_UNSUPPORTED ) {
+         if ( swarm_rc==0 ) {
+             printf( "File found at %d peer(s). file saved \"%s\".\n", owner_cnt, user_file );
+         }
+         return swarm_rc;
+     }
+
+     uint32_t peer_id = 0;
+     uint16_t port = 0;
+     char ip_str[INET_ADDRSTRLEN];
+     int peer = -1;
+     for ( int o=0; o<owner_cnt && peer<0; o++ ) {
+         const char *resp = owners+o*10;
+         memcpy( &peer_id, resp, 4 );
+         //This extracts the peer ID
+         peer_id = ntohl( peer_id );
+
+         struct in_addr addr;
+         //This extracts the IP address
+         memcpy( &addr,resp+4,4 );
+
+         memcpy( &port,resp+8,2 );
+         //This extracts the port
+         port = ntohs( port );
+
+         // Converts the binary into text
+         if ( !inet_ntop( AF_INET,&addr,ip_str,sizeof( ip_str ))) {
+             perror( "inet_ntop" );
+             continue;
+         }
+
+         // Converts the port into a string
+         char port_strs[16];
+         snprintf( port_strs,sizeof( port_strs ),"%u",port );
+
+         // connects to peer 
+         peer =lookup_and_connect( ip_str, port_strs );
+     }
+     if ( peer<0 ){
+         fprintf( stderr, "Could not connect to peer\n" );
+         return -1;
+     }
+
+     // this builds the fetch request; the name fits, fetch_from_owners checked it
+     int file_len = strlen( user_file ) +1;
+     unsigned char fetch_reqst[1+P2P_MAX_NAME+1];
+     fetch_reqst[0] =0x03; // Set first byte to 0x03, this indicate a fetch
+     memcpy( fetch_reqst+1,user_file,file_len );
+     int f_len =1+file_len;
+
+     // Send the FETCH request to the connected peer 
+     if ( send_data_to_soc( peer, ( char* )fetch_reqst,&f_len ) ==-1 ) {
+         perror( "send the fetch out" );
+         close( peer );
+         return -1;
+     }
+
+     unsigned char code;
+     int c_len = 1;
+
+     // Receive the response code from the peer; if there's an error or we got 0 bytes, report it
+     if ( recv_data_from_soc( peer,( char* )&code,&c_len )==-1||c_len<1 ) {
+         fprintf( stderr, "fetch response error\n" );
+         close( peer );
+         return -1;
+     }
+     int file_fd = open( user_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 ); //opens the file
+
+     if ( file_fd<0 ) {
+         perror( "open" ); //if it fails
+         close( peer );
+         return -1;
+     }
+
+     // The rest of the reply is the file; the peer closes the connection after the last byte.
+     if ( download_to_fd( peer, file_fd, 0, -1 )<0 ) {
+         perror( "FETCH download" );
+     }
+
+     close( file_fd );
+     close( peer );
+     printf("File found at Peer %u %s:%u. file saved \"%s\".\n",peer_id, ip_str, port, user_file );
+     return 0;
+ }
+
+ struct pending { // a script lookup whose answer is still on its way
+     bool fetch;     // the owners for a FETCH rather than a plain SEARCH
+     char name[101];
+ };
+
+ // Reads the answer to p and prints it, or downloads the file for a FETCH.
+ // Returns -1 if the reply didn't arrive.
+ static int retire_lookup( int sock, const struct pending *p ) {
+     if ( p->fetch ) {
+         char owners[MAX_OWNERS*10];
+         int owner_cnt;
+         if ( read_owners_reply( sock, owners, &owner_cnt ) == -1 ) {
+             return -1;
+         }
+         fetch_from_owners( p->name, owners, owner_cnt );
+         return 0;
+     }
+     printf( "%s: ", p->name );
+     return read_search_reply( sock );
+ }
+
+ // True if the next script line can be read without waiting. Only a regular file is read
+ // through stdio's buffer (see run_script), so for anything else the descriptor tells.
+ static bool input_ready( FILE *in ) {
+     struct pollfd pfd = { fileno( in ), POLLIN, 0 };
+     return poll( &pfd, 1, 0 ) != 0;
+ }
+
+ // Runs a command script: one command per line, arguments on the same line
+ // ("SEARCH name", "FETCH name", "BATCH listfile"). Up to depth SEARCH/FETCH lookups are
+ // kept in flight on the registry socket; their answers come back in request order and are
+ // handled from a FIFO, so output still follows the script. Before waiting for more of the
+ // script, queued requests are sent and every answer is read, so a script fed slowly (say
+ // "-s -" from a terminal) acts on each line as it comes. Returns -1 if the link broke.
+ int run_script( int sock, FILE *in, int depth, int peer_id ) {
+     struct pending *pend = calloc( depth, sizeof( *pend ) );
+     int head = 0, inflight = 0, rc = 0;
+     char line[256];
+     if ( pend == NULL ) {
+         perror( "calloc" );
+         return -1;
+     }
+     // A pipe or terminal is read unbuffered, so no line can hide in stdio while we poll
+     struct stat st;
+     if ( fstat( fileno( in ), &st ) == 0 && !S_ISREG( st.st_mode ) ) {
+         setvbuf( in, NULL, _IONBF, 0 );
+     }
+
+     while ( rc == 0 ) {
+         if ( !input_ready( in ) ) {
+             for ( ; inflight > 0 && rc == 0; inflight-- ) {
+                 rc = retire_lookup( sock, &pend[head] );
+                 head = ( head+1 ) % depth;
+             }
+             if ( rc == 0 ) {
+                 rc = req_flush( sock );
+             }
+             fflush( stdout );
+             if ( rc != 0 ) {
+                 break;
+             }
+         }
+         bool eof = fgets( line, sizeof( line ), in ) == NULL;
+         line[strcspn( line, "\r\n" )] = '\0';
+         char *arg = strchr( line, ' ' );
+         if ( arg != NULL ) {
+             *arg++ = '\0';
+             arg += strspn( arg, " " );
+         }
+         bool lookup = !eof && ( strcmp( line, "SEARCH" ) == 0 || strcmp( line, "FETCH" ) == 0 );
+         bool barrier = eof || strcmp( line, "EXIT" ) == 0 || strcmp( line, "BATCH" ) == 0;
+
+         // Retire the oldest lookup when the window is full, or every lookup before a
+         // command that needs the registry link to itself.
+         while ( inflight > 0 && ( barrier || ( lookup && inflight == depth ) ) ) {
+             if ( retire_lookup( sock, &pend[head] ) == -1 ) {
+                 rc = -1;
+                 break;
+             }
+             head = ( head+1 ) % depth;
+             inflight--;
+         }
+         if ( rc != 0 || eof || strcmp( line, "EXIT" ) == 0 ) {
+             break;
+         }
+
+         if ( lookup ) {
+             if ( arg == NULL || *arg == '\0' ) {
+                 fprintf( stderr, "%s needs a file name\n", line );
+                 continue;
+             }
+             struct pending *p = &pend[( head+inflight ) % depth];
+             p->fetch = line[0] == 'F';
+             snprintf( p->name, sizeof( p->name ), "%s", arg );
+             if ( send_search( sock, p->fetch && search_all ? search_all_bytes : search_bytes, p->name ) == -1 ) {
+                 perror( "send SEARCH" );
+                 rc = -1;
+             }
+             inflight++;
+         } else if ( strcmp( line, "JOIN" ) == 0 ) {
+             if ( send_join( sock, peer_id ) == -1 ) {
+                 perror( "send JOIN" );
+                 rc = -1;
+             }
+         } else if ( strcmp( line, "PUBLISH" ) == 0 ) {
+             if ( send_publish( sock ) == -1 ) {
+                 perror( "send PUBLISH" );
+                 rc = -1;
+             }
+         } else if ( strcmp( line, "WATCH" ) == 0 ) {
+             if ( watch_start( sock ) == -1 ) {
+                 perror( "WATCH: send PUBLISH" );
+                 rc = -1;
+             }
+         } else if ( strcmp( line, "BATCH" ) == 0 && arg != NULL ) {
+             rc = batch_search( sock, arg );
+         } else if ( line[0] != '\0' && line[0] != '#' ) {
+             fprintf( stderr, "Unknown command: %s\n", line );
+         }
+     }
+     if ( rc == 0 ) {
+         rc = req_flush( sock );
+     }
+     free( pend );
+     return rc;
+ }
+
+ // Looks up every name in list_path (one per line) with batch SEARCH frames (0x05: count,
+ // then the names), keeping up to BATCH_WINDOW frames in flight so the whole list costs a
+ // handful of round trips instead of one per name. Returns -1 if the registry link broke.
+ int batch_search( int sock, const char *list_path ) {
+     FILE *list = fopen( list_path, "r" );
+     if ( list == NULL ) {
+         perror( "fopen" );
+         return 0;
+     }
+     // Read the names up front so answers can be matched back to them
+     char (*names)[101] = NULL;
+     int cnt = 0, cap = 0;
+     char line[256];
+     while ( fgets( line, sizeof( line ), list ) != NULL ) {
+         line[strcspn( line, "\n" )] = '\0';
+         if ( line[0] == '\0' || strlen( line ) > 100 ) {
+             continue;
+         }
+         if ( cnt == cap ) {
+             cap = cap ? cap*2 : 256;
+             char (*grown)[101] = realloc( names, cap*sizeof( *names ) );
+             if ( grown == NULL ) {
+                 perror( "realloc" );
+                 break;
+             }
+             names = grown;
+         }
+         strcpy( names[cnt++], line );
+     }
+     fclose( list );
+
+     char *frame = malloc( 5 + BATCH_NAMES*101 );
+     char *resp = malloc( BATCH_NAMES*10 );
+     int rc = 0, sent = 0, answered = 0, found = 0;
+     if ( frame == NULL || resp == NULL ) {
+         perror( "malloc" );
+         cnt = 0;
+     }
+     while ( answered < cnt ) {
+         // Fill the window, then collect the oldest batch's answers
+         while ( sent < cnt && sent-answered < BATCH_WINDOW*BATCH_NAMES ) {
+             int n = cnt-sent < BATCH_NAMES ? cnt-sent : BATCH_NAMES;
+             int len = 5;
+             frame[0] = 0x05;
+             uint32_t n_net = htonl( ( uint32_t )n );
+             memcpy( frame+1, &n_net, 4 );
+             for ( int i=0; i<n; i++ ) {
+                 int name_len = strlen( names[sent+i] )+1;
+                 memcpy( frame+len, names[sent+i], name_len );
+                 len += name_len;
+             }
+             if ( req_add( sock, frame, len ) == -1 ) {
+                 perror( "send batch SEARCH" );
+                 rc = -1;
+                 goto out;
+             }
+             sent += n;
+         }
+         int n = cnt-answered < BATCH_NAMES ? cnt-answered : BATCH_NAMES;
+         if ( reg_recv( sock, resp, n*10 ) == -1 ) {
+             fprintf( stderr, "Incomplete batch SEARCH response\n" );
+             rc = -1;
+             goto out;
+         }
+         for ( int i=0; i<n; i++ ) {
+             uint32_t id;
+             struct in_addr addr;
+             uint16_t port;
+             memcpy( &id, resp+i*10, 4 );
+             memcpy( &addr, resp+i*10+4, 4 );
+             memcpy( &port, resp+i*10+8, 2 );
+             if ( id == 0 && addr.s_addr == 0 && port == 0 ) {
+                 printf( "%s: not indexed\n", names[answered+i] );
+                 continue;
+             }
+             char ip_str[INET_ADDRSTRLEN];
+             inet_ntop( AF_INET, &addr, ip_str, sizeof( ip_str ) );
+             printf( "%s: Peer %u %s:%u\n", names[answered+i], ntohl( id ), ip_str, ntohs( port ) );
+             found++;
+         }
+         answered += n;
+     }
+     printf( "BATCH resolved %d of %d name(s).\n", found, cnt );
+ out:
+     free( frame );
+     free( resp );
+     free( names );
+     return rc;
+ }
+
  // function used in last program
  int send_data_to_soc(int s, const char *buf, int *len) {
      int tot = 0;
      int bytes_left = *len;
-     int num;
+     int num = 0;
      while (tot < *len) {
          num = send(s, buf + tot, bytes_left, 0);
          if (num == -1)
@@ -387,7 +952,7 @@
  int recv_data_from_soc(int s, char *buf, int *len) {
      int tot = 0;
      int bytes_left = *len;
-     int num;
+     int num = 0;
      while (tot < *len) {
          num = recv(s, buf + tot, bytes_left, 0);
          if (num <= 0)
@@ -0,0 +1,527 @@
+ #define _GNU_SOURCE // accept4()
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <fcntl.h>
+ #include <errno.h>
+ #include <time.h>
+ #include <stdbool.h>
+ #include <signal.h>
+ #include <pthread.h>
+ #include <sys/types.h>
+ #include <sys/stat.h>
+ #include <sys/socket.h>
+ #include <sys/epoll.h>
+ #include <sys/sendfile.h>
+ #include <netinet/in.h>
+ #include "serve.h"
+ #include "p2p.h"
+ #include "crc32c.h"
+
+ #define SERVE_BUF 16384 // file bytes staged per connection on the buffered path
+ #define SERVE_EVENTS 64
+ #define SUMS_CACHE 32   // files whose block checksums are kept between requests
+ #define SERVE_IDLE 60   // seconds a connection may go without an event before it is dropped
+ #define SUMS_SLICE 4     // blocks checksummed per connection per loop turn, 1 MB
+
+ // One peer connection. Every socket is non-blocking and the event loop only touches the
+ // ones that are ready, so a slow downloader never holds up the others. A FETCH ends the
+ // connection; INFO and RANGE replies are length-framed and the next request follows.
+ struct fetch_conn {
+     int sd;
+     int fd;              // file being sent, -1 between requests
+     unsigned char req[17+P2P_MAX_NAME+1]; // longest request: RANGE header + name
+     int req_len;
+     bool answered;       // request complete, now sending the reply
+     bool keep;           // read another request once this reply is out
+     unsigned char *hdr;  // reply header: code, then what the extension carries
+     unsigned char hdr_buf[9]; // hdr points here unless it is a SUMS list
+     int hdr_len, hdr_sent;
+     bool buffered;       // copying through buf instead of sendfile()
+     off_t off, end;      // next file byte to send (or read, when buffered) and where to stop
+     char *buf;           // buffered only: staged data, buf[buf_off..buf_len) not sent yet
+     int buf_off, buf_len;
+     time_t active;       // last event, for dropping idle connections
+     uint32_t *sums;      // SUMS of an uncached file being computed, NULL otherwise
+     uint32_t sums_cnt, sums_done;
+     struct stat sums_st; // the file version they are for
+     struct fetch_conn *prev, *next;
+ };
+
+ static int serve_dir = -1; // SharedFiles, names are opened relative to it
+ static int serve_ep = -1;
+ static bool serve_buffered = false;
+ static int serve_sd = -1;
+ static struct fetch_conn *serve_conns; // every open connection, for the idle sweep
+ static int serve_summing; // connections with sums in progress; the loop then doesn't sleep
+
+ // Block checksums cost a full read of the file, so they are remembered per file version.
+ // Only the server thread touches the cache.
+ struct sums_entry {
+     dev_t dev;
+     ino_t ino;
+     off_t size;
+     struct timespec mtime;
+     uint32_t cnt;
+     uint32_t *sums; // NULL for an unused entry
+ };
+ static struct sums_entry sums_cache[SUMS_CACHE];
+ static int sums_next; // entry replaced next
+
+ static const uint32_t *sums_cached( const struct stat *st, uint32_t *cnt ) {
+     *cnt = ( st->st_size+P2P_BLOCK-1 )/P2P_BLOCK;
+     for ( int i=0; i<SUMS_CACHE; i++ ) {
+         struct sums_entry *e = &sums_cache[i];
+         if ( e->sums != NULL && e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size &&
+              e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec ) {
+             return e->sums;
+         }
+     }
+     return NULL;
+ }
+
+ // Takes over sums, cnt of them, for the file version st.
+ static const uint32_t *sums_store( const struct stat *st, uint32_t *sums, uint32_t cnt ) {
+     struct sums_entry *e = &sums_cache[sums_next];
+     sums_next = ( sums_next+1 )%SUMS_CACHE;
+     free( e->sums );
+     *e = ( struct sums_entry ){ st->st_dev, st->st_ino, st->st_size, st->st_mtim, cnt, sums };
+     return sums;
+ }
+
+ // Sets up a SUMS reply: size, block size and the checksums, or "no such file" if sums is
+ // NULL. Returns -1 if the reply can't be allocated.
+ static int sums_reply( struct fetch_conn *c, const uint32_t *sums, uint32_t cnt, off_t size ) {
+     c->hdr_sent = 0;
+     c->off = c->end = 0;
+     c->keep = true;
+     c->answered = true;
+     if ( sums == NULL ) {
+         c->hdr = c->hdr_buf;
+         c->hdr[0] = P2P_NO_FILE;
+         c->hdr_len = 1;
+         return 0;
+     }
+     unsigned char *h = malloc( 17+( size_t )cnt*4 );
+     if ( h == NULL ) {
+         return -1;
+     }
+     h[0] = P2P_OK;
+     p2p_put64( h+1, size );
+     p2p_put32( h+9, P2P_BLOCK );
+     p2p_put32( h+13, cnt );
+     for ( uint32_t b=0; b<cnt; b++ ) {
+         p2p_put32( h+17+b*4, sums[b] );
+     }
+     c->hdr = h;
+     c->hdr_len = 17+cnt*4;
+     return 0;
+ }
+
+ // Checksums the next SUMS_SLICE blocks of c's file. A whole file at once would stall every
+ // other transfer on this thread for as long as it takes to read, so fetch_loop calls this
+ // once per turn until the list is done, then caches it and sets up the reply.
+ // Returns -1 if the reply can't be allocated.
+ static int sums_step( struct fetch_conn *c ) {
+     char *blk = malloc( P2P_BLOCK );
+     const struct stat *st = &c->sums_st;
+     bool failed = blk == NULL;
+     for ( int i=0; !failed && i<SUMS_SLICE && c->sums_done<c->sums_cnt; i++, c->sums_done++ ) {
+         off_t at = ( off_t )c->sums_done*P2P_BLOCK;
+         size_t want = st->st_size-at < P2P_BLOCK ? ( size_t )( st->st_size-at ) : P2P_BLOCK;
+         failed = pread( c->fd, blk, want, at ) != ( ssize_t )want;
+         if ( !failed ) {
+             c->sums[c->sums_done] = crc32c( 0, blk, want );
+         }
+     }
+     free( blk );
+     if ( !failed && c->sums_done<c->sums_cnt ) {
+         return 0;
+     }
+     serve_summing--;
+     const uint32_t *sums = NULL;
+     if ( failed ) { // file shrank or vanished: answer as if it weren't there
+         free( c->sums );
+         close( c->fd );
+         c->fd = -1;
+     } else {
+         sums = sums_store( st, c->sums, c->sums_cnt );
+     }
+     c->sums = NULL;
+     return sums_reply( c, sums, c->sums_cnt, st->st_size );
+ }
+
+ static void fetch_close( struct fetch_conn *c ) {
+     if ( c->prev != NULL ) {
+         c->prev->next = c->next;
+     } else {
+         serve_conns = c->next;
+     }
+     if ( c->next != NULL ) {
+         c->next->prev = c->prev;
+     }
+     close( c->sd );
+     if ( c->fd >= 0 ) {
+         close( c->fd );
+     }
+     if ( c->hdr != c->hdr_buf ) {
+         free( c->hdr );
+     }
+     if ( c->sums != NULL ) {
+         free( c->sums );
+         serve_summing--;
+     }
+     free( c->buf );
+     free( c );
+ }
+
+ // Opens the requested file for sending. Only plain names inside SharedFiles are served.
+ static int open_shared( const char *name, struct stat *st ) {
+     if ( name[0] == '\0' || strchr( name, '/' ) != NULL || strcmp( name, ".." ) == 0 ) {
+         return -1;
+     }
+     int fd = openat( serve_dir, name, O_RDONLY | O_CLOEXEC );
+     if ( fd >= 0 && ( fstat( fd, st ) == -1 || !S_ISREG( st->st_mode ) ) ) {
+         close( fd );
+         fd = -1;
+     }
+     if ( fd < 0 ) {
+         st->st_size = 0;
+     }
+     return fd;
+ }
+
+ // Bytes before the name in a request, or -1 for an opcode we don't serve.
+ static int req_fixed( unsigned char op ) {
+     return op == P2P_FETCH || op == P2P_INFO || op == P2P_SUMS ? 1 : op == P2P_RANGE ? 17 : -1;
+ }
+
+ // Reads a request as it trickles in and sets up the reply: the response code (0 followed
+ // by the file, or 1 for no such file) plus the size or length the extensions carry.
+ static int fetch_read_request( struct fetch_conn *c ) {
+     int fixed = -1;
+     while ( true ) {
+         if ( c->req_len > 0 && ( fixed = req_fixed( c->req[0] ) ) < 0 ) {
+             return -1;
+         }
+         if ( fixed > 0 && c->req_len > fixed && memchr( c->req+fixed, '\0', c->req_len-fixed ) != NULL ) {
+             break;
+         }
+         if ( c->req_len == sizeof( c->req ) ) {
+             return -1; // name too long
+         }
+         // One byte at a time would be wasteful, but reading past this request would eat the
+         // start of a pipelined one; peek, then consume only up to the terminating NUL.
+         int n = recv( c->sd, c->req+c->req_len, sizeof( c->req )-c->req_len, MSG_PEEK );
+         if ( n < 0 && errno == EINTR ) {
+             continue;
+         }
+         if ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) {
+             return 0;
+         }
+         if ( n <= 0 ) {
+             return -1;
+         }
+         int take = n;
+         fixed = req_fixed( c->req[0] );
+         int from = fixed < 0 ? 0 : fixed > c->req_len ? fixed-c->req_len : 0;
+         unsigned char *nul = from < n ? memchr( c->req+c->req_len+from, '\0', n-from ) : NULL;
+         if ( fixed > 0 && nul != NULL ) {
+             take = nul-( c->req+c->req_len )+1;
+         }
+         if ( recv( c->sd, c->req+c->req_len, take, 0 ) != take ) {
+             return -1;
+         }
+         c->req_len += take;
+     }
+
+     unsigned char op = c->req[0];
+     struct stat st;
+     c->fd = open_shared( ( char * )c->req+fixed, &st );
+     off_t size = st.st_size;
+     if ( c->fd >= 0 && op == P2P_SUMS ) {
+         uint32_t cnt;
+         const uint32_t *sums = sums_cached( &st, &cnt );
+         if ( sums != NULL ) {
+             return sums_reply( c, sums, cnt, size );
+         }
+         // Not seen this version yet: fetch_loop checksums it a slice per turn
+         if ( ( c->sums = malloc( ( cnt+1 )*sizeof( *c->sums ) ) ) == NULL ) {
+             return -1;
+         }
+         c->sums_cnt = cnt;
+         c->sums_done = 0;
+         c->sums_st = st;
+         serve_summing++;
+         return 0;
+     }
+     c->hdr = c->hdr_buf;
+     c->hdr[0] = c->fd >= 0 ? P2P_OK : P2P_NO_FILE;
+     c->hdr_len = 1;
+     c->hdr_sent = 0;
+     c->off = 0;
+     c->end = size;
+     c->keep = op != P2P_FETCH;
+     if ( c->fd >= 0 && op == P2P_INFO ) {
+         p2p_put64( c->hdr+1, size );
+         c->hdr_len = 9;
+         c->end = 0; // no body
+     } else if ( c->fd >= 0 && op == P2P_RANGE ) {
+         uint64_t off = p2p_get64( c->req+1 ), len = p2p_get64( c->req+9 );
+         c->off = off < ( uint64_t )size ? ( off_t )off : size; // clipped to the file
+         c->end = len < ( uint64_t )( size-c->off ) ? c->off+( off_t )len : size;
+         p2p_put64( c->hdr+1, c->end-c->off );
+         c->hdr_len = 9;
+     }
+     c->answered = true;
+     return 0;
+ }
+
+ // Ready for the next request on a kept-alive connection.
+ static void fetch_reset( struct fetch_conn *c ) {
+     if ( c->fd >= 0 ) {
+         close( c->fd );
+     }
+     if ( c->hdr != c->hdr_buf ) {
+         free( c->hdr );
+     }
+     c->hdr = c->hdr_buf;
+     c->fd = -1;
+     c->req_len = 0;
+     c->answered = false;
+     c->buf_off = c->buf_len = 0;
+ }
+
+ // Fallback and benchmark baseline: read() into a user-space buffer, then send() it.
+ static int fetch_send_buffered( struct fetch_conn *c ) {
+     if ( c->buf == NULL && ( c->buf = malloc( SERVE_BUF ) ) == NULL ) {
+         return -1;
+     }
+     while ( true ) {
+         if ( c->buf_off == c->buf_len ) {
+             if ( c->off >= c->end ) {
+                 return 1;
+             }
+             size_t want = c->end-c->off < SERVE_BUF ? ( size_t )( c->end-c->off ) : SERVE_BUF;
+             int n = pread( c->fd, c->buf, want, c->off );
+             if ( n < 0 && errno == EINTR ) {
+                 continue;
+             }
+             if ( n <= 0 ) {
+                 return -1; // file shrank under us and the reply promised more
+             }
+             c->off += n;
+             c->buf_off = 0;
+             c->buf_len = n;
+         }
+         int n = send( c->sd, c->buf+c->buf_off, c->buf_len-c->buf_off, MSG_NOSIGNAL );
+         if ( n < 0 ) {
+             if ( errno == EINTR ) {
+                 continue;
+             }
+             return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+         }
+         c->buf_off += n;
+     }
+ }
+
+ // Sends the reply header, then lets the kernel move the file straight from the page cache
+ // to the socket with sendfile(). Returns 1 when the reply is finished, 0 to wait for
+ // EPOLLOUT, -1 on error.
+ static int fetch_send( struct fetch_conn *c ) {
+     while ( c->hdr_sent < c->hdr_len ) {
+         // MSG_MORE lets the header share a segment with the start of the file
+         int more = c->off < c->end ? MSG_MORE : 0;
+         int n = send( c->sd, c->hdr+c->hdr_sent, c->hdr_len-c->hdr_sent, MSG_NOSIGNAL | more );
+         if ( n < 0 && errno == EINTR ) {
+             continue;
+         }
+         if ( n < 0 ) {
+             return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+         }
+         c->hdr_sent += n;
+     }
+     if ( c->fd < 0 ) {
+         return 1;
+     }
+     if ( c->buffered ) {
+         return fetch_send_buffered( c );
+     }
+     off_t start = c->off;
+     while ( c->off < c->end ) {
+         ssize_t n = sendfile( c->sd, c->fd, &c->off, c->end-c->off );
+         if ( n < 0 ) {
+             if ( errno == EINTR ) {
+                 continue;
+             }
+             if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                 return 0;
+             }
+             if ( ( errno == EINVAL || errno == ENOSYS ) && c->off == start ) {
+                 c->buffered = true; // file system can't sendfile(), copy instead
+                 return fetch_send_buffered( c );
+             }
+             return -1;
+         }
+         if ( n == 0 ) {
+             // File shrank under us. A FETCH just ends early; a framed reply can't.
+             return c->keep ? -1 : 1;
+         }
+     }
+     return 1;
+ }
+
+ static void fetch_accept( void ) {
+     while ( true ) {
+         int sd = accept4( serve_sd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+         if ( sd < 0 ) {
+             if ( errno == EINTR || errno == ECONNABORTED ) {
+                 continue;
+             }
+             return;
+         }
+         struct fetch_conn *c = malloc( sizeof( *c ) );
+         if ( c == NULL ) {
+             close( sd );
+             continue;
+         }
+         c->sd = sd;
+         c->fd = -1;
+         c->buffered = serve_buffered;
+         c->buf = NULL;
+         c->hdr = c->hdr_buf;
+         c->sums = NULL;
+         fetch_reset( c );
+         c->active = time( NULL );
+         c->prev = NULL;
+         c->next = serve_conns;
+         if ( serve_conns != NULL ) {
+             serve_conns->prev = c;
+         }
+         serve_conns = c;
+         struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = c };
+         if ( epoll_ctl( serve_ep, EPOLL_CTL_ADD, sd, &ev ) == -1 ) {
+             fetch_close( c );
+         }
+     }
+ }
+
+ // Closes connections that have gone SERVE_IDLE seconds without an event, whatever they were
+ // doing: sitting between requests, stuck halfway through one, or not reading a reply.
+ // Downloaders pool theirs for less than this, so normally they hang up first.
+ static void fetch_sweep( time_t now ) {
+     struct fetch_conn *next;
+     for ( struct fetch_conn *c = serve_conns; c != NULL; c = next ) {
+         next = c->next;
+         if ( now-c->active > SERVE_IDLE ) {
+             fetch_close( c );
+         }
+     }
+ }
+
+ // Works through c's requests and replies as far as its socket allows, then closes it if it
+ // is finished or failed.
+ static void fetch_run( struct fetch_conn *c, bool err ) {
+     int rc = 0;
+     while ( rc == 0 && c->sums == NULL ) { // while checksumming, only fetch_loop moves c on
+         if ( !c->answered && ( rc = fetch_read_request( c ) ) != 0 ) {
+             break;
+         }
+         if ( !c->answered || ( rc = fetch_send( c ) ) != 1 || !c->keep ) {
+             break; // waiting for the socket or the sums, failed, or a FETCH is over
+         }
+         fetch_reset( c ); // a pipelined request may already be waiting
+         rc = 0;
+     }
+     if ( rc != 0 || err ) {
+         fetch_close( c ); // done, or the downloader went away
+     }
+ }
+
+ static void *fetch_loop( void *arg ) {
+     struct epoll_event evs[SERVE_EVENTS];
+     time_t swept = time( NULL );
+     while ( true ) {
+         int n = epoll_wait( serve_ep, evs, SERVE_EVENTS, serve_summing > 0 ? 0 : 1000 );
+         time_t now = time( NULL );
+         if ( n < 0 ) {
+             if ( errno == EINTR ) {
+                 continue;
+             }
+             perror( "epoll_wait" );
+             return NULL;
+         }
+         for ( int i=0; i<n; i++ ) {
+             struct fetch_conn *c = evs[i].data.ptr;
+             if ( c == NULL ) {
+                 fetch_accept();
+                 continue;
+             }
+             c->active = now;
+             fetch_run( c, evs[i].events & EPOLLERR );
+         }
+         struct fetch_conn *next;
+         for ( struct fetch_conn *c = serve_conns; serve_summing > 0 && c != NULL; c = next ) {
+             next = c->next;
+             if ( c->sums != NULL ) {
+                 c->active = now;
+                 if ( sums_step( c ) == -1 ) {
+                     fetch_close( c );
+                 } else if ( c->sums == NULL ) {
+                     fetch_run( c, false ); // the list is ready, send it
+                 }
+             }
+         }
+         if ( now-swept >= SERVE_IDLE/4 ) { // after the events, which may point at swept ones
+             fetch_sweep( now );
+             swept = now;
+         }
+     }
+     return NULL;
+ }
+
+ void fetch_server_buffered( bool on ) {
+     serve_buffered = on;
+ }
+
+ int fetch_server_start( const char *dir, uint16_t port ) {
+     // sendfile() has no MSG_NOSIGNAL; a downloader vanishing mid-transfer must be an EPIPE,
+     // not the end of this process.
+     signal( SIGPIPE, SIG_IGN );
+     serve_dir = open( dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+     if ( serve_dir < 0 ) {
+         perror( dir );
+         return -1;
+     }
+     serve_sd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+     if ( serve_sd < 0 ) {
+         perror( "socket" );
+         return -1;
+     }
+     int yes = 1;
+     setsockopt( serve_sd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof( yes ) );
+     struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons( port ), .sin_addr.s_addr = htonl( INADDR_ANY ) };
+     socklen_t alen = sizeof( addr );
+     if ( bind( serve_sd, ( struct sockaddr * )&addr, sizeof( addr ) ) == -1 || listen( serve_sd, SOMAXCONN ) == -1 ||
+          getsockname( serve_sd, ( struct sockaddr * )&addr, &alen ) == -1 ) {
+         perror( "FETCH server" );
+         close( serve_sd );
+         return -1;
+     }
+     serve_ep = epoll_create1( EPOLL_CLOEXEC );
+     struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = NULL };
+     if ( serve_ep < 0 || epoll_ctl( serve_ep, EPOLL_CTL_ADD, serve_sd, &ev ) == -1 ) {
+         perror( "epoll" );
+         close( serve_sd );
+         return -1;
+     }
+     pthread_t tid;
+     if ( pthread_create( &tid, NULL, fetch_loop, NULL ) != 0 ) {
+         fprintf( stderr, "FETCH server: could not start thread\n" );
+         close( serve_sd );
+         return -1;
+     }
+     pthread_detach( tid );
+     return ntohs( addr.sin_port );
+ }
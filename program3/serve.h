@@ -0,0 +1,17 @@
+ // FETCH server: answers other peers' FETCH (0x03) requests for files in SharedFiles from a
+ // background thread, so downloads are served while the command loop keeps running.
+ #ifndef SERVE_H
+ #define SERVE_H
+
+ #include <stdint.h>
+ #include <stdbool.h>
+
+ // Starts serving the regular files in dir on port (0 picks a free one). Returns the port
+ // it listens on, or -1 if it could not start.
+ int fetch_server_start( const char *dir, uint16_t port );
+
+ // Serve through a user-space buffer instead of sendfile(). Only fetchbench wants this, to
+ // measure what zero-copy saves; call it before starting the server.
+ void fetch_server_buffered( bool on );
+
+ #endif
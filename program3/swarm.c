@@ -0,0 +1,486 @@
+ #define _GNU_SOURCE // fallocate()
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <fcntl.h>
+ #include <errno.h>
+ #include <stdint.h>
+ #include <stdbool.h>
+ #include <time.h>
+ #include <pthread.h>
+ #include <sys/socket.h>
+ #include <netinet/in.h>
+ #include "swarm.h"
+ #include "p2p.h"
+ #include "download.h"
+ #include "crc32c.h"
+ #include "connpool.h"
+
+ #define SWARM_CHUNK ( 4<<20 )      // range requested at a time
+ #define SWARM_MIN_CHUNK ( 256<<10 ) // small files are split finer so every owner gets some
+ #define PART_MAGIC "P3PART01"       // sidecar: magic, size(8), block(4), count(4), sums, done flags
+ #define PART_HDR 24
+
+ enum { CHUNK_PENDING, CHUNK_ACTIVE, CHUNK_DONE };
+
+ struct swarm_worker { // one owner and the connection to it
+     struct swarm *sw;
+     struct sockaddr_in addr; // from its SEARCH_ALL record
+     int sd;
+     int cur;          // chunk being downloaded, -1 when idle
+     bool cancelled;   // someone else finished cur first
+     char *blk;        // block read back for verification
+     pthread_t tid;
+ };
+
+ struct swarm {
+     pthread_mutex_t mu;
+     pthread_cond_t set_up; // broadcast when the first owner's setup is over
+     bool setting_up;    // a worker is in swarm_prepare(); the rest wait for it
+     const char *name;
+     int fd;             // output file, -1 until the first owner reports the size
+     long long size;     // -1 until known
+     long long chunk;
+     int nchunks, done;
+     int next;           // lowest chunk that may still be pending
+     unsigned char *state;
+     unsigned char *holders; // workers on each chunk: 2 once a slow one is duplicated
+     double *started;
+     bool fatal;         // the output file couldn't be set up
+     uint32_t *sums;     // CRC32C per P2P_BLOCK from the owner, NULL if it sent none
+     uint32_t nblocks;
+     unsigned char *blk_ok; // blocks on disk and verified
+     int part_fd;        // sidecar recording blk_ok, so a later FETCH can resume
+     char part[P2P_MAX_NAME+8];
+     struct swarm_worker *w;
+     int nw;
+ };
+
+ static double now_sec( void ) {
+     struct timespec ts;
+     clock_gettime( CLOCK_MONOTONIC, &ts );
+     return ts.tv_sec + ts.tv_nsec/1e9;
+ }
+
+ static int send_all( int sd, const void *buf, int len ) {
+     const char *p = buf;
+     while ( len > 0 ) {
+         int n = send( sd, p, len, MSG_NOSIGNAL );
+         if ( n < 0 && errno == EINTR ) {
+             continue;
+         }
+         if ( n <= 0 ) {
+             return -1;
+         }
+         p += n;
+         len -= n;
+     }
+     return 0;
+ }
+
+ static int recv_all( int sd, void *buf, int len ) {
+     char *p = buf;
+     while ( len > 0 ) {
+         int n = recv( sd, p, len, 0 );
+         if ( n < 0 && errno == EINTR ) {
+             continue;
+         }
+         if ( n <= 0 ) {
+             return -1;
+         }
+         p += n;
+         len -= n;
+     }
+     return 0;
+ }
+
+ // Asks the owner for the file size. Returns it, or -1 if it doesn't have the file or
+ // doesn't speak the extensions (an old peer just closes on the unknown opcode).
+ static long long owner_info( int sd, const char *name ) {
+     unsigned char req[1+P2P_MAX_NAME+1], resp[9];
+     int len = strlen( name )+1;
+     req[0] = P2P_INFO;
+     memcpy( req+1, name, len );
+     if ( send_all( sd, req, 1+len ) == -1 || recv_all( sd, resp, 1 ) == -1 || resp[0] != P2P_OK ||
+          recv_all( sd, resp+1, 8 ) == -1 ) {
+         return -1;
+     }
+     return ( long long )p2p_get64( resp+1 );
+ }
+
+ // Asks the owner for the block checksums of a file of the given size. Returns 0, or -1 if
+ // it can't send them; the connection is unusable after a failure.
+ static int owner_sums( int sd, struct swarm *sw, long long size ) {
+     unsigned char req[1+P2P_MAX_NAME+1], resp[17];
+     int len = strlen( sw->name )+1;
+     req[0] = P2P_SUMS;
+     memcpy( req+1, sw->name, len );
+     if ( send_all( sd, req, 1+len ) == -1 || recv_all( sd, resp, 1 ) == -1 || resp[0] != P2P_OK ||
+          recv_all( sd, resp+1, 16 ) == -1 ) {
+         return -1;
+     }
+     uint32_t cnt = p2p_get32( resp+13 );
+     if ( ( long long )p2p_get64( resp+1 ) != size || p2p_get32( resp+9 ) != P2P_BLOCK ||
+          cnt != ( size+P2P_BLOCK-1 )/P2P_BLOCK ) {
+         return -1;
+     }
+     unsigned char *raw = malloc( ( size_t )cnt*4+1 );
+     sw->sums = malloc( ( size_t )cnt*4+4 );
+     if ( raw == NULL || sw->sums == NULL || recv_all( sd, raw, cnt*4 ) == -1 ) {
+         free( raw );
+         free( sw->sums );
+         sw->sums = NULL;
+         return -1;
+     }
+     for ( uint32_t b=0; b<cnt; b++ ) {
+         sw->sums[b] = p2p_get32( raw+b*4 );
+     }
+     free( raw );
+     sw->nblocks = cnt;
+     return 0;
+ }
+
+ static size_t block_len( const struct swarm *sw, uint32_t b ) {
+     long long at = ( long long )b*P2P_BLOCK;
+     return sw->size-at < P2P_BLOCK ? ( size_t )( sw->size-at ) : P2P_BLOCK;
+ }
+
+ // Reads block b back from the output file and checks it against the owner's checksum.
+ static bool block_verify( const struct swarm *sw, uint32_t b, char *buf ) {
+     size_t len = block_len( sw, b );
+     return pread( sw->fd, buf, len, ( off_t )b*P2P_BLOCK ) == ( ssize_t )len && crc32c( 0, buf, len ) == sw->sums[b];
+ }
+
+ // Picks up an interrupted download: blocks the sidecar lists as done are kept if they still
+ // match the owner's checksums. A sidecar for another version of the file is discarded.
+ // Returns the number of blocks kept, or -1 if the sidecar can't be written.
+ static long long part_resume( struct swarm *sw, char *buf ) {
+     size_t sums_len = ( size_t )sw->nblocks*4;
+     unsigned char *old = malloc( PART_HDR+sums_len+sw->nblocks+1 );
+     unsigned char *hdr = malloc( PART_HDR+sums_len+1 );
+     sw->blk_ok = calloc( sw->nblocks+1, 1 );
+     if ( old == NULL || hdr == NULL || sw->blk_ok == NULL ) {
+         free( old );
+         free( hdr );
+         return -1;
+     }
+     memcpy( hdr, PART_MAGIC, 8 );
+     p2p_put64( hdr+8, sw->size );
+     p2p_put32( hdr+16, P2P_BLOCK );
+     p2p_put32( hdr+20, sw->nblocks );
+     for ( uint32_t b=0; b<sw->nblocks; b++ ) {
+         p2p_put32( hdr+PART_HDR+b*4, sw->sums[b] );
+     }
+
+     long long kept = 0;
+     size_t whole = PART_HDR+sums_len+sw->nblocks;
+     sw->part_fd = open( sw->part, O_RDWR | O_CREAT | O_CLOEXEC, 0644 );
+     if ( sw->part_fd >= 0 && pread( sw->part_fd, old, whole, 0 ) == ( ssize_t )whole &&
+          memcmp( old, hdr, PART_HDR+sums_len ) == 0 ) {
+         for ( uint32_t b=0; b<sw->nblocks; b++ ) {
+             if ( old[PART_HDR+sums_len+b] && block_verify( sw, b, buf ) ) {
+                 sw->blk_ok[b] = 1;
+                 kept++;
+             }
+         }
+     }
+     free( old );
+     if ( sw->part_fd < 0 || ftruncate( sw->part_fd, 0 ) == -1 ||
+          pwrite( sw->part_fd, hdr, PART_HDR+sums_len, 0 ) != ( ssize_t )( PART_HDR+sums_len ) ||
+          pwrite( sw->part_fd, sw->blk_ok, sw->nblocks, PART_HDR+sums_len ) != ( ssize_t )sw->nblocks ) {
+         perror( sw->part );
+         free( hdr );
+         return -1;
+     }
+     free( hdr );
+     return kept;
+ }
+
+ // Sizes the output file and the chunk table for the first owner to answer, which is also
+ // asked for block checksums; they make the download verifiable and resumable. Runs
+ // without the lock: the other workers wait in swarm_setup() until it is over.
+ static bool swarm_prepare( struct swarm *sw, struct swarm_worker *me, long long size ) {
+     if ( owner_sums( me->sd, sw, size ) == -1 ) {
+         bool reused;
+         close( me->sd ); // an owner without checksums still serves ranges
+         me->sd = connpool_get( &me->addr, &reused );
+     }
+     // Without checksums nothing on disk can be trusted, so start over like a plain FETCH.
+     int trunc = sw->sums == NULL ? O_TRUNC : 0;
+     sw->fd = open( sw->name, O_RDWR | O_CREAT | O_CLOEXEC | trunc, 0644 );
+     if ( sw->fd < 0 ) {
+         perror( "open" );
+         return false;
+     }
+     long long kept = 0;
+     if ( sw->sums != NULL && ( kept = part_resume( sw, me->blk ) ) < 0 ) {
+         return false;
+     }
+     if ( kept > 0 ) {
+         printf( "Resuming %s: %lld of %u blocks already downloaded.\n", sw->name, kept, sw->nblocks );
+     }
+     if ( size > 0 ) {
+         fallocate( sw->fd, 0, 0, size ); // best effort; download_to_fd() writes either way
+     }
+     if ( ftruncate( sw->fd, size ) == -1 ) {
+         perror( "ftruncate" );
+         return false;
+     }
+     long long chunk = SWARM_CHUNK;
+     while ( chunk > SWARM_MIN_CHUNK && size/chunk < sw->nw ) {
+         chunk /= 2;
+     }
+     sw->chunk = chunk;
+     sw->nchunks = ( size+chunk-1 )/chunk;
+     sw->state = calloc( sw->nchunks+1, 1 );
+     sw->holders = calloc( sw->nchunks+1, 1 );
+     sw->started = calloc( sw->nchunks+1, sizeof( double ) );
+     if ( sw->state == NULL || sw->holders == NULL || sw->started == NULL ) {
+         return false;
+     }
+     for ( int k=0; sw->blk_ok != NULL && k<sw->nchunks; k++ ) {
+         uint32_t b = k*( chunk/P2P_BLOCK ), last = ( k+1 )*( chunk/P2P_BLOCK );
+         while ( b < last && b < sw->nblocks && sw->blk_ok[b] ) {
+             b++;
+         }
+         if ( b == last || b == sw->nblocks ) {
+             sw->state[k] = CHUNK_DONE;
+             sw->done++;
+         }
+     }
+     return true;
+ }
+
+ // First owner to answer sets the download up; the rest must agree on the size. Called with
+ // the lock held, which is dropped for the owner round trip and the re-checksumming of a
+ // resumed file.
+ static bool swarm_setup( struct swarm *sw, struct swarm_worker *me, long long size ) {
+     while ( sw->setting_up ) {
+         pthread_cond_wait( &sw->set_up, &sw->mu );
+     }
+     if ( sw->size >= 0 || sw->fatal ) {
+         return !sw->fatal && sw->size == size;
+     }
+     sw->size = size;
+     sw->setting_up = true;
+     pthread_mutex_unlock( &sw->mu );
+     bool ok = swarm_prepare( sw, me, size );
+     pthread_mutex_lock( &sw->mu );
+     sw->fatal = !ok;
+     sw->setting_up = false;
+     pthread_cond_broadcast( &sw->set_up );
+     return ok;
+ }
+
+ // Next chunk for a worker: the lowest pending one, or once none are left, a duplicate of
+ // the chunk that has been running longest on another owner so a slow peer can't hold up
+ // the end of the file. Called with the lock held; returns -1 when there is nothing to do.
+ static int chunk_pick( struct swarm *sw ) {
+     while ( sw->next < sw->nchunks && sw->state[sw->next] != CHUNK_PENDING ) {
+         sw->next++;
+     }
+     int k = sw->next < sw->nchunks ? sw->next : -1;
+     for ( int i=0; k < 0 && i<sw->nchunks; i++ ) {
+         if ( sw->state[i] == CHUNK_ACTIVE && sw->holders[i] == 1 ) {
+             k = i; // endgame: pick the oldest below
+             for ( int j=i+1; j<sw->nchunks; j++ ) {
+                 if ( sw->state[j] == CHUNK_ACTIVE && sw->holders[j] == 1 && sw->started[j] < sw->started[k] ) {
+                     k = j;
+                 }
+             }
+         }
+     }
+     if ( k >= 0 ) {
+         if ( sw->state[k] == CHUNK_PENDING ) {
+             sw->started[k] = now_sec();
+         }
+         sw->state[k] = CHUNK_ACTIVE;
+         sw->holders[k]++;
+     }
+     return k;
+ }
+
+ // Records how a chunk attempt ended. Called with the lock held.
+ static void chunk_finish( struct swarm *sw, struct swarm_worker *me, int k, bool ok ) {
+     sw->holders[k]--;
+     me->cur = -1;
+     if ( ok && sw->state[k] != CHUNK_DONE && sw->blk_ok != NULL ) {
+         // The data went in before the flags do, so a crash leaves at worst unflagged good data.
+         uint32_t first = k*( sw->chunk/P2P_BLOCK ), last = ( k+1 )*( sw->chunk/P2P_BLOCK );
+         last = last < sw->nblocks ? last : sw->nblocks;
+         memset( sw->blk_ok+first, 1, last-first );
+         size_t at = PART_HDR+( size_t )sw->nblocks*4+first;
+         ok = pwrite( sw->part_fd, sw->blk_ok+first, last-first, at ) == ( ssize_t )( last-first );
+     }
+     if ( ok && sw->state[k] != CHUNK_DONE ) {
+         sw->state[k] = CHUNK_DONE;
+         sw->done++;
+         for ( int i=0; i<sw->nw; i++ ) { // cut off the slower copy, if any
+             if ( sw->w[i].cur == k ) {
+                 sw->w[i].cancelled = true;
+                 shutdown( sw->w[i].sd, SHUT_RDWR );
+             }
+         }
+     } else if ( !ok && me->cancelled && sw->state[k] == CHUNK_DONE && sw->sums != NULL ) {
+         // We were the slower copy and may have written into the finished chunk after it was
+         // verified. Honest owners send the same bytes, so this only catches a bad one.
+         uint32_t first = k*( sw->chunk/P2P_BLOCK ), last = ( k+1 )*( sw->chunk/P2P_BLOCK );
+         for ( uint32_t b=first; b<last && b<sw->nblocks; b++ ) {
+             if ( !block_verify( sw, b, me->blk ) ) {
+                 memset( sw->blk_ok+first, 0, ( last < sw->nblocks ? last : sw->nblocks )-first );
+                 sw->state[k] = CHUNK_PENDING;
+                 sw->done--;
+                 sw->next = k < sw->next ? k : sw->next;
+                 break;
+             }
+         }
+     } else if ( !ok && sw->state[k] == CHUNK_ACTIVE && sw->holders[k] == 0 ) {
+         sw->state[k] = CHUNK_PENDING; // hand it to another owner
+         if ( k < sw->next ) {
+             sw->next = k;
+         }
+     }
+ }
+
+ // First block of chunk k that still has to be downloaded. Called with the lock held.
+ static uint32_t chunk_first( const struct swarm *sw, int k ) {
+     uint32_t b = k*( sw->chunk/P2P_BLOCK ), last = ( k+1 )*( sw->chunk/P2P_BLOCK );
+     while ( sw->blk_ok != NULL && b < last && b < sw->nblocks && sw->blk_ok[b] ) {
+         b++;
+     }
+     return b;
+ }
+
+ // Downloads chunk k from block first on over the worker's connection, then checks it
+ // against the owner's checksums. Returns 0 or -1.
+ static int chunk_get( struct swarm_worker *me, int k, uint32_t first ) {
+     struct swarm *sw = me->sw;
+     long long end = ( k+1 )*sw->chunk < sw->size ? ( k+1 )*sw->chunk : sw->size;
+     uint32_t last = ( end+P2P_BLOCK-1 )/P2P_BLOCK;
+     long long off = ( long long )first*P2P_BLOCK;
+     long long len = end-off;
+     unsigned char req[17+P2P_MAX_NAME+1], resp[9];
+     int name_len = strlen( sw->name )+1;
+     req[0] = P2P_RANGE;
+     p2p_put64( req+1, off );
+     p2p_put64( req+9, len );
+     memcpy( req+17, sw->name, name_len );
+     if ( send_all( me->sd, req, 17+name_len ) == -1 || recv_all( me->sd, resp, 1 ) == -1 || resp[0] != P2P_OK ||
+          recv_all( me->sd, resp+1, 8 ) == -1 || ( long long )p2p_get64( resp+1 ) != len ||
+          download_to_fd( me->sd, sw->fd, off, len ) != len ) {
+         return -1;
+     }
+     if ( sw->sums == NULL ) {
+         return 0;
+     }
+     for ( uint32_t b=first; b<last; b++ ) {
+         if ( !block_verify( sw, b, me->blk ) ) {
+             fprintf( stderr, "FETCH: block %u of %s failed its checksum\n", b, sw->name );
+             return -1;
+         }
+     }
+     return 0;
+ }
+
+ static void *swarm_worker( void *arg ) {
+     struct swarm_worker *me = arg;
+     struct swarm *sw = me->sw;
+     // A pooled connection may have been closed by the owner since; then try a fresh one.
+     bool reused = true;
+     int sd = -1;
+     long long size = -1;
+     while ( size < 0 && reused ) {
+         if ( sd >= 0 ) {
+             close( sd );
+         }
+         sd = connpool_get( &me->addr, &reused );
+         size = sd < 0 ? -1 : owner_info( sd, sw->name );
+     }
+
+     pthread_mutex_lock( &sw->mu );
+     me->sd = sd;
+     bool ok = size >= 0 && swarm_setup( sw, me, size ) && me->sd >= 0;
+     sd = me->sd; // setup may have reconnected
+     while ( ok && !me->cancelled ) {
+         int k = chunk_pick( sw );
+         if ( k < 0 ) {
+             break;
+         }
+         me->cur = k;
+         uint32_t first = chunk_first( sw, k );
+         pthread_mutex_unlock( &sw->mu );
+         int rc = chunk_get( me, k, first );
+         pthread_mutex_lock( &sw->mu );
+         chunk_finish( sw, me, k, rc == 0 );
+         ok = rc == 0; // a failed owner is dropped; a cancelled one was the slow copy
+     }
+     bool idle = ok && !me->cancelled; // the last reply was read in full
+     me->sd = -1;
+     pthread_mutex_unlock( &sw->mu );
+     if ( sd >= 0 && idle ) {
+         connpool_put( &me->addr, sd );
+     } else if ( sd >= 0 ) {
+         close( sd );
+     }
+     return NULL;
+ }
+
+ int swarm_fetch( const char *name, const char *owners, int cnt ) {
+     struct swarm sw = { .name = name, .fd = -1, .size = -1, .nw = cnt, .part_fd = -1 };
+     snprintf( sw.part, sizeof( sw.part ), "%s.part", name );
+     sw.w = calloc( cnt, sizeof( *sw.w ) );
+     if ( sw.w == NULL ) {
+         return -1;
+     }
+     pthread_mutex_init( &sw.mu, NULL );
+     pthread_cond_init( &sw.set_up, NULL );
+     int started = 0;
+     for ( int i=0; i<cnt; i++ ) {
+         sw.w[i] = ( struct swarm_worker ){ .sw = &sw, .sd = -1, .cur = -1 };
+         sw.w[i].addr.sin_family = AF_INET;
+         memcpy( &sw.w[i].addr.sin_addr, owners+i*10+4, 4 );
+         memcpy( &sw.w[i].addr.sin_port, owners+i*10+8, 2 );
+     }
+     for ( int i=0; i<cnt; i++ ) {
+         sw.w[i].blk = malloc( P2P_BLOCK );
+         if ( sw.w[i].blk != NULL && pthread_create( &sw.w[i].tid, NULL, swarm_worker, &sw.w[i] ) == 0 ) {
+             started++;
+         } else {
+             sw.w[i].tid = 0;
+         }
+     }
+     for ( int i=0; i<cnt; i++ ) {
+         if ( sw.w[i].tid != 0 ) {
+             pthread_join( sw.w[i].tid, NULL );
+         }
+     }
+
+     int rc = sw.size < 0 && !sw.fatal ? SWARM_UNSUPPORTED : 0;
+     if ( started == 0 || sw.fatal || ( rc == 0 && sw.done < sw.nchunks ) ) {
+         fprintf( stderr, "FETCH: %d of %d chunks of %s downloaded%s\n", sw.done, sw.nchunks, name,
+                  sw.part_fd >= 0 ? "; FETCH it again to resume" : "" );
+         rc = -1;
+     }
+     if ( sw.fd >= 0 ) {
+         close( sw.fd );
+     }
+     if ( sw.part_fd >= 0 ) {
+         close( sw.part_fd );
+         if ( rc == 0 ) {
+             unlink( sw.part ); // complete and verified
+         }
+     }
+     for ( int i=0; i<cnt; i++ ) {
+         free( sw.w[i].blk );
+     }
+     free( sw.sums );
+     free( sw.blk_ok );
+     free( sw.state );
+     free( sw.holders );
+     free( sw.started );
+     free( sw.w );
+     pthread_cond_destroy( &sw.set_up );
+     pthread_mutex_destroy( &sw.mu );
+     return rc;
+ }
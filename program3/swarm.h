@@ -0,0 +1,11 @@
+ // Segmented FETCH: pulls one file from every owner at once, a range at a time.
+ #ifndef SWARM_H
+ #define SWARM_H
+
+ #define SWARM_UNSUPPORTED -2 // no owner answered INFO; fall back to a plain FETCH
+
+ // Downloads name into a file of the same name from the owners of a SEARCH_ALL reply
+ // (cnt 10-byte id/IPv4/port records). Returns 0, -1 on failure, or SWARM_UNSUPPORTED.
+ int swarm_fetch( const char *name, const char *owners, int cnt );
+
+ #endif
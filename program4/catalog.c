@@ -0,0 +1,223 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "catalog.h"
+
+// FNV-1a; names are short, so a byte at a time is plenty.
+uint64_t catalog_hash ( const char *s,size_t len ) {
+    uint64_t h= 0xcbf29ce484222325ULL;
+    for ( size_t i=0; i<len; i++ ) {
+        h ^= ( unsigned char ) s[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Size class for a name of len bytes, or -1 if it is too long to pool.
+static int name_class ( size_t len ) {
+    size_t c= ( sizeof( struct cat_name )+len+1+15 )/16-1;
+    return c<CAT_NAME_CLASSES ? ( int ) c : -1;
+}
+
+static struct cat_name *name_alloc ( struct catalog *cat,size_t len ) {
+    int c= name_class( len );
+    size_t bytes= c<0 ? sizeof( struct cat_name )+len+1 : cat->names[c].size;
+    struct cat_name *n= c<0 ? malloc( bytes ) : pool_get( &cat->names[c] );
+    if ( n ) {
+        cat->bytes += bytes;
+    }
+    return n;
+}
+
+static void name_free ( struct catalog *cat,struct cat_name *n ) {
+    if ( n->owners != &n->one_owner ) {
+        free( n->owners );
+        cat->bytes -= n->owner_cap*sizeof( *n->owners );
+    }
+    int c= name_class( n->len );
+    if ( c<0 ) {
+        cat->bytes -= sizeof( struct cat_name )+n->len+1;
+        free( n );
+    } else {
+        cat->bytes -= cat->names[c].size;
+        pool_put( &cat->names[c],n );
+    }
+}
+
+int catalog_init ( struct catalog *cat,size_t hint ) {
+    size_t cap= 16;
+    while ( cap<hint+hint/3 ) { // keep the load factor under 3/4
+        cap *= 2;
+    }
+    cat->slots= calloc( cap,sizeof( *cat->slots ) );
+    if ( !cat->slots ) {
+        return -1;
+    }
+    cat->cap= cap;
+    cat->cnt= 0;
+    cat->bytes= cap*sizeof( *cat->slots );
+    for ( int c=0; c<CAT_NAME_CLASSES; c++ ) {
+        pool_init( &cat->names[c],( c+1 )*16 );
+    }
+    return 0;
+}
+
+void catalog_free ( struct catalog *cat ) {
+    for ( size_t i=0; i<cat->cap; i++ ) {
+        if ( cat->slots[i].name ) {
+            name_free( cat,cat->slots[i].name );
+        }
+    }
+    for ( int c=0; c<CAT_NAME_CLASSES; c++ ) {
+        pool_destroy( &cat->names[c] );
+    }
+    free( cat->slots );
+    cat->slots= NULL;
+    cat->cap= cat->cnt= 0;
+}
+
+// Linear probe for s; returns its slot, or the empty slot where it would go.
+static size_t probe ( const struct catalog *cat,uint64_t h,const char *s,size_t len ) {
+    size_t mask= cat->cap-1;
+    size_t i= h & mask;
+    while ( cat->slots[i].name ) {
+        struct cat_name *n= cat->slots[i].name;
+        if ( cat->slots[i].hash==h && n->len==len && memcmp( n->str,s,len )==0 ) {
+            break;
+        }
+        i= ( i+1 ) & mask;
+    }
+    return i;
+}
+
+static int grow ( struct catalog *cat ) {
+    struct cat_slot *old= cat->slots;
+    size_t old_cap= cat->cap;
+    struct cat_slot *ns= calloc( old_cap*2,sizeof( *ns ) );
+    if ( !ns ) {
+        return -1;
+    }
+    cat->slots= ns;
+    cat->cap= old_cap*2;
+    cat->bytes += old_cap*sizeof( *ns );
+    size_t mask= cat->cap-1;
+    for ( size_t i=0; i<old_cap; i++ ) {
+        if ( !old[i].name ) {
+            continue;
+        }
+        size_t j= old[i].hash & mask;
+        while ( ns[j].name ) {
+            j= ( j+1 ) & mask;
+        }
+        ns[j]= old[i];
+    }
+    free( old );
+    return 0;
+}
+
+struct cat_name *catalog_find ( const struct catalog *cat,const char *s,size_t len ) {
+    return catalog_find_hashed( cat,s,len,catalog_hash( s,len ) );
+}
+
+struct cat_name *catalog_find_hashed ( const struct catalog *cat,const char *s,size_t len,uint64_t h ) {
+    size_t i= probe( cat,h,s,len );
+    return cat->slots[i].name;
+}
+
+int catalog_add ( struct catalog *cat,struct cat_ref *ref,const char *s,size_t len,void *owner ) {
+    if ( ( cat->cnt+1 )*4>cat->cap*3 && grow( cat )<0 ) {
+        return -1;
+    }
+    uint64_t h= catalog_hash( s,len );
+    size_t i= probe( cat,h,s,len );
+    struct cat_name *n= cat->slots[i].name;
+    if ( !n ) {
+        n= name_alloc( cat,len );
+        if ( !n ) {
+            return -1;
+        }
+        n->hash= h;
+        n->len= len;
+        n->owner_cnt= 0;
+        n->owner_cap= 1;
+        n->rr= 0;
+        n->owners= &n->one_owner;
+        memcpy( n->str,s,len );
+        n->str[len]= '\0';
+        cat->slots[i].hash= h;
+        cat->slots[i].name= n;
+        cat->cnt++;
+    }
+    if ( n->owner_cnt==n->owner_cap ) { // a fresh name always has room, so this never strands one
+        uint32_t cap= n->owner_cap*2;
+        bool inline_list= n->owners==&n->one_owner;
+        struct cat_ref **no= realloc( inline_list ? NULL : n->owners,cap*sizeof( *no ) );
+        if ( !no ) {
+            return -1;
+        }
+        if ( inline_list ) {
+            no[0]= n->one_owner;
+        } else {
+            cat->bytes -= n->owner_cap*sizeof( *no );
+        }
+        cat->bytes += cap*sizeof( *no );
+        n->owners= no;
+        n->owner_cap= cap;
+    }
+    ref->name= n;
+    ref->slot= n->owner_cnt;
+    ref->owner= owner;
+    n->owners[n->owner_cnt++]= ref;
+    return 0;
+}
+
+struct cat_ref *catalog_claim ( const struct cat_name *n,const void *owner ) {
+    for ( uint32_t i=0; i<n->owner_cnt; i++ ) {
+        if ( n->owners[i]->owner==owner ) {
+            return n->owners[i];
+        }
+    }
+    return NULL;
+}
+
+void catalog_moved ( struct cat_ref *ref ) {
+    ref->name->owners[ref->slot]= ref;
+}
+
+void catalog_drop ( struct catalog *cat,struct cat_ref *ref ) {
+    struct cat_name *n= ref->name;
+    if ( n->owner_cnt>0 ) { // move the last owner into the hole
+        struct cat_ref *last= n->owners[--n->owner_cnt];
+        n->owners[ref->slot]= last;
+        last->slot= ref->slot;
+    }
+    ref->name= NULL;
+    if ( n->owner_cnt>0 ) {
+        return;
+    }
+
+    // Last owner gone: remove the name and shift later entries of its probe run back so
+    // lookups never need tombstones.
+    size_t mask= cat->cap-1;
+    size_t i= probe( cat,n->hash,n->str,n->len );
+    name_free( cat,n );
+    cat->cnt--;
+    size_t j= i;
+    while ( true ) {
+        cat->slots[i].name= NULL;
+        while ( true ) {
+            j= ( j+1 ) & mask;
+            if ( !cat->slots[j].name ) {
+                return;
+            }
+            size_t home= cat->slots[j].hash & mask;
+            // slots[j] may fill the hole at i unless its home lies cyclically in (i, j]
+            bool stays= i<=j ? ( i<home && home<=j ) : ( i<home || home<=j );
+            if ( !stays ) {
+                break;
+            }
+        }
+        cat->slots[i]= cat->slots[j];
+        i= j;
+    }
+}
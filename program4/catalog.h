@@ -0,0 +1,68 @@
+// File catalog for the registry: an open-addressing hash table from interned file name to
+// the peers that published it.
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "pool.h"
+
+#define CAT_NAME_CLASSES 16 // names are pooled in 16-byte size classes up to 256 bytes
+
+struct cat_name;
+
+// One owner's claim on a name. The owner keeps one of these per published file and the
+// name points back at it, so either side can be dropped without searching the other.
+struct cat_ref {
+    struct cat_name *name;
+    uint32_t slot; // position in name->owners
+    void *owner;
+};
+
+struct cat_name { // an interned file name, shared by every owner that published it
+    uint64_t hash;
+    struct cat_ref **owners; // points at one_owner until a second owner shows up
+    struct cat_ref *one_owner;
+    uint32_t len;
+    uint32_t owner_cnt, owner_cap;
+    uint32_t rr; // round-robin cursor for handing out owners
+    char str[]; // NUL-terminated
+};
+
+struct cat_slot {
+    uint64_t hash; // copy of name->hash so probes rarely touch the name itself
+    struct cat_name *name; // NULL when the slot is empty
+};
+
+struct catalog {
+    struct cat_slot *slots;
+    size_t cap; // always a power of two
+    size_t cnt; // distinct names
+    size_t bytes; // memory held by the table, names and owner lists
+    struct pool names[CAT_NAME_CLASSES];
+};
+
+uint64_t catalog_hash ( const char *s,size_t len );
+
+int catalog_init ( struct catalog *cat,size_t hint );
+void catalog_free ( struct catalog *cat );
+
+// Returns the interned name, or NULL if nobody published it.
+struct cat_name *catalog_find ( const struct catalog *cat,const char *s,size_t len );
+
+// Same, for a caller that already has catalog_hash( s,len ), e.g. to pick a shard.
+struct cat_name *catalog_find_hashed ( const struct catalog *cat,const char *s,size_t len,uint64_t h );
+
+// Interns s if needed and records owner on it through ref. Returns 0, or -1 if out of memory.
+int catalog_add ( struct catalog *cat,struct cat_ref *ref,const char *s,size_t len,void *owner );
+
+// Withdraws the claim made through ref; the name goes away with its last owner.
+void catalog_drop ( struct catalog *cat,struct cat_ref *ref );
+
+// Returns owner's claim on n, or NULL if owner has not published it. Walks n's owners.
+struct cat_ref *catalog_claim ( const struct cat_name *n,const void *owner );
+
+// Tells the catalog that a claim was moved to ref, e.g. when its owner's list was resized.
+void catalog_moved ( struct cat_ref *ref );
+
+#endif
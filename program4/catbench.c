@@ -0,0 +1,86 @@
+// Microbenchmark: SEARCH lookup latency of the hash catalog against the nested
+// peers x files strcmp scan the registry used before, at growing catalog sizes.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "catalog.h"
+
+#define FILES_PER_PEER 10
+
+struct scan_peer { // the old registry layout: fixed name slots per peer
+    int file_cnt;
+    char files[FILES_PER_PEER][101];
+};
+
+static struct scan_peer *scan_peers;
+static size_t scan_cnt;
+
+struct scan_peer *scan_lookup ( const char *name ) {
+    for ( size_t i=0; i<scan_cnt; i++ ) {
+        for ( int j=0; j<scan_peers[i].file_cnt; j++ ) {
+            if ( strcmp( scan_peers[i].files[j],name )==0 ) {
+                return &scan_peers[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+double now_ns ( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC,&ts );
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+void make_name ( char *buf,size_t i ) {
+    snprintf( buf,101,"shared/media/file-%zu.bin",i );
+}
+
+int main ( int argc,char *argv[] ) {
+    size_t max_files= argc>1 ? strtoul( argv[1],NULL,10 ) : 1000000;
+    srand( 1 );
+    printf( "%10s %14s %14s %10s\n","files","hash ns/op","scan ns/op","speedup" );
+
+    for ( size_t files=1000; files<=max_files; files*=10 ) {
+        size_t peers= ( files+FILES_PER_PEER-1 )/FILES_PER_PEER;
+        struct catalog cat;
+        struct cat_ref *refs= malloc( files*sizeof( *refs ) );
+        scan_peers= calloc( peers,sizeof( *scan_peers ) );
+        if ( !refs || !scan_peers || catalog_init( &cat,0 )<0 ) {
+            perror( "alloc" );
+            return 1;
+        }
+        scan_cnt= peers;
+        char name[101];
+        for ( size_t i=0; i<files; i++ ) {
+            make_name( name,i );
+            struct scan_peer *sp= &scan_peers[i/FILES_PER_PEER];
+            strcpy( sp->files[sp->file_cnt++],name );
+            catalog_add( &cat,&refs[i],name,strlen( name ),sp );
+        }
+
+        // Random hits; scan gets fewer queries since each one walks half the catalog.
+        size_t hash_q= 1000000, scan_q= 20000000/files+10;
+        void * volatile sink; // keeps the lookups from being optimised away
+        double t= now_ns();
+        for ( size_t q=0; q<hash_q; q++ ) {
+            make_name( name,( size_t ) rand()%files );
+            sink= catalog_find( &cat,name,strlen( name ) );
+        }
+        double hash_ns= ( now_ns()-t )/hash_q;
+        t= now_ns();
+        for ( size_t q=0; q<scan_q; q++ ) {
+            make_name( name,( size_t ) rand()%files );
+            sink= scan_lookup( name );
+        }
+        double scan_ns= ( now_ns()-t )/scan_q;
+        ( void ) sink;
+        printf( "%10zu %14.1f %14.1f %9.0fx\n",files,hash_ns,scan_ns,scan_ns/hash_ns );
+
+        catalog_free( &cat );
+        free( refs );
+        free( scan_peers );
+    }
+    return 0;
+}
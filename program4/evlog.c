@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include "evlog.h"
+
+#define EVLOG_OUT ( 64*1024 ) // formatted text is written in chunks of up to this much
+
+// A record in a ring: this header, then slen bytes of NUL-terminated strings, padded to a
+// multiple of 8. A len of 0 marks the unused end of the ring; the next record is at 0.
+struct evlog_rec {
+    uint32_t len;
+    uint32_t slen;
+    const char *fmt;
+    uint32_t arg[3];
+    uint32_t cut; // strings were dropped to fit
+};
+
+// Single producer, single consumer: the owning thread moves head, the flusher moves tail.
+// Both only grow; the position in buf is taken modulo EVLOG_RING.
+struct evlog_ring {
+    _Alignas( 64 ) atomic_size_t head;
+    _Alignas( 64 ) atomic_size_t tail;
+    atomic_ullong dropped;
+    _Alignas( 64 ) unsigned char buf[EVLOG_RING];
+};
+
+int evlog_level= LOG_QUERIES;
+unsigned evlog_sample= 1;
+_Thread_local unsigned evlog_tick;
+
+static _Thread_local struct evlog_ring *mine;
+static _Atomic( struct evlog_ring * ) rings[EVLOG_MAX_THREADS];
+static atomic_int ring_cnt;
+static atomic_int sleeping; // the flusher is blocked on wake_fd, or about to be
+static atomic_int stopping;
+static int wake_fd= -1, out_fd;
+static pthread_t flusher;
+static char out[EVLOG_OUT];
+static size_t out_len;
+
+static void out_write ( const char *p,size_t n ) {
+    while ( n>0 ) {
+        ssize_t w= write( out_fd,p,n );
+        if ( w<0 && errno==EINTR ) {
+            continue;
+        }
+        if ( w<0 ) {
+            return; // nowhere to log to; keep serving
+        }
+        p += w;
+        n -= w;
+    }
+}
+
+static void out_flush ( void ) {
+    out_write( out,out_len );
+    out_len= 0;
+}
+
+static void out_put ( const char *p,size_t n ) {
+    if ( out_len+n>EVLOG_OUT ) {
+        out_flush();
+        if ( n>EVLOG_OUT ) {
+            out_write( p,n );
+            return;
+        }
+    }
+    memcpy( out+out_len,p,n );
+    out_len += n;
+}
+
+// Turns one record back into its line.
+static void format ( const struct evlog_rec *r ) {
+    const char *s= ( const char * ) ( r+1 ), *end= s+r->slen;
+    int argi= 0;
+    char num[INET_ADDRSTRLEN];
+    for ( const char *f= r->fmt; *f; f++ ) {
+        const char *lit= f;
+        while ( *f && *f != '%' ) {
+            f++;
+        }
+        out_put( lit,f-lit );
+        if ( !*f ) {
+            break;
+        }
+        f++;
+        if ( *f=='u' && argi<3 ) {
+            out_put( num,snprintf( num,sizeof( num ),"%u",r->arg[argi++] ) );
+        } else if ( *f=='a' && argi<3 ) {
+            struct in_addr ip= { r->arg[argi++] };
+            inet_ntop( AF_INET,&ip,num,sizeof( num ) );
+            out_put( num,strlen( num ) );
+        } else if ( *f=='s' && s<end ) {
+            size_t n= strlen( s );
+            out_put( s,n );
+            s += n+1;
+        } else if ( *f=='v' ) {
+            for ( ; s<end; s += strlen( s )+1 ) {
+                out_put( " ",1 );
+                out_put( s,strlen( s ) );
+            }
+            if ( r->cut ) {
+                out_put( " ...",4 );
+            }
+        } else if ( *f=='%' ) {
+            out_put( "%",1 );
+        } else if ( !*f ) {
+            break;
+        }
+    }
+}
+
+// Formats everything queued in every ring. Returns the number of records.
+static size_t drain ( void ) {
+    size_t recs= 0;
+    int n= atomic_load( &ring_cnt );
+    for ( int i=0; i<n && i<EVLOG_MAX_THREADS; i++ ) {
+        struct evlog_ring *g= atomic_load( &rings[i] );
+        if ( !g ) {
+            continue;
+        }
+        size_t tail= atomic_load_explicit( &g->tail,memory_order_relaxed );
+        size_t head= atomic_load_explicit( &g->head,memory_order_acquire );
+        while ( tail != head ) {
+            size_t off= tail & ( EVLOG_RING-1 );
+            const struct evlog_rec *r= ( const void * ) ( g->buf+off );
+            if ( r->len==0 ) {
+                tail += EVLOG_RING-off;
+                continue;
+            }
+            format( r );
+            tail += r->len;
+            recs++;
+        }
+        atomic_store_explicit( &g->tail,tail,memory_order_release );
+        unsigned long long lost= atomic_exchange( &g->dropped,0 );
+        if ( lost>0 ) {
+            fprintf( stderr,"LOG dropped %llu records, the flusher fell behind\n",lost );
+        }
+    }
+    out_flush();
+    return recs;
+}
+
+static bool pending ( void ) {
+    int n= atomic_load( &ring_cnt );
+    for ( int i=0; i<n && i<EVLOG_MAX_THREADS; i++ ) {
+        struct evlog_ring *g= atomic_load( &rings[i] );
+        if ( g && atomic_load( &g->head ) != atomic_load( &g->tail ) ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Drains the rings until there is nothing left, then sleeps until a producer wakes it.
+// After a busy round it waits a little first, so a burst becomes one large write.
+static void *flush_loop ( void *arg ) {
+    while ( true ) {
+        if ( atomic_load( &stopping ) ) {
+            drain();
+            return NULL;
+        }
+        if ( drain()>0 ) {
+            usleep( EVLOG_FLUSH_US );
+            continue;
+        }
+        atomic_store( &sleeping,1 );
+        if ( pending() || atomic_load( &stopping ) ) { // logged between the drain and now
+            atomic_store( &sleeping,0 );
+            continue;
+        }
+        uint64_t v;
+        if ( read( wake_fd,&v,sizeof( v ) )<0 && errno != EINTR ) {
+            return NULL;
+        }
+        atomic_store( &sleeping,0 );
+    }
+}
+
+int evlog_start ( int fd,int level,unsigned sample ) {
+    evlog_level= level;
+    evlog_sample= sample;
+    out_fd= fd;
+    if ( level==LOG_OFF ) {
+        return 0;
+    }
+    wake_fd= eventfd( 0,EFD_CLOEXEC );
+    if ( wake_fd<0 || pthread_create( &flusher,NULL,flush_loop,NULL ) != 0 ) {
+        return -1;
+    }
+    return 0;
+}
+
+int evlog_thread ( void ) {
+    if ( evlog_level==LOG_OFF || mine ) {
+        return 0;
+    }
+    int i= atomic_fetch_add( &ring_cnt,1 );
+    if ( i>=EVLOG_MAX_THREADS ) {
+        return -1;
+    }
+    struct evlog_ring *g= aligned_alloc( 64,sizeof( *g ) );
+    if ( !g ) {
+        return -1;
+    }
+    atomic_init( &g->head,0 );
+    atomic_init( &g->tail,0 );
+    atomic_init( &g->dropped,0 );
+    mine= g;
+    atomic_store( &rings[i],g );
+    return 0;
+}
+
+void evlog_put ( const char *fmt,uint32_t a,uint32_t b,uint32_t c,const char *strs,size_t len ) {
+    struct evlog_ring *g= mine;
+    if ( !g ) {
+        return;
+    }
+    uint32_t cut= 0;
+    if ( len>EVLOG_RING/4-sizeof( struct evlog_rec ) ) { // keep the whole strings that fit
+        len= EVLOG_RING/4-sizeof( struct evlog_rec );
+        while ( len>0 && strs[len-1] != '\0' ) {
+            len--;
+        }
+        cut= 1;
+    }
+    size_t need= ( sizeof( struct evlog_rec )+len+7 ) & ~( size_t ) 7;
+    size_t head= atomic_load_explicit( &g->head,memory_order_relaxed );
+    size_t tail= atomic_load_explicit( &g->tail,memory_order_acquire );
+    size_t off= head & ( EVLOG_RING-1 ), skip= 0;
+    if ( need>EVLOG_RING-off ) {
+        skip= EVLOG_RING-off; // does not fit before the end, start over at 0
+    }
+    if ( head+skip+need-tail>EVLOG_RING ) {
+        atomic_fetch_add_explicit( &g->dropped,1,memory_order_relaxed );
+        return;
+    }
+    if ( skip ) {
+        memset( g->buf+off,0,sizeof( uint32_t ) );
+        off= 0;
+    }
+    struct evlog_rec *r= ( void * ) ( g->buf+off );
+    r->len= need;
+    r->slen= len;
+    r->fmt= fmt;
+    r->arg[0]= a;
+    r->arg[1]= b;
+    r->arg[2]= c;
+    r->cut= cut;
+    memcpy( r+1,strs,len );
+    atomic_store( &g->head,head+skip+need ); // seq_cst, paired with the flusher's check of sleeping
+    if ( atomic_load( &sleeping ) && atomic_exchange( &sleeping,0 ) ) {
+        uint64_t one= 1;
+        if ( write( wake_fd,&one,sizeof( one ) )<0 ) {
+            // the counter is already nonzero; the flusher wakes up anyway
+        }
+    }
+}
+
+void evlog_stop ( void ) {
+    if ( wake_fd<0 ) {
+        return;
+    }
+    atomic_store( &stopping,1 );
+    uint64_t one= 1;
+    if ( write( wake_fd,&one,sizeof( one ) )<0 ) {
+        // as above
+    }
+    pthread_join( flusher,NULL );
+}
@@ -0,0 +1,52 @@
+// Asynchronous event log for the registry's "TEST]" lines. A handler only copies a compact
+// record -- a format string that lives forever, three integers and a few strings -- into
+// its own thread's ring, with no lock and no system call. A background thread drains every
+// ring, formats the records and writes them out in large batches.
+//
+// Lines from one thread come out in the order they were logged. Lines from different
+// threads are only ordered to within a flush interval. A record that does not fit in a
+// full ring is dropped and counted rather than waited for.
+#ifndef EVLOG_H
+#define EVLOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define EVLOG_RING ( 1<<20 ) // bytes per thread; records over a quarter of it are cut short
+#define EVLOG_MAX_THREADS 512
+#define EVLOG_FLUSH_US 1000  // how long the flusher lets records pile up once it has work
+
+enum log_level {
+    LOG_OFF= 0,
+    LOG_EVENTS= 1,  // JOIN, REGISTER, PUBLISH: changes to the registry
+    LOG_QUERIES= 2, // the SEARCH family as well, subject to sampling
+};
+
+extern int evlog_level;
+extern unsigned evlog_sample; // log one query in this many
+extern _Thread_local unsigned evlog_tick;
+
+// Cheap check before building a record: is this level on, and is this query sampled.
+static inline bool evlog_want ( enum log_level l ) {
+    if ( l>evlog_level ) {
+        return false;
+    }
+    return l<LOG_QUERIES || evlog_sample<=1 || ++evlog_tick % evlog_sample==0;
+}
+
+// Starts the flusher writing to fd. Returns -1 if the thread could not be started.
+int evlog_start ( int fd,int level,unsigned sample );
+
+// Gives the calling thread a ring of its own; call once before it logs anything.
+int evlog_thread ( void );
+
+// Logs one line. fmt takes %u and %a (an IPv4 address in network order) for a, b and c in
+// turn, %s for the next of the NUL-terminated strings in strs[0..len), and %v for all the
+// remaining strings, each after a space. fmt is kept by pointer, so it must be a literal.
+void evlog_put ( const char *fmt,uint32_t a,uint32_t b,uint32_t c,const char *strs,size_t len );
+
+// Writes out everything logged so far and stops the flusher.
+void evlog_stop ( void );
+
+#endif
@@ -0,0 +1,413 @@
+// Load generator for the registry: simulates N peers, each holding a connection that JOINs
+// and PUBLISHes a synthetic catalog, and keeps a subset of them busy with SEARCH requests.
+// Reports requests/sec and latency percentiles. Run it against builds of registry.c to
+// compare event loops and find a host's capacity.
+//
+// Without -q every busy connection has one SEARCH in flight at a time (closed loop), which
+// finds the peak rate. -q paces the SEARCHes at a fixed total rate instead (open loop),
+// pipelining up to LG_PIPELINE per connection. Latency is then measured from when each
+// SEARCH was due, not when it got sent, so a stalled registry cannot hide its stall by
+// slowing the client down.
+//
+// Names searched are drawn uniformly from everything published: -f names shared through
+// the first peer plus -c names of each peer's own. -m makes that percentage of the
+// searches ask for names nobody has. -j drives the busy connections from several threads,
+// each with its own epoll loop.
+#define _GNU_SOURCE // epoll_pwait2()
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include "metrics.h"
+
+#define LG_FILE "loadgen-%d.bin"      // names published by the first connection for everyone
+#define LG_PEER_FILE "peer%d-%d.bin"  // the per-peer catalogs
+#define LG_MISS_FILE "missing-%u.bin" // what -m searches for
+#define LG_NAME_MAX 32
+#define LG_MAX_THREADS 256
+#define LG_PIPELINE 64 // SEARCHes one connection may have outstanding at a target rate
+
+struct lg_conn {
+    int sd;
+    int got; // bytes of the oldest outstanding 10-byte SEARCH reply received so far
+    unsigned char reply[10];
+    int head, cnt; // ring of the times the outstanding SEARCHes were due
+    uint64_t due[LG_PIPELINE];
+};
+
+struct lg_thread { // one driver thread and the busy connections it owns
+    pthread_t thread;
+    int ep;
+    struct lg_conn **conns;
+    int conn_cnt, rr;
+    uint64_t rng;
+    double rate; // this thread's share of -q, 0 for closed loop
+    long long done, hits, sent;
+    bool stalled; // a due SEARCH found every pipeline full
+    struct hist lat;
+};
+
+static int files= 1, per_peer= 0, miss_pct= 0, total;
+static uint64_t start_ns, end_ns;
+
+uint64_t now_ns ( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC,&ts );
+    return ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+uint64_t next_rand ( uint64_t *s ) {
+    *s ^= *s<<13;
+    *s ^= *s>>7;
+    *s ^= *s<<17;
+    return *s;
+}
+
+int send_all ( int s,const void *buf,int len ) {
+    const char *p= buf;
+    while ( len>0 ) {
+        int n= send( s,p,len,MSG_NOSIGNAL );
+        if ( n<0 ) {
+            if ( errno==EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Writes a SEARCH for a name drawn from the mix into buf and returns the frame length.
+int search_frame ( struct lg_thread *t,unsigned char *buf ) {
+    uint64_t r= next_rand( &t->rng );
+    char *name= ( char * ) buf+1;
+    int n;
+    buf[0]= 0x02;
+    if ( ( int ) ( r % 100 )<miss_pct ) {
+        n= snprintf( name,LG_NAME_MAX,LG_MISS_FILE,( unsigned ) ( r>>32 ) );
+    } else {
+        uint64_t u= ( r>>8 ) % ( files+( uint64_t ) total*per_peer );
+        if ( u<( uint64_t ) files ) {
+            n= snprintf( name,LG_NAME_MAX,LG_FILE,( int ) u );
+        } else {
+            u -= files;
+            n= snprintf( name,LG_NAME_MAX,LG_PEER_FILE,( int ) ( u/per_peer )+1,( int ) ( u % per_peer ) );
+        }
+    }
+    return n+2;
+}
+
+// Sends one SEARCH on c that was due at the given time.
+void search_send ( struct lg_thread *t,struct lg_conn *c,uint64_t due ) {
+    unsigned char frame[LG_NAME_MAX+2];
+    int len= search_frame( t,frame );
+    c->due[( c->head+c->cnt ) % LG_PIPELINE]= due;
+    c->cnt++;
+    if ( send_all( c->sd,frame,len )<0 ) {
+        perror( "send SEARCH" );
+        exit( 1 );
+    }
+}
+
+// Sends the SEARCHes that have come due at t->rate, each on the next connection with room
+// in its pipeline. If every pipeline is full they stay owed, and their latency keeps
+// counting from when they were due.
+void pace ( struct lg_thread *t,uint64_t now ) {
+    while ( t->sent<( now-start_ns )*t->rate/1e9 ) {
+        int k= 0;
+        while ( k<t->conn_cnt && t->conns[( t->rr+k ) % t->conn_cnt]->cnt==LG_PIPELINE ) {
+            k++;
+        }
+        if ( k==t->conn_cnt ) {
+            t->stalled= true;
+            return;
+        }
+        struct lg_conn *c= t->conns[( t->rr+k ) % t->conn_cnt];
+        t->rr= ( t->rr+k+1 ) % t->conn_cnt;
+        search_send( t,c,start_ns+( uint64_t ) ( t->sent*1e9/t->rate ) );
+        t->sent++;
+    }
+}
+
+// Takes in the replies that have arrived on c and times each against when it was due.
+void replies ( struct lg_thread *t,struct lg_conn *c ) {
+    unsigned char buf[64*10];
+    while ( true ) {
+        int r= recv( c->sd,buf,sizeof( buf ),0 );
+        if ( r<0 && errno==EINTR ) {
+            continue;
+        }
+        if ( r<0 && errno==EAGAIN ) {
+            return;
+        }
+        if ( r<=0 ) {
+            fprintf( stderr,"registry closed a connection\n" );
+            exit( 1 );
+        }
+        uint64_t now= now_ns();
+        for ( int off= 0; off<r; ) {
+            int n= r-off<10-c->got ? r-off : 10-c->got;
+            memcpy( c->reply+c->got,buf+off,n );
+            off += n;
+            c->got += n;
+            if ( c->got<10 ) {
+                break;
+            }
+            if ( c->cnt==0 ) {
+                fprintf( stderr,"registry sent a reply nobody asked for\n" );
+                exit( 1 );
+            }
+            c->got= 0;
+            uint64_t due= c->due[c->head];
+            c->head= ( c->head+1 ) % LG_PIPELINE;
+            c->cnt--;
+            if ( now<end_ns ) {
+                hist_add( &t->lat,now-due );
+                t->done++;
+                t->hits += memcmp( c->reply,"\0\0\0\0",4 ) != 0; // owner id 0 means not found
+            }
+            if ( t->rate==0 ) {
+                search_send( t,c,now ); // closed loop: the next one goes out right away
+            }
+        }
+    }
+}
+
+// Keeps the connections registered on t->ep busy until the run ends.
+void *lg_drive ( void *arg ) {
+    struct lg_thread *t= arg;
+    struct epoll_event evs[256];
+    if ( t->rate==0 ) {
+        for ( int k=0; k<t->conn_cnt; k++ ) {
+            search_send( t,t->conns[k],now_ns() );
+        }
+    }
+    for ( uint64_t now= now_ns(); now<end_ns; now= now_ns() ) {
+        struct timespec wait= { .tv_nsec= 100000000 };
+        if ( t->rate>0 ) { // sleep exactly until the next SEARCH is due, so pacing adds no latency
+            pace( t,now );
+            uint64_t next= start_ns+( uint64_t ) ( t->sent*1e9/t->rate );
+            wait.tv_nsec= next>now ? ( next-now<100000000 ? next-now : 100000000 ) : 0;
+            if ( t->stalled && wait.tv_nsec==0 ) {
+                wait.tv_nsec= 100000; // owed but no pipeline has room; wait for replies
+            }
+        }
+        int n= epoll_pwait2( t->ep,evs,256,&wait,NULL );
+        for ( int i=0; i<n; i++ ) {
+            replies( t,evs[i].data.ptr );
+        }
+    }
+    return NULL;
+}
+
+// The PUBLISH frame for peer i: its own catalog, plus the shared names for the first peer.
+unsigned char *publish_frame ( int i,size_t *len ) {
+    uint32_t cnt= per_peer+( i==0 ? files : 0 );
+    unsigned char *pub= malloc( 5+( size_t ) cnt*LG_NAME_MAX );
+    if ( !pub ) {
+        return NULL;
+    }
+    uint32_t cnt_n= htonl( cnt );
+    pub[0]= 0x01;
+    memcpy( pub+1,&cnt_n,4 );
+    *len= 5;
+    for ( int k=0; i==0 && k<files; k++ ) {
+        *len += snprintf( ( char * ) pub+*len,LG_NAME_MAX,LG_FILE,k )+1;
+    }
+    for ( int k=0; k<per_peer; k++ ) {
+        *len += snprintf( ( char * ) pub+*len,LG_NAME_MAX,LG_PEER_FILE,i+1,k )+1;
+    }
+    return pub;
+}
+
+int main ( int argc,char *argv[] ) {
+    int opt, nthreads= 1;
+    double qps= 0;
+    while ( ( opt= getopt( argc,argv,"j:f:c:m:q:" ) ) != -1 ) {
+        if ( opt=='j' && atoi( optarg )>=1 && atoi( optarg )<=LG_MAX_THREADS ) {
+            nthreads= atoi( optarg );
+        } else if ( opt=='f' && atoi( optarg )>=1 ) {
+            files= atoi( optarg );
+        } else if ( opt=='c' && atoi( optarg )>=0 ) {
+            per_peer= atoi( optarg );
+        } else if ( opt=='m' && atoi( optarg )>=0 && atoi( optarg )<=100 ) {
+            miss_pct= atoi( optarg );
+        } else if ( opt=='q' && atof( optarg )>0 ) {
+            qps= atof( optarg );
+        } else {
+            optind= argc;
+            break;
+        }
+    }
+    argc -= optind-1;
+    argv += optind-1;
+    if ( argc<4 || argc>6 ) {
+        fprintf( stderr,"Usage: loadgen [-j threads] [-f shared files] [-c files per peer] [-m miss %%] [-q target req/s]\n"
+                        "               <host> <port> <connections> [active] [seconds]\n" );
+        exit( 1 );
+    }
+    total= atoi( argv[3] );
+    int active= argc>4 ? atoi( argv[4] ) : 64;
+    int secs= argc>5 ? atoi( argv[5] ) : 10;
+    if ( total<1 || active<1 || secs<1 ) {
+        fprintf( stderr,"connections, active and seconds must be positive\n" );
+        exit( 1 );
+    }
+    if ( active>total ) {
+        active= total;
+    }
+
+    struct rlimit rl;
+    if ( getrlimit( RLIMIT_NOFILE,&rl )==0 ) {
+        rl.rlim_cur= rl.rlim_max;
+        setrlimit( RLIMIT_NOFILE,&rl );
+    }
+
+    struct addrinfo hints= { 0 }, *res;
+    hints.ai_family= AF_INET;
+    hints.ai_socktype= SOCK_STREAM;
+    int rc= getaddrinfo( argv[1],argv[2],&hints,&res );
+    if ( rc != 0 ) {
+        fprintf( stderr,"getaddrinfo: %s\n",gai_strerror( rc ) );
+        exit( 1 );
+    }
+
+    struct lg_conn *conns= calloc( total,sizeof( *conns ) );
+    if ( !conns ) {
+        perror( "calloc" );
+        exit( 1 );
+    }
+
+    // Open every connection, JOIN it and PUBLISH its catalog, so the registry holds a real
+    // peer per socket.
+    uint64_t t0= now_ns();
+    uint64_t names= 0;
+    for ( int i=0; i<total; i++ ) {
+        int s= socket( res->ai_family,res->ai_socktype,res->ai_protocol );
+        if ( s<0 || connect( s,res->ai_addr,res->ai_addrlen )<0 ) {
+            fprintf( stderr,"connection %d: %s\n",i,strerror( errno ) );
+            exit( 1 );
+        }
+        unsigned char join[5]= { 0x00 };
+        uint32_t id_n= htonl( ( uint32_t ) i+1 );
+        memcpy( join+1,&id_n,4 );
+        if ( send_all( s,join,sizeof( join ) )<0 ) {
+            perror( "send JOIN" );
+            exit( 1 );
+        }
+        if ( i==0 || per_peer>0 ) {
+            size_t len;
+            unsigned char *pub= publish_frame( i,&len );
+            if ( !pub || send_all( s,pub,len )<0 ) {
+                perror( "send PUBLISH" );
+                exit( 1 );
+            }
+            free( pub );
+            names += per_peer+( i==0 ? files : 0 );
+        }
+        conns[i].sd= s;
+    }
+    freeaddrinfo( res );
+
+    // The registry answers each connection in order, so once every connection's SEARCH
+    // is answered, every catalog is in.
+    struct lg_thread sync= { .rng= 1 };
+    for ( int i=0; i<total; i++ ) {
+        search_send( &sync,&conns[i],0 );
+    }
+    for ( int i=0; i<total; i++ ) {
+        if ( recv( conns[i].sd,conns[i].reply,10,MSG_WAITALL ) != 10 ) {
+            fprintf( stderr,"connection %d: no answer to SEARCH\n",i );
+            exit( 1 );
+        }
+        conns[i].cnt= 0;
+    }
+    printf( "opened %d connections and published %llu names in %.2fs\n",total,( unsigned long long ) names,
+            ( now_ns()-t0 )/1e9 );
+
+    if ( nthreads>active ) {
+        nthreads= active;
+    }
+    struct lg_thread *threads= calloc( nthreads,sizeof( *threads ) );
+    struct lg_conn **busy= calloc( active,sizeof( *busy ) );
+    if ( !threads || !busy ) {
+        perror( "calloc" );
+        exit( 1 );
+    }
+    // Spread the busy connections across the whole descriptor range so a scan-based
+    // server pays for every idle descriptor below the highest active one, and give each
+    // thread a contiguous share of them.
+    int stride= total/active;
+    for ( int k=0; k<active; k++ ) {
+        busy[k]= &conns[total-1-k*stride];
+        fcntl( busy[k]->sd,F_SETFL,fcntl( busy[k]->sd,F_GETFL )|O_NONBLOCK );
+    }
+    for ( int j=0, first= 0; j<nthreads; j++ ) {
+        struct lg_thread *t= &threads[j];
+        t->conns= busy+first;
+        t->conn_cnt= active/nthreads+( j<active % nthreads );
+        first += t->conn_cnt;
+        t->rate= qps*t->conn_cnt/active;
+        t->rng= 0x9e3779b97f4a7c15ull*( j+1 );
+        t->ep= epoll_create1( 0 );
+        if ( t->ep<0 ) {
+            perror( "epoll_create1" );
+            exit( 1 );
+        }
+        for ( int k=0; k<t->conn_cnt; k++ ) {
+            struct epoll_event ev= { .events= EPOLLIN,.data.ptr= t->conns[k] };
+            epoll_ctl( t->ep,EPOLL_CTL_ADD,t->conns[k]->sd,&ev );
+        }
+    }
+
+    start_ns= now_ns();
+    end_ns= start_ns+secs*1000000000ull;
+    for ( int j=0; j<nthreads; j++ ) {
+        if ( pthread_create( &threads[j].thread,NULL,lg_drive,&threads[j] ) != 0 ) {
+            fprintf( stderr,"Could not start thread %d\n",j );
+            exit( 1 );
+        }
+    }
+    long long done= 0, hits= 0;
+    bool stalled= false;
+    static struct hist lat;
+    for ( int j=0; j<nthreads; j++ ) {
+        pthread_join( threads[j].thread,NULL );
+        done += threads[j].done;
+        hits += threads[j].hits;
+        stalled= stalled || threads[j].stalled;
+        hist_merge( &lat,&threads[j].lat );
+        close( threads[j].ep );
+    }
+    double el= ( now_ns()-start_ns )/1e9;
+    printf( "%d connections (%d active, %d threads, %d shared + %d per peer files, %d%% misses): "
+            "%lld searches in %.2fs = %.0f req/s\n",total,active,nthreads,files,per_peer,miss_pct,done,el,done/el );
+    if ( qps>0 ) {
+        printf( "target %.0f req/s, %s\n",qps,stalled ? "fell behind with every pipeline full" : "kept up" );
+    }
+    printf( "latency us: p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f, hits %.1f%%\n",
+            hist_quantile( &lat,0.5 )/1e3,hist_quantile( &lat,0.9 )/1e3,hist_quantile( &lat,0.99 )/1e3,
+            hist_quantile( &lat,0.999 )/1e3,atomic_load( &lat.max )/1e3,done ? 100.0*hits/done : 0.0 );
+
+    for ( int i=0; i<total; i++ ) {
+        close( conns[i].sd );
+    }
+    free( conns );
+    free( busy );
+    free( threads );
+    return 0;
+}
@@ -0,0 +1,98 @@
+#include "metrics.h"
+
+#define RELAXED memory_order_relaxed
+
+// Bucket of v: values below 2^HIST_SUB_BITS get one each, then each power of two is split
+// into 1<<HIST_SUB_BITS equal parts.
+static int hist_index ( uint64_t v ) {
+    if ( v<( 1u<<HIST_SUB_BITS ) ) {
+        return v;
+    }
+    int e= 63-__builtin_clzll( v );
+    int i= ( ( e-HIST_SUB_BITS )<<HIST_SUB_BITS )+( int ) ( v>>( e-HIST_SUB_BITS ) );
+    return i<HIST_BUCKETS ? i : HIST_BUCKETS-1;
+}
+
+// First value past bucket i.
+static uint64_t hist_upper ( int i ) {
+    if ( i<( 1<<HIST_SUB_BITS ) ) {
+        return i+1;
+    }
+    int e= ( i>>HIST_SUB_BITS )+HIST_SUB_BITS-1;
+    uint64_t m= ( i & ( ( 1<<HIST_SUB_BITS )-1 ) )+( 1<<HIST_SUB_BITS );
+    return ( m+1 )<<( e-HIST_SUB_BITS );
+}
+
+static void add ( _Atomic uint64_t *c,uint64_t n ) { // single writer, so no locked instruction
+    atomic_store_explicit( c,atomic_load_explicit( c,RELAXED )+n,RELAXED );
+}
+
+void metrics_record ( struct metrics *m,int op,uint64_t ns ) {
+    hist_add( &m->op[op & ( METRIC_OPS-1 )],ns );
+}
+
+void hist_add ( struct hist *h,uint64_t ns ) {
+    add( &h->bucket[hist_index( ns )],1 );
+    add( &h->sum,ns );
+    if ( ns>atomic_load_explicit( &h->max,RELAXED ) ) {
+        atomic_store_explicit( &h->max,ns,RELAXED );
+    }
+    add( &h->count,1 ); // last, so a reader rarely sees a count without its bucket
+}
+
+void hist_merge ( struct hist *into,const struct hist *h ) {
+    for ( int i=0; i<HIST_BUCKETS; i++ ) {
+        add( &into->bucket[i],atomic_load_explicit( &h->bucket[i],RELAXED ) );
+    }
+    add( &into->sum,atomic_load_explicit( &h->sum,RELAXED ) );
+    add( &into->count,atomic_load_explicit( &h->count,RELAXED ) );
+    uint64_t max= atomic_load_explicit( &h->max,RELAXED );
+    if ( max>atomic_load_explicit( &into->max,RELAXED ) ) {
+        atomic_store_explicit( &into->max,max,RELAXED );
+    }
+}
+
+uint64_t hist_quantile ( const struct hist *h,double q ) {
+    uint64_t total= 0;
+    for ( int i=0; i<HIST_BUCKETS; i++ ) { // count from the buckets, which may be ahead of count
+        total += atomic_load_explicit( &h->bucket[i],RELAXED );
+    }
+    if ( total==0 ) {
+        return 0;
+    }
+    uint64_t rank= q*total;
+    if ( rank<1 ) {
+        rank= 1;
+    }
+    uint64_t seen= 0;
+    for ( int i=0; i<HIST_BUCKETS; i++ ) {
+        seen += atomic_load_explicit( &h->bucket[i],RELAXED );
+        if ( seen>=rank ) {
+            return hist_upper( i );
+        }
+    }
+    return hist_upper( HIST_BUCKETS-1 );
+}
+
+void hist_prom ( FILE *out,const char *name,const char *labels,const struct hist *h ) {
+    static const char *const le[]= { "1e-06","2.5e-06","5e-06","1e-05","2.5e-05","5e-05","0.0001","0.00025",
+                                     "0.0005","0.001","0.0025","0.005","0.01","0.025","0.05","0.1","0.25",
+                                     "0.5","1","2.5","5","10" };
+    static const uint64_t le_ns[]= { 1000,2500,5000,10000,25000,50000,100000,250000,500000,1000000,2500000,
+                                     5000000,10000000,25000000,50000000,100000000,250000000,500000000,
+                                     1000000000,2500000000,5000000000,10000000000 };
+    uint64_t seen= 0, total= 0;
+    int i= 0;
+    for ( size_t k=0; k<sizeof( le_ns )/sizeof( le_ns[0] ); k++ ) {
+        for ( ; i<HIST_BUCKETS && hist_upper( i )<=le_ns[k]; i++ ) {
+            seen += atomic_load_explicit( &h->bucket[i],RELAXED );
+        }
+        fprintf( out,"%s_bucket{%s,le=\"%s\"} %llu\n",name,labels,le[k],( unsigned long long ) seen );
+    }
+    for ( int j=0; j<HIST_BUCKETS; j++ ) {
+        total += atomic_load_explicit( &h->bucket[j],RELAXED );
+    }
+    fprintf( out,"%s_bucket{%s,le=\"+Inf\"} %llu\n",name,labels,( unsigned long long ) total );
+    fprintf( out,"%s_sum{%s} %.9f\n",name,labels,atomic_load_explicit( &h->sum,RELAXED )/1e9 );
+    fprintf( out,"%s_count{%s} %llu\n",name,labels,( unsigned long long ) total );
+}
@@ -0,0 +1,56 @@
+// Request metrics for the registry: per-opcode counters and log-linear latency histograms
+// in the style of HdrHistogram. Every worker thread owns one set and is its only writer,
+// so recording is a plain load and store, with no lock and no read-modify-write. A
+// reader sums all the sets; its view may lag by a request or two.
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// 1<<HIST_SUB_BITS buckets per power of two, so any value is reported within 12.5%.
+// Values are nanoseconds, covered up to 2^40 (about 18 minutes); longer ones land in the
+// last bucket.
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS ( ( 40-HIST_SUB_BITS+1 )<<HIST_SUB_BITS )
+#define METRIC_OPS 16 // indexed by opcode byte
+
+struct hist {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+    _Atomic uint64_t bucket[HIST_BUCKETS];
+};
+
+struct metrics {
+    _Atomic uint64_t accepted;      // connections
+    _Atomic uint64_t closed;
+    _Atomic uint64_t bad_frames;    // connections dropped for breaking the protocol
+    struct hist op[METRIC_OPS];     // request latency, count and total by opcode
+};
+
+// Records one request that took ns nanoseconds. Only the owning thread may call this.
+void metrics_record ( struct metrics *m,int op,uint64_t ns );
+
+// Records one value in h. Only one thread may write to h.
+void hist_add ( struct hist *h,uint64_t ns );
+
+// Bumps a counter of the calling thread's own set.
+static inline void metric_inc ( _Atomic uint64_t *c ) {
+    atomic_store_explicit( c,atomic_load_explicit( c,memory_order_relaxed )+1,memory_order_relaxed );
+}
+
+// Adds h into the private sum into, which nobody else is writing.
+void hist_merge ( struct hist *into,const struct hist *h );
+
+// The value below which a fraction q of the recorded values fall, as the upper bound of the
+// bucket holding it; 0 if nothing was recorded.
+uint64_t hist_quantile ( const struct hist *h,double q );
+
+// Writes h as a Prometheus histogram in seconds: cumulative buckets at fixed bounds from
+// 1 us to 10 s, then _sum and _count. labels goes inside the braces, e.g. op="search".
+// Buckets that straddle a bound are counted toward the next one.
+void hist_prom ( FILE *out,const char *name,const char *labels,const struct hist *h );
+
+#endif
@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "catalog.h"
+#include "persist.h"
+
+#define SNAP_MAGIC "P4SNAP01"
+#define SNAP_HDR 32          // magic, seq, peer count, pad, file count
+#define SNAP_STDIO_BUF ( 1<<20 )
+#define WAL_HDR 5            // payload length, op
+#define WAL_SUM 4            // checksum of op and payload
+
+// Checksum of a record's op and payload: the catalog's FNV-1a, folded to 32 bits.
+static uint32_t wal_sum ( const unsigned char *p,size_t len ) {
+    uint64_t h= catalog_hash( ( const char * ) p,len );
+    return ( uint32_t ) ( h ^ h>>32 );
+}
+
+static void wal_path ( char *out,size_t len,const char *dir,uint64_t seq ) {
+    snprintf( out,len,"%s/wal.%llu",dir,( unsigned long long ) seq );
+}
+
+int wal_open ( struct wal *w,const char *dir,uint64_t seq,bool sync ) {
+    char path[4096];
+    wal_path( path,sizeof( path ),dir,seq );
+    int fd= open( path,O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,0644 );
+    if ( fd<0 ) {
+        return -1;
+    }
+    w->fd= fd;
+    w->dir= dir;
+    w->seq= seq;
+    w->sync= sync;
+    w->len= 0;
+    return 0;
+}
+
+int wal_append ( struct wal *w,enum wal_op op,const void *a,size_t alen,const void *b,size_t blen ) {
+    size_t need= WAL_HDR+alen+blen+WAL_SUM;
+    if ( w->len+need>w->cap ) {
+        size_t cap= w->cap ? w->cap : 4096;
+        while ( cap<w->len+need ) {
+            cap *= 2;
+        }
+        unsigned char *nb= realloc( w->buf,cap );
+        if ( !nb ) {
+            return -1;
+        }
+        w->buf= nb;
+        w->cap= cap;
+    }
+    unsigned char *r= w->buf+w->len;
+    uint32_t plen= alen+blen;
+    memcpy( r,&plen,4 );
+    r[4]= op;
+    memcpy( r+WAL_HDR,a,alen );
+    if ( blen>0 ) {
+        memcpy( r+WAL_HDR+alen,b,blen );
+    }
+    uint32_t sum= wal_sum( r+4,1+plen );
+    memcpy( r+WAL_HDR+plen,&sum,4 );
+    w->len += need;
+    w->bytes += need;
+    return 0;
+}
+
+int wal_flush ( struct wal *w ) {
+    size_t off= 0;
+    while ( off<w->len ) {
+        ssize_t n= write( w->fd,w->buf+off,w->len-off );
+        if ( n<0 ) {
+            if ( errno==EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+        off += n;
+    }
+    if ( w->len>0 && w->sync && fdatasync( w->fd )<0 ) {
+        return -1;
+    }
+    w->len= 0;
+    if ( w->cap>WAL_BUF_KEEP ) { // a huge PUBLISH went through, give the memory back
+        free( w->buf );
+        w->buf= NULL;
+        w->cap= 0;
+    }
+    return 0;
+}
+
+int wal_rotate ( struct wal *w ) {
+    if ( wal_flush( w )<0 ) {
+        return -1;
+    }
+    close( w->fd );
+    w->fd= -1;
+    return wal_open( w,w->dir,w->seq+1,w->sync );
+}
+
+// Maps a whole file read-only. Returns 0, 1 if it does not exist, or -1.
+static int map_file ( const char *path,void **map,size_t *len ) {
+    int fd= open( path,O_RDONLY | O_CLOEXEC );
+    if ( fd<0 ) {
+        return errno==ENOENT ? 1 : -1;
+    }
+    struct stat st;
+    if ( fstat( fd,&st )<0 ) {
+        close( fd );
+        return -1;
+    }
+    *len= st.st_size;
+    *map= NULL;
+    if ( *len>0 ) {
+        *map= mmap( NULL,*len,PROT_READ,MAP_PRIVATE | MAP_POPULATE,fd,0 );
+        if ( *map==MAP_FAILED ) {
+            close( fd );
+            return -1;
+        }
+    }
+    close( fd );
+    return 0;
+}
+
+uint64_t wal_replay ( const char *dir,uint64_t seq,wal_apply_fn apply,void *arg,uint64_t *records ) {
+    for ( ;; seq++ ) {
+        char path[4096];
+        void *map;
+        size_t len;
+        wal_path( path,sizeof( path ),dir,seq );
+        if ( map_file( path,&map,&len ) != 0 ) {
+            return seq;
+        }
+        const unsigned char *p= map;
+        size_t off= 0;
+        while ( len-off>=WAL_HDR+WAL_SUM ) {
+            uint32_t plen, sum;
+            memcpy( &plen,p+off,4 );
+            if ( plen>len-off-WAL_HDR-WAL_SUM ) {
+                break; // torn write at the end of the segment
+            }
+            memcpy( &sum,p+off+WAL_HDR+plen,4 );
+            if ( sum != wal_sum( p+off+4,1+plen ) ) {
+                break;
+            }
+            apply( arg,p[off+4],p+off+WAL_HDR,plen );
+            ( *records )++;
+            off += WAL_HDR+plen+WAL_SUM;
+        }
+        if ( map ) {
+            munmap( map,len );
+        }
+    }
+}
+
+void wal_prune ( const char *dir,uint64_t seq ) {
+    DIR *d= opendir( dir );
+    if ( !d ) {
+        return;
+    }
+    struct dirent *e;
+    while ( ( e= readdir( d ) ) ) {
+        unsigned long long s;
+        char tail;
+        if ( sscanf( e->d_name,"wal.%llu%c",&s,&tail )==1 && s<seq ) {
+            char path[4096];
+            wal_path( path,sizeof( path ),dir,s );
+            unlink( path );
+        }
+    }
+    closedir( d );
+}
+
+FILE *snap_begin ( const char *dir ) {
+    char path[4096];
+    snprintf( path,sizeof( path ),"%s/snapshot.tmp",dir );
+    FILE *f= fopen( path,"w" );
+    if ( !f ) {
+        return NULL;
+    }
+    setvbuf( f,NULL,_IOFBF,SNAP_STDIO_BUF );
+    unsigned char hdr[SNAP_HDR]= { 0 }; // filled in by snap_commit
+    if ( fwrite( hdr,1,SNAP_HDR,f ) != SNAP_HDR ) {
+        fclose( f );
+        return NULL;
+    }
+    return f;
+}
+
+int snap_put_peer ( FILE *f,const struct snap_peer *p ) {
+    return fwrite( p,sizeof( *p ),1,f )==1 ? 0 : -1;
+}
+
+int snap_put_name ( FILE *f,const char *name,size_t len ) {
+    return fwrite( name,1,len+1,f )==len+1 ? 0 : -1;
+}
+
+int snap_commit ( FILE *f,const char *dir,uint64_t seq,uint32_t peer_cnt,uint64_t file_cnt ) {
+    unsigned char hdr[SNAP_HDR]= { 0 };
+    memcpy( hdr,SNAP_MAGIC,8 );
+    memcpy( hdr+8,&seq,8 );
+    memcpy( hdr+16,&peer_cnt,4 );
+    memcpy( hdr+24,&file_cnt,8 );
+    bool ok= fseek( f,0,SEEK_SET )==0 && fwrite( hdr,1,SNAP_HDR,f )==SNAP_HDR && fflush( f )==0 && fsync( fileno( f ) )==0;
+    ok= fclose( f )==0 && ok;
+
+    char tmp[4096], path[4096];
+    snprintf( tmp,sizeof( tmp ),"%s/snapshot.tmp",dir );
+    snprintf( path,sizeof( path ),"%s/snapshot",dir );
+    if ( !ok || rename( tmp,path )<0 ) {
+        unlink( tmp );
+        return -1;
+    }
+    int dfd= open( dir,O_RDONLY | O_DIRECTORY | O_CLOEXEC ); // make the rename itself durable
+    if ( dfd>=0 ) {
+        fsync( dfd );
+        close( dfd );
+    }
+    return 0;
+}
+
+int snap_open ( const char *dir,struct snap_view *v ) {
+    char path[4096];
+    snprintf( path,sizeof( path ),"%s/snapshot",dir );
+    memset( v,0,sizeof( *v ) );
+    int rc= map_file( path,&v->map,&v->len );
+    if ( rc != 0 ) {
+        return rc;
+    }
+    if ( v->len<SNAP_HDR || memcmp( v->map,SNAP_MAGIC,8 ) != 0 ) {
+        snap_close( v );
+        return -1;
+    }
+    const unsigned char *p= v->map;
+    memcpy( &v->seq,p+8,8 );
+    memcpy( &v->peer_cnt,p+16,4 );
+    memcpy( &v->file_cnt,p+24,8 );
+    v->off= SNAP_HDR;
+    return 0;
+}
+
+int snap_next ( struct snap_view *v,struct snap_peer *p,const char **names ) {
+    if ( v->off==v->len ) {
+        return 1;
+    }
+    if ( v->len-v->off<sizeof( *p ) ) {
+        return -1;
+    }
+    memcpy( p,( const char * ) v->map+v->off,sizeof( *p ) );
+    v->off += sizeof( *p );
+    if ( v->len-v->off<p->names_len || p->file_cnt>p->names_len ) {
+        return -1;
+    }
+    *names= ( const char * ) v->map+v->off;
+    if ( p->names_len>0 && ( *names )[p->names_len-1] != '\0' ) {
+        return -1;
+    }
+    v->off += p->names_len;
+    return 0;
+}
+
+void snap_close ( struct snap_view *v ) {
+    if ( v->map ) {
+        munmap( v->map,v->len );
+    }
+    v->map= NULL;
+}
@@ -0,0 +1,97 @@
+// Registry persistence: a compact snapshot of every peer and the files it published, plus
+// an append-only log of the JOIN/PUBLISH/leave events since. A restart maps the snapshot,
+// replays the log after it and is serving again without waiting for peers to re-PUBLISH.
+//
+// Files live in one directory: "snapshot" and log segments "wal.<seq>". A snapshot taken
+// while segment seq is being written covers everything before it, so recovery is the
+// snapshot followed by segments seq, seq+1, ... in order. Both use host byte order; they
+// are meant for restarting on the same machine, not for exchange.
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define WAL_BUF_KEEP ( 64*1024 ) // log buffers up to this size stay allocated between flushes
+
+// Log record types. Peers are named by their slot in the registry's peer table, which
+// replaying the same events in the same order reproduces exactly.
+enum wal_op {
+    WAL_JOIN= 1,    // id, ip, port: a new peer takes the next slot
+    WAL_PUBLISH= 2, // slot, count, NUL-terminated names: replaces the peer's file list
+    WAL_LEAVE= 3,   // slot: the peer is gone and the last slot moves into its place
+    WAL_ADDR= 4,    // slot, ip, port: a restored peer re-joined from a new address
+    WAL_ADD= 5,     // slot, count, names: added to the peer's file list
+    WAL_DEL= 6,     // slot, count, names: taken off the peer's file list
+};
+
+struct wal {
+    int fd;                // current segment, -1 when logging is off
+    const char *dir;
+    uint64_t seq;          // number of the current segment
+    bool sync;             // fdatasync() after every flush
+    unsigned char *buf;    // records not written yet
+    size_t len, cap;
+    uint64_t bytes;        // logged since the last snapshot started
+};
+
+// Opens a new, empty segment seq in dir for appending.
+int wal_open ( struct wal *w,const char *dir,uint64_t seq,bool sync );
+
+// Queues a record; a and b are written back to back as its payload.
+int wal_append ( struct wal *w,enum wal_op op,const void *a,size_t alen,const void *b,size_t blen );
+
+// Writes out the queued records. Returns -1 if the segment could not be written.
+int wal_flush ( struct wal *w );
+
+// Flushes and moves on to segment seq+1, so a snapshot can start at the boundary.
+int wal_rotate ( struct wal *w );
+
+// Replays segments from seq on, calling apply for each intact record until a segment is
+// missing. A record cut short or failing its checksum ends that segment. Returns the
+// number of the first segment that does not exist, where logging should resume.
+typedef void ( *wal_apply_fn ) ( void *arg,enum wal_op op,const unsigned char *data,size_t len );
+uint64_t wal_replay ( const char *dir,uint64_t seq,wal_apply_fn apply,void *arg,uint64_t *records );
+
+// Deletes the segments before seq once a snapshot has made them redundant.
+void wal_prune ( const char *dir,uint64_t seq );
+
+// A peer as stored in the snapshot, followed by file_cnt NUL-terminated names taking
+// names_len bytes in all.
+struct snap_peer {
+    uint32_t id;
+    uint32_t ip;   // network order, as in struct in_addr
+    uint16_t port;
+    uint16_t pad;
+    uint32_t file_cnt;
+    uint32_t names_len;
+};
+
+// Writing: snap_begin, then snap_put_peer and one snap_put_name per file, then
+// snap_commit, which makes the new snapshot replace the old one atomically.
+FILE *snap_begin ( const char *dir );
+int snap_put_peer ( FILE *f,const struct snap_peer *p );
+int snap_put_name ( FILE *f,const char *name,size_t len );
+int snap_commit ( FILE *f,const char *dir,uint64_t seq,uint32_t peer_cnt,uint64_t file_cnt );
+
+// Reading maps the file and walks it in place.
+struct snap_view {
+    void *map;
+    size_t len;
+    uint64_t seq;          // first log segment to replay after it
+    uint32_t peer_cnt;
+    uint64_t file_cnt;
+    size_t off;            // read position
+};
+
+// Returns 0, 1 if there is no snapshot, or -1 if it exists but is unusable.
+int snap_open ( const char *dir,struct snap_view *v );
+
+// Reads the next peer and points names at its names. Returns 0, 1 once every peer was
+// read, or -1 if the file is damaged.
+int snap_next ( struct snap_view *v,struct snap_peer *p,const char **names );
+void snap_close ( struct snap_view *v );
+
+#endif
@@ -0,0 +1,53 @@
+#include <stdlib.h>
+#include "pool.h"
+
+#define SLAB_SIZE ( 64*1024 )
+#define SLAB_HDR 16 // keeps objects 16-byte aligned behind the slab link
+
+void pool_init ( struct pool *p,size_t size ) {
+    p->size= ( size+15 ) & ~( size_t ) 15;
+    p->free= NULL;
+    p->cur= p->end= NULL;
+    p->slabs= NULL;
+    p->slab_bytes= 0;
+    p->used= 0;
+}
+
+void pool_destroy ( struct pool *p ) {
+    while ( p->slabs ) {
+        void *next= *( void ** ) p->slabs;
+        free( p->slabs );
+        p->slabs= next;
+    }
+    pool_init( p,p->size );
+}
+
+void *pool_get ( struct pool *p ) {
+    void *obj= p->free;
+    if ( obj ) {
+        p->free= *( void ** ) obj;
+    } else {
+        if ( ( size_t ) ( p->end-p->cur )<p->size ) {
+            size_t bytes= SLAB_HDR+p->size>SLAB_SIZE ? SLAB_HDR+p->size : SLAB_SIZE;
+            char *slab= malloc( bytes );
+            if ( !slab ) {
+                return NULL;
+            }
+            *( void ** ) slab= p->slabs;
+            p->slabs= slab;
+            p->slab_bytes += bytes;
+            p->cur= slab+SLAB_HDR;
+            p->end= slab+bytes;
+        }
+        obj= p->cur;
+        p->cur += p->size;
+    }
+    p->used++;
+    return obj;
+}
+
+void pool_put ( struct pool *p,void *obj ) {
+    *( void ** ) obj= p->free;
+    p->free= obj;
+    p->used--;
+}
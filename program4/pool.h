@@ -0,0 +1,22 @@
+// Fixed-size object pool: objects are carved out of 64 KB slabs and recycled through a
+// free list, so get and put are O(1) and small objects carry no malloc header.
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+struct pool {
+    size_t size;       // object size, rounded up to 16 bytes
+    void *free;        // objects handed back, linked through their first word
+    char *cur, *end;   // untouched tail of the newest slab
+    void *slabs;       // every slab, linked through its first word
+    size_t slab_bytes; // memory held by the pool
+    size_t used;       // objects currently handed out
+};
+
+void pool_init ( struct pool *p,size_t size );
+void pool_destroy ( struct pool *p ); // frees every slab, including objects still in use
+void *pool_get ( struct pool *p );    // NULL if out of memory
+void pool_put ( struct pool *p,void *obj );
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // accept4()
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -8,45 +9,214 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "catalog.h"
+#include "evlog.h"
+#include "metrics.h"
+#include "persist.h"
+#include "pool.h"
+
+#define MAX_EVENTS 256 // events pulled per epoll_wait() call
+#define MAX_NAME 100 // longest file name, not counting the NUL
+#define MAX_FRAME ( 16<<20 ) // largest request we are willing to buffer for one peer
+#define RBUF_KEEP 4096 // partial-frame buffers up to this size stay allocated between frames
+#define MAX_OWNERS_REPLY 32 // owners listed in one SEARCH_ALL reply
+#define WBUF_HIGH ( 256*1024 ) // stop reading a pipelining client while this much output is queued
+#define SNAP_LOG_BYTES ( 64<<20 ) // start a new snapshot once this much has been logged since the last
+#define REJOIN_GRACE 120 // default seconds restored peers have to JOIN again before they are dropped
+#define CAT_SHARD_BITS 6 // the catalog is split in 1<<CAT_SHARD_BITS shards by the top bits of a name's hash
+#define MAX_THREADS 256
 
 const unsigned char join = 0x00;
 const unsigned char pub = 0x01;
 const unsigned char search = 0x02;
+const unsigned char reg = 0x04; // REGISTER: a JOIN that names the address the peer serves FETCH on
+const unsigned char search_all = 0x06; // like SEARCH, but lists several owners
+const unsigned char search_batch = 0x05; // count + names, answered with one SEARCH record per name
+const unsigned char stats = 0x07; // no arguments; answered with a 4-byte length and Prometheus text
+const unsigned char pub_add = 0x08; // count + names added to the peer's list, no answer
+const unsigned char pub_del = 0x09; // count + names taken off the peer's list, no answer
 
 struct peer_entry {
     uint32_t id;
     int sock;
     struct in_addr ip;
     uint16_t port;
-    int file_cnt;
-    char files[10][101];
+    uint32_t slot;          // index in peers[], so leaving is O(1)
+    uint32_t file_cnt, file_cap;
+    struct cat_ref *files;  // claims on the interned names in the catalog, one per published file
+    _Atomic uint32_t load;  // SEARCH answers that pointed at this peer lately, halved every second
+    _Atomic time_t load_at; // when load was last decayed
+    bool detached;          // restored from disk and not yet claimed by a JOIN with its id
+    struct peer_entry *next_detached;
 };
 
-static struct peer_entry peers[5]; //store up to 5 peers
-static int peer_cnt = 0;
+// How SEARCH chooses among the peers that published a file.
+enum pick_policy {
+    PICK_RR,    // rotate through the owners
+    PICK_LEAST, // owner with the fewest recent assignments
+};
 
-// Used to identify which peer sent a request.
-struct peer_entry *peer_by_socket ( int s ) { // Find peer by socket descriptor
-    for ( int i=0; i<peer_cnt; i++ ) {
-        if ( peers[i].sock== s ) {
-            return &peers[i];
-        }
+// One shard of the file catalog. SEARCH only ever takes the lock of the shard its name
+// hashes to, so lookups of different files on different threads rarely meet.
+struct shard {
+    pthread_mutex_t mu;
+    struct catalog cat; // file name -> peers that published it
+} __attribute__(( aligned( 64 ) ));
+
+// Everything that changes the registry -- JOIN, PUBLISH, leaving, the event log, the
+// detached table and snapshots -- runs under state_mu, so changes are applied and logged
+// in one order. The catalog shards additionally take their own lock for each name.
+static pthread_mutex_t state_mu= PTHREAD_MUTEX_INITIALIZER;
+static struct peer_entry **peers; // grows as peers JOIN; the entries themselves never move
+static uint32_t peer_cnt = 0, peer_cap = 0;
+static struct pool peer_pool;
+static size_t files_bytes; // heap behind peer file lists
+static atomic_size_t buf_bytes; // heap behind connection buffers, on every thread
+static struct shard shards[1<<CAT_SHARD_BITS];
+static atomic_int want_stats; // SIGUSR1 asks for a memory report
+static atomic_int want_exit; // SIGTERM or SIGINT: write out the log and stop
+static sigset_t wait_sigs; // worker 0 takes signals only while it waits, so none slips past housekeeping
+static enum pick_policy pick= PICK_RR;
+static _Thread_local time_t loop_now; // refreshed on every event loop wakeup
+static _Thread_local unsigned rand_seed; // for the two random choices of PICK_LEAST
+static _Thread_local bool logged; // this wakeup appended to the event log
+static struct wal wal= { .fd= -1 }; // log of JOIN/PUBLISH/leave events, when -d names a directory
+static pid_t snap_pid; // child writing a snapshot, 0 if none
+static uint64_t snap_seq; // first log segment the snapshot in progress does not cover
+static volatile sig_atomic_t snap_done; // SIGCHLD: the snapshot child finished
+// Peers restored at startup, hashed by id and chained through next_detached, until a JOIN
+// with the same id adopts them or the grace period ends
+static struct peer_entry **detached;
+static uint32_t detached_mask, detached_cnt;
+static time_t detached_until;
+static int rejoin_grace= REJOIN_GRACE;
+
+// Where the parser is inside the frame at the head of a connection's input.
+enum parse_state {
+    ST_OP,        // waiting for the op byte
+    ST_FIXED,     // JOIN/REGISTER: fixed-size body, frame is need bytes in all
+    ST_COUNT,     // PUBLISH, PUB_ADD/DEL, batch SEARCH: 4 byte name count
+    ST_NAME,      // PUBLISH/SEARCH: NUL-terminated names, names_left still to go
+};
+
+// Per-connection state, hung off the epoll_event so a wakeup goes straight to its connection.
+struct conn {
+    int sd;
+    struct peer_entry *peer; // set once the connection JOINs
+    bool dead;               // a send failed, drop the connection after this wakeup
+    enum parse_state st;
+    size_t scan;             // bytes of the current frame already examined
+    size_t name_at;          // start of the name being scanned
+    size_t need;             // length of a fixed-size frame
+    uint32_t names_left;
+    unsigned char *rbuf;     // partial frame carried over between reads, NULL when idle
+    size_t rlen, rcap;
+    unsigned char *wbuf;     // replies the socket did not take yet
+    size_t wlen, wcap;
+};
+
+// An event loop thread. Each has its own SO_REUSEPORT listening socket, so the kernel
+// spreads new connections over them, and a connection stays on the thread that accepted it.
+struct worker {
+    int id;
+    pthread_t thread;
+    int ep_fd;
+    int listen_sd;
+    struct conn listen_conn; // the listening socket is registered like any other connection
+    struct pool conn_pool;
+    struct metrics metrics;
+};
+
+static struct worker *workers;
+static int worker_cnt= 1;
+static _Thread_local struct worker *self; // the worker running on this thread
+
+static struct shard *shard_for ( uint64_t hash ) {
+    return &shards[hash>>( 64-CAT_SHARD_BITS )];
+}
+
+// For the rare change a SEARCH could see half done in any shard, like a peer's address.
+void shards_lock_all ( void ) {
+    for ( int i=0; i<1<<CAT_SHARD_BITS; i++ ) {
+        pthread_mutex_lock( &shards[i].mu );
     }
-    return NULL;
 }
 
-struct peer_entry *file_lookup ( const char *name ) {  // Searches for a peer that has published a file with the given name.
-    for ( int i=0; i<peer_cnt; i++ ) {
-        for ( int j=0; j<peers[i].file_cnt; j++ ) {
-            if ( strcmp( peers[i].files[j],name ) == 0 ) {
-                return &peers[i];
+void shards_unlock_all ( void ) {
+    for ( int i=( 1<<CAT_SHARD_BITS )-1; i>=0; i-- ) {
+        pthread_mutex_unlock( &shards[i].mu );
+    }
+}
+
+// Workers on different shards pick the same peer at once, so load is only ever changed
+// atomically: the thread that moves load_at forward does the decay, as a compare-and-swap
+// so it cannot lose an increment made meanwhile. Relaxed order is enough for a hint.
+uint32_t peer_load ( struct peer_entry *p ) {
+    time_t at= atomic_load_explicit( &p->load_at,memory_order_relaxed ); // may be a second ahead of our clock
+    if ( at<loop_now && atomic_compare_exchange_strong_explicit( &p->load_at,&at,loop_now,memory_order_relaxed,
+                                                                 memory_order_relaxed ) ) {
+        time_t age= loop_now-at;
+        uint32_t load= atomic_load_explicit( &p->load,memory_order_relaxed ), decayed;
+        do {
+            decayed= age>=32 ? 0 : load>>age;
+        } while ( !atomic_compare_exchange_weak_explicit( &p->load,&load,decayed,memory_order_relaxed,
+                                                          memory_order_relaxed ) );
+    }
+    return atomic_load_explicit( &p->load,memory_order_relaxed );
+}
+
+// Chooses which owner of n the next request goes to and returns its index in n->owners,
+// so repeated SEARCHes for a popular file spread over everyone who has it.
+uint32_t owner_pick ( struct cat_name *n ) {
+    uint32_t i;
+    if ( pick==PICK_RR ) {
+        i= n->rr++ % n->owner_cnt;
+    } else if ( n->owner_cnt<=8 ) {
+        i= 0;
+        for ( uint32_t j=1; j<n->owner_cnt; j++ ) {
+            if ( peer_load( n->owners[j]->owner )<peer_load( n->owners[i]->owner ) ) {
+                i= j;
             }
         }
+    } else { // two random choices: nearly as even as a full scan, O(1) for huge swarms
+        uint32_t a= rand_r( &rand_seed ) % n->owner_cnt, b= rand_r( &rand_seed ) % n->owner_cnt;
+        i= peer_load( n->owners[b]->owner )<peer_load( n->owners[a]->owner ) ? b : a;
     }
-    return NULL;
+    struct peer_entry *p= n->owners[i]->owner;
+    peer_load( p );
+    atomic_fetch_add_explicit( &p->load,1,memory_order_relaxed );
+    return i;
+}
+
+void put_peer ( unsigned char *out,const struct peer_entry *p ) { // 10-byte id/ip/port record
+    uint32_t id_n= htonl( p->id );
+    uint16_t port_n= htons( p->port );
+    memcpy( out,&id_n,4 );
+    memcpy( out+4,&p->ip,4 );
+    memcpy( out+8,&port_n,2 );
+}
+
+void peer_unpublish ( struct peer_entry *p ) { // withdraw everything the peer published
+    for ( uint32_t i=0; i<p->file_cnt; i++ ) {
+        struct shard *sh= shard_for( p->files[i].name->hash );
+        pthread_mutex_lock( &sh->mu );
+        catalog_drop( &sh->cat,&p->files[i] );
+        pthread_mutex_unlock( &sh->mu );
+    }
+    p->file_cnt= 0;
 }
 
-int m_listener ( const char *port ) { // Sets up a TCP socket to listen for peer connections
+int m_listener ( const char *port ) { // Sets up a TCP socket to listen for peer connections; one per worker
     struct addrinfo hints ={ 0 }, *res;
     hints.ai_family =AF_INET;
     hints.ai_socktype =SOCK_STREAM;
@@ -66,6 +236,7 @@ int m_listener ( const char *port ) { // Sets up a TCP socket to listen for peer
 
     int yes= 1;
     setsockopt( s,SOL_SOCKET,SO_REUSEADDR,&yes,sizeof( yes ) );
+    setsockopt( s,SOL_SOCKET,SO_REUSEPORT,&yes,sizeof( yes ) ); // every worker binds the same port
 
     // Bind the socket to the address and port
     if ( bind( s,res->ai_addr,res->ai_addrlen )< 0 ) {
@@ -73,7 +244,7 @@ int m_listener ( const char *port ) { // Sets up a TCP socket to listen for peer
         exit( 1 );
     }
     // listening for incoming TCP connections on the socket
-    if ( listen( s,5 )<0 ) {
+    if ( listen( s,SOMAXCONN )<0 ) {
         perror( "listen" );
         exit( 1 );
     }
@@ -82,177 +253,1219 @@ int m_listener ( const char *port ) { // Sets up a TCP socket to listen for peer
     return s;
 }
 
-void h_join ( int sd ) { // this handles the join request
-    unsigned char buf[4];
-    if ( recv( sd,buf,4,0 ) != 4 ) {
-        return;
+void conn_send ( struct conn *c,const void *buf,size_t len ) { // queue a reply, writing as much as the socket takes now
+    if ( c->wlen==0 ) {
+        while ( len>0 ) {
+            ssize_t n= send( c->sd,buf,len,MSG_NOSIGNAL );
+            if ( n<0 ) {
+                if ( errno==EINTR ) {
+                    continue;
+                }
+                if ( errno!=EAGAIN && errno!=EWOULDBLOCK ) {
+                    c->dead= true; // reset by the peer, the read side will notice and close
+                    return;
+                }
+                break;
+            }
+            buf= ( const char * ) buf+n;
+            len -= n;
+        }
+        if ( len==0 ) {
+            return;
+        }
+    }
+    // Socket buffer is full, keep the rest until EPOLLOUT
+    if ( c->wlen+len>c->wcap ) {
+        size_t cap= c->wcap ? c->wcap : 1024;
+        while ( cap<c->wlen+len ) {
+            cap *= 2;
+        }
+        unsigned char *nb= realloc( c->wbuf,cap );
+        if ( !nb ) {
+            c->dead= true;
+            return;
+        }
+        buf_bytes += cap-c->wcap;
+        c->wbuf= nb;
+        c->wcap= cap;
+    }
+    memcpy( c->wbuf+c->wlen,buf,len );
+    if ( c->wlen==0 ) {
+        struct epoll_event ev= { .events= EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,.data.ptr= c };
+        epoll_ctl( self->ep_fd,EPOLL_CTL_MOD,c->sd,&ev );
     }
+    c->wlen += len;
+}
 
-    uint32_t net_id;
-    memcpy( &net_id,buf,4 );
-    uint32_t id= ntohl( net_id );
+void conn_flush ( struct conn *c ) { // EPOLLOUT: push out whatever conn_send could not
+    size_t off= 0;
+    while ( off<c->wlen ) {
+        ssize_t n= send( c->sd,c->wbuf+off,c->wlen-off,MSG_NOSIGNAL );
+        if ( n<0 ) {
+            if ( errno==EINTR ) {
+                continue;
+            }
+            if ( errno!=EAGAIN && errno!=EWOULDBLOCK ) {
+                c->dead= true;
+            }
+            break;
+        }
+        off += n;
+    }
+    memmove( c->wbuf,c->wbuf+off,c->wlen-off );
+    c->wlen -= off;
+    if ( c->wlen==0 ) {
+        struct epoll_event ev= { .events= EPOLLIN | EPOLLRDHUP | EPOLLET,.data.ptr= c };
+        epoll_ctl( self->ep_fd,EPOLL_CTL_MOD,c->sd,&ev );
+    }
+}
 
-    if ( peer_cnt==5 ) {
-        return; // number of peers reached (the max it can hold)
+// Appends an event to the log, if there is one; state_mu is held. Nothing is logged while
+// the log is being replayed, since it is only opened afterwards.
+void log_event ( enum wal_op op,const void *a,size_t alen,const void *b,size_t blen ) {
+    logged= true;
+    if ( wal.fd>=0 && wal_append( &wal,op,a,alen,b,blen )<0 ) {
+        fprintf( stderr,"Out of memory for the event log, no longer logging\n" );
+        close( wal.fd );
+        wal.fd= -1;
     }
+}
 
-    // Get the IP address and port of the connected peer socket
-    struct sockaddr_in addr;
-    socklen_t alen= sizeof( addr );
-    getpeername( sd,( struct sockaddr * ) &addr,&alen );
-    // Register the new peer
-    struct peer_entry *p = &peers[peer_cnt++];
+// Adds a peer in the next slot of peers[]. Returns NULL if out of memory. This and the
+// other peer_ and detached_ functions run under state_mu.
+struct peer_entry *peer_add ( uint32_t id,struct in_addr ip,uint16_t port ) {
+    if ( peer_cnt==peer_cap ) {
+        uint32_t cap= peer_cap ? peer_cap*2 : 64;
+        struct peer_entry **np= realloc( peers,cap*sizeof( *np ) );
+        if ( !np ) {
+            return NULL;
+        }
+        peers= np;
+        peer_cap= cap;
+    }
+    struct peer_entry *p = pool_get( &peer_pool );
+    if ( !p ) {
+        return NULL;
+    }
+    p->slot= peer_cnt;
+    peers[peer_cnt++]= p;
     p->id= id;
-    p->sock= sd;
-    p->ip= addr.sin_addr;
-    p->port= ntohs( addr.sin_port );
-    p->file_cnt = 0;
+    p->sock= -1;
+    p->ip= ip;
+    p->port= port;
+    p->file_cnt = p->file_cap = 0;
+    p->files= NULL;
+    atomic_store_explicit( &p->load,0,memory_order_relaxed );
+    atomic_store_explicit( &p->load_at,loop_now,memory_order_relaxed );
+    p->detached= false;
 
-    printf( "TEST] JOIN %u\n",id );
-    fflush( stdout );
+    struct snap_peer rec= { .id= id,.ip= ip.s_addr,.port= port };
+    log_event( WAL_JOIN,&rec,sizeof( rec ),NULL,0 );
+    return p;
 }
 
-void h_publish ( int sd ) { // this handles the publish request
-    unsigned char hdr[4];
-    if ( recv( sd,hdr,4,0 ) != 4 ) {
-        return;
+// Replaces p's file list with the cnt NUL-terminated names at names, len bytes in all.
+void peer_publish ( struct peer_entry *p,uint32_t cnt,const char *names,size_t len ) {
+    const char *end= names+len;
+    uint32_t slot_cnt[2]= { p->slot,cnt };
+    peer_unpublish( p ); // a PUBLISH replaces the peer's whole list
+    if ( cnt>p->file_cap || cnt<p->file_cap/4 ) { // size the list to fit, the frame bounds cnt
+        struct cat_ref *nf= realloc( p->files,cnt*sizeof( *nf ) );
+        if ( !nf && cnt>0 ) {
+            slot_cnt[1]= 0; // the old list is gone either way
+            log_event( WAL_PUBLISH,slot_cnt,sizeof( slot_cnt ),NULL,0 );
+            return;
+        }
+        files_bytes += ( cnt-( size_t ) p->file_cap )*sizeof( *nf );
+        p->files= nf;
+        p->file_cap= cnt;
+    }
+    const char *name= names;
+    for ( uint32_t i=0; i<cnt && name<end; i++ ) {
+        size_t n= strlen( name );
+        struct shard *sh= shard_for( catalog_hash( name,n ) );
+        pthread_mutex_lock( &sh->mu );
+        if ( catalog_add( &sh->cat,&p->files[p->file_cnt],name,n,p )==0 ) {
+            p->file_cnt++;
+        }
+        pthread_mutex_unlock( &sh->mu );
+        name += n+1;
     }
+    log_event( WAL_PUBLISH,slot_cnt,sizeof( slot_cnt ),names,name-names );
+}
 
-    uint32_t net_cnt;
-    memcpy( &net_cnt,hdr,4 );
-    uint32_t cnt = ntohl( net_cnt );
+// Makes room for more files in p's list. Growing moves the claims the catalog points at,
+// so every shard is locked while they are moved and re-pointed.
+int peer_reserve ( struct peer_entry *p,uint32_t more ) {
+    if ( p->file_cnt+more<=p->file_cap ) {
+        return 0;
+    }
+    uint32_t cap= p->file_cap ? p->file_cap : 16;
+    while ( cap<p->file_cnt+more ) {
+        cap *= 2;
+    }
+    shards_lock_all();
+    struct cat_ref *nf= realloc( p->files,cap*sizeof( *nf ) );
+    if ( nf ) {
+        for ( uint32_t i=0; i<p->file_cnt; i++ ) {
+            catalog_moved( &nf[i] );
+        }
+        files_bytes += ( cap-( size_t ) p->file_cap )*sizeof( *nf );
+        p->files= nf;
+        p->file_cap= cap;
+    }
+    shards_unlock_all();
+    return nf ? 0 : -1;
+}
 
-    struct peer_entry *p = peer_by_socket( sd ); // Find peer with the given socket
-    if ( !p ||cnt == 0|| cnt>10 ) {
-        return;
+// Adds the cnt names at names to p's list, skipping ones it already published, so the
+// cost follows the size of the change rather than of the list. Returns how many were new.
+uint32_t peer_add_files ( struct peer_entry *p,uint32_t cnt,const char *names,size_t len ) {
+    if ( peer_reserve( p,cnt )<0 ) {
+        return 0;
+    }
+    const char *end= names+len, *name= names;
+    uint32_t added= 0, slot_cnt[2]= { p->slot,cnt };
+    for ( uint32_t i=0; i<cnt && name<end; i++ ) {
+        size_t n= strlen( name );
+        uint64_t h= catalog_hash( name,n );
+        struct shard *sh= shard_for( h );
+        pthread_mutex_lock( &sh->mu );
+        struct cat_name *cn= catalog_find_hashed( &sh->cat,name,n,h );
+        if ( !( cn && catalog_claim( cn,p ) ) && catalog_add( &sh->cat,&p->files[p->file_cnt],name,n,p )==0 ) {
+            p->file_cnt++;
+            added++;
+        }
+        pthread_mutex_unlock( &sh->mu );
+        name += n+1;
     }
+    log_event( WAL_ADD,slot_cnt,sizeof( slot_cnt ),names,name-names );
+    return added;
+}
 
-    p->file_cnt = 0;
-    for ( uint32_t i=0; i<cnt; i++ ) {
-        char name[101];
-        int idx= 0;
-        char ch;
-        while ( idx<101 && recv( sd,&ch,1,0 )==1 ) { // Read characters until null or max length 
-            name[idx++]= ch;
-            if ( ch== '\0' ) {
-                break;
-            }
+// Takes the cnt names at names off p's list; names it never published are ignored.
+// Returns how many were dropped.
+uint32_t peer_del_files ( struct peer_entry *p,uint32_t cnt,const char *names,size_t len ) {
+    const char *end= names+len, *name= names;
+    uint32_t dropped= 0, slot_cnt[2]= { p->slot,cnt };
+    for ( uint32_t i=0; i<cnt && name<end; i++ ) {
+        size_t n= strlen( name );
+        uint64_t h= catalog_hash( name,n );
+        struct shard *sh= shard_for( h );
+        pthread_mutex_lock( &sh->mu );
+        struct cat_name *cn= catalog_find_hashed( &sh->cat,name,n,h );
+        struct cat_ref *ref= cn ? catalog_claim( cn,p ) : NULL;
+        if ( ref ) {
+            catalog_drop( &sh->cat,ref );
+        }
+        pthread_mutex_unlock( &sh->mu );
+        name += n+1;
+        if ( !ref ) {
+            continue;
         }
-        if ( idx== 101 ) { //if the max length was hit then it makes sure the string is null terminated 
-            name[100]= '\0';
+        // Fill the hole with the last claim, which may belong to another shard
+        struct cat_ref *last= &p->files[--p->file_cnt];
+        if ( ref != last ) {
+            struct shard *ls= shard_for( last->name->hash );
+            pthread_mutex_lock( &ls->mu );
+            *ref= *last;
+            catalog_moved( ref );
+            pthread_mutex_unlock( &ls->mu );
         }
-        // Store the file name
-        strncpy( p->files[p->file_cnt++],name,100 );
+        dropped++;
     }
+    log_event( WAL_DEL,slot_cnt,sizeof( slot_cnt ),names,name-names );
+    return dropped;
+}
 
-    printf( "TEST] PUBLISH %d",p->file_cnt );
-    for ( int i=0; i<p->file_cnt; i++ ) {
-        printf(" %s",p->files[i] );
+// Drops p from the detached table; it is known to be there.
+void detached_unlink ( struct peer_entry *p ) {
+    struct peer_entry **link= &detached[( p->id*2654435761u ) & detached_mask];
+    while ( *link != p ) {
+        link= &( *link )->next_detached;
+    }
+    *link= p->next_detached;
+    p->detached= false;
+    if ( --detached_cnt==0 ) {
+        free( detached );
+        detached= NULL;
     }
-    printf( "\n" );
-    fflush( stdout );
 }
 
-void h_search ( int sd ) {  // this handles the search request
-    char fname[101];
-    int idx= 0;
-    char ch;
-    while ( idx<101 && recv( sd,&ch,1,0 )== 1 ) {// Read characters until null or max length 
-        fname[idx++] = ch;
-        if ( ch == '\0' ) {
-            break;
+// Withdraws p and frees it; the last peer moves into its slot.
+void peer_remove ( struct peer_entry *p ) {
+    log_event( WAL_LEAVE,&p->slot,sizeof( p->slot ),NULL,0 );
+    if ( p->detached ) {
+        detached_unlink( p );
+    }
+    peer_unpublish( p );
+    peers[p->slot]= peers[--peer_cnt]; // move the last peer into the hole
+    peers[p->slot]->slot= p->slot;
+    files_bytes -= p->file_cap*sizeof( *p->files );
+    free( p->files );
+    pool_put( &peer_pool,p );
+}
+
+// this handles the join request; a REGISTER passes the address to advertise, a JOIN passes
+// NULL and the peer is reached at the address its registry connection comes from. A peer
+// restored at startup with the same id is taken over, files and all, so it need not
+// PUBLISH again.
+void h_join ( struct conn *c,uint32_t id,const struct in_addr *ip,uint16_t port ) {
+    if ( c->peer ) {
+        return; // already joined
+    }
+
+    // Get the IP address and port of the connected peer socket
+    struct sockaddr_in addr= { 0 };
+    if ( ip ) {
+        addr.sin_addr= *ip;
+        addr.sin_port= htons( port );
+    } else {
+        socklen_t alen= sizeof( addr );
+        getpeername( c->sd,( struct sockaddr * ) &addr,&alen );
+    }
+
+    pthread_mutex_lock( &state_mu );
+    struct peer_entry *p= NULL;
+    if ( detached_cnt>0 ) {
+        for ( p= detached[( id*2654435761u ) & detached_mask]; p && p->id != id; p= p->next_detached ) {
         }
     }
-    if ( idx== 101 ) {
-        fname[100]= '\0';
+    if ( p ) {
+        detached_unlink( p );
+        if ( p->ip.s_addr != addr.sin_addr.s_addr || p->port != ntohs( addr.sin_port ) ) {
+            shards_lock_all(); // searches on other threads may be copying the old address
+            p->ip= addr.sin_addr;
+            p->port= ntohs( addr.sin_port );
+            shards_unlock_all();
+            struct snap_peer rec= { .id= id,.ip= p->ip.s_addr,.port= p->port };
+            log_event( WAL_ADDR,&p->slot,sizeof( p->slot ),&rec,sizeof( rec ) );
+        }
+    } else if ( !( p= peer_add( id,addr.sin_addr,ntohs( addr.sin_port ) ) ) ) {
+        pthread_mutex_unlock( &state_mu );
+        return;
     }
+    // Register the new peer
+    c->peer= p;
+    p->sock= c->sd;
+    pthread_mutex_unlock( &state_mu );
 
-    struct peer_entry *own =file_lookup( fname );
+    if ( !evlog_want( LOG_EVENTS ) ) {
+        return;
+    }
+    if ( ip ) {
+        evlog_put( "TEST] REGISTER %u %a:%u\n",id,ip->s_addr,port,NULL,0 );
+    } else {
+        evlog_put( "TEST] JOIN %u\n",id,0,0,NULL,0 );
+    }
+}
+
+// this handles the publish request; names holds cnt NUL-terminated file names back to back
+void h_publish ( struct conn *c,uint32_t cnt,const char *names,size_t len ) {
+    struct peer_entry *p = c->peer;
+    if ( !p ) {
+        return;
+    }
+
+    pthread_mutex_lock( &state_mu );
+    peer_publish( p,cnt,names,len ); // an empty list clears the peer's files, as on replay
+    uint32_t published= p->file_cnt;
+    pthread_mutex_unlock( &state_mu );
+
+    if ( evlog_want( LOG_EVENTS ) ) {
+        evlog_put( "TEST] PUBLISH %u%v\n",published,0,0,names,len );
+    }
+}
+
+// this handles PUB_ADD and PUB_DEL: like PUBLISH, but only the names that changed
+void h_publish_delta ( struct conn *c,unsigned char op,uint32_t cnt,const char *names,size_t len ) {
+    struct peer_entry *p = c->peer;
+    if ( !p || cnt==0 ) {
+        return;
+    }
+
+    pthread_mutex_lock( &state_mu );
+    uint32_t changed= op==pub_add ? peer_add_files( p,cnt,names,len ) : peer_del_files( p,cnt,names,len );
+    uint32_t published= p->file_cnt;
+    pthread_mutex_unlock( &state_mu );
+
+    if ( evlog_want( LOG_EVENTS ) ) {
+        evlog_put( op==pub_add ? "TEST] PUB_ADD %u %u%v\n" : "TEST] PUB_DEL %u %u%v\n",changed,published,0,names,len );
+    }
+}
+
+void h_search ( struct conn *c,const char *fname ) {  // this handles the search request
+    size_t len= strlen( fname );
+    uint64_t h= catalog_hash( fname,len );
+    struct shard *sh= shard_for( h );
     unsigned char resp[10]= { 0 };
     uint32_t id_h= 0;
     uint16_t port_h= 0;
     struct in_addr ip= { 0 };
 
+    pthread_mutex_lock( &sh->mu ); // the owner stays valid until the shard is unlocked
+    struct cat_name *n= catalog_find_hashed( &sh->cat,fname,len,h );
+    struct peer_entry *own= n ? n->owners[owner_pick( n )]->owner : NULL;
     if ( own ) {
         id_h= own->id;
         port_h= own->port;
         ip= own->ip;
-        uint32_t id_n= htonl( id_h );
-        uint16_t port_n= htons( port_h );
-        memcpy( resp,&id_n,4 );
-        memcpy( resp+4,&ip,4 );
-        memcpy( resp+8,&port_n,2 );
+        put_peer( resp,own );
     }
+    pthread_mutex_unlock( &sh->mu );
     // Send the response to the requesting peer
-    send( sd,resp,10,0 );
-    char ipbuf[INET_ADDRSTRLEN];
-    inet_ntop( AF_INET,&ip,ipbuf,sizeof( ipbuf ) );
-    if ( !own ) {
-        strcpy( ipbuf,"0.0.0.0" );
+    conn_send( c,resp,10 );
+
+    if ( evlog_want( LOG_QUERIES ) ) {
+        evlog_put( "TEST] SEARCH %s %u %a:%u\n",id_h,ip.s_addr,port_h,fname,len+1 );
+    }
+}
+
+// this handles the extended search: a 2-byte owner count, then that many 10-byte records,
+// starting with the owner the policy picked so clients that try them in order spread out
+void h_search_all ( struct conn *c,const char *fname ) {
+    size_t len= strlen( fname );
+    uint64_t h= catalog_hash( fname,len );
+    struct shard *sh= shard_for( h );
+    unsigned char resp[2+MAX_OWNERS_REPLY*10];
+    uint16_t cnt= 0;
+    pthread_mutex_lock( &sh->mu );
+    struct cat_name *n= catalog_find_hashed( &sh->cat,fname,len,h );
+    if ( n ) {
+        uint32_t first= owner_pick( n );
+        cnt= n->owner_cnt<MAX_OWNERS_REPLY ? n->owner_cnt : MAX_OWNERS_REPLY;
+        for ( uint16_t k=0; k<cnt; k++ ) {
+            put_peer( resp+2+k*10,n->owners[( first+k ) % n->owner_cnt]->owner );
+        }
     }
+    pthread_mutex_unlock( &sh->mu );
+    uint16_t cnt_n= htons( cnt );
+    memcpy( resp,&cnt_n,2 );
+    conn_send( c,resp,2+cnt*10 );
 
-    printf("TEST] SEARCH %s %u %s:%u\n",fname,id_h,ipbuf,port_h );
-    fflush( stdout );
+    if ( evlog_want( LOG_QUERIES ) ) {
+        evlog_put( "TEST] SEARCH_ALL %s %u\n",cnt,0,0,fname,len+1 );
+    }
 }
 
-int main ( int argc,char *argv[] ) {
-    if ( argc != 2 ) {
-        fprintf( stderr,"Usage: %s <port>\n",argv[0] );
-        exit( 1 );
+// this handles a batch search: cnt names in, cnt 10-byte records out in the same order,
+// all-zero for names nobody published, written with a single send
+void h_search_batch ( struct conn *c,uint32_t cnt,const char *names ) {
+    unsigned char stackbuf[64*10];
+    unsigned char *resp= cnt<=64 ? stackbuf : malloc( ( size_t ) cnt*10 );
+    if ( !resp ) {
+        c->dead= true; // can't answer, and skipping the reply would desync the client
+        return;
+    }
+    uint32_t hits= 0;
+    for ( uint32_t i=0; i<cnt; i++ ) {
+        size_t len= strlen( names );
+        uint64_t h= catalog_hash( names,len );
+        struct shard *sh= shard_for( h );
+        pthread_mutex_lock( &sh->mu );
+        struct cat_name *n= catalog_find_hashed( &sh->cat,names,len,h );
+        if ( n ) {
+            put_peer( resp+i*10,n->owners[owner_pick( n )]->owner );
+            hits++;
+        } else {
+            memset( resp+i*10,0,10 );
+        }
+        pthread_mutex_unlock( &sh->mu );
+        names += len+1;
+    }
+    conn_send( c,resp,( size_t ) cnt*10 );
+    if ( resp != stackbuf ) {
+        free( resp );
     }
-    int listen_sd = m_listener( argv[1] );
-    fd_set master,readfds;
-    FD_ZERO( &master );
-    FD_SET( listen_sd,&master );
-    int fd_max= listen_sd;
 
+    if ( evlog_want( LOG_QUERIES ) ) {
+        evlog_put( "TEST] SEARCH_BATCH %u %u\n",cnt,hits,0,NULL,0 );
+    }
+}
+
+uint64_t now_ns ( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC,&ts );
+    return ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+// Writes every metric in the Prometheus text format: request counts and latencies by
+// opcode, summed over the workers, then gauges for connections, peers and the catalog.
+void metrics_text ( FILE *out ) {
+    static const char *const op_name[METRIC_OPS]= { "join","publish","search",NULL,"register","search_batch",
+                                                    "search_all","stats","pub_add","pub_del" };
+    static _Thread_local struct hist sum; // big for the stack; cleared for every report
+    uint64_t accepted= 0, closed= 0, bad= 0;
+    for ( int w=0; w<worker_cnt; w++ ) {
+        struct metrics *m= &workers[w].metrics;
+        accepted += atomic_load_explicit( &m->accepted,memory_order_relaxed );
+        closed += atomic_load_explicit( &m->closed,memory_order_relaxed );
+        bad += atomic_load_explicit( &m->bad_frames,memory_order_relaxed );
+    }
+
+    fprintf( out,"# HELP registry_request_duration_seconds Time spent handling a request, by opcode.\n"
+                 "# TYPE registry_request_duration_seconds histogram\n" );
+    uint64_t q[METRIC_OPS][3];
+    for ( int op=0; op<METRIC_OPS; op++ ) {
+        if ( !op_name[op] ) {
+            continue;
+        }
+        memset( &sum,0,sizeof( sum ) );
+        for ( int w=0; w<worker_cnt; w++ ) {
+            hist_merge( &sum,&workers[w].metrics.op[op] );
+        }
+        char labels[32];
+        snprintf( labels,sizeof( labels ),"op=\"%s\"",op_name[op] );
+        hist_prom( out,"registry_request_duration_seconds",labels,&sum );
+        q[op][0]= hist_quantile( &sum,0.5 );
+        q[op][1]= hist_quantile( &sum,0.99 );
+        q[op][2]= hist_quantile( &sum,0.999 );
+    }
+    fprintf( out,"# HELP registry_request_duration_quantile_seconds Request latency quantiles from the histogram, within 12.5%%.\n"
+                 "# TYPE registry_request_duration_quantile_seconds gauge\n" );
+    static const char *const q_name[3]= { "0.5","0.99","0.999" };
+    for ( int op=0; op<METRIC_OPS; op++ ) {
+        for ( int k=0; op_name[op] && k<3; k++ ) {
+            fprintf( out,"registry_request_duration_quantile_seconds{op=\"%s\",quantile=\"%s\"} %.9f\n",
+                     op_name[op],q_name[k],q[op][k]/1e9 );
+        }
+    }
+
+    size_t names= 0, cat_bytes= 0;
+    for ( int i=0; i<1<<CAT_SHARD_BITS; i++ ) {
+        pthread_mutex_lock( &shards[i].mu );
+        names += shards[i].cat.cnt;
+        cat_bytes += shards[i].cat.bytes;
+        pthread_mutex_unlock( &shards[i].mu );
+    }
+    pthread_mutex_lock( &state_mu );
+    uint32_t peers_now= peer_cnt, detached_now= detached_cnt;
+    uint64_t log_bytes= wal.bytes;
+    pthread_mutex_unlock( &state_mu );
+
+    fprintf( out,"# HELP registry_connections_accepted_total Connections accepted.\n"
+                 "# TYPE registry_connections_accepted_total counter\n"
+                 "registry_connections_accepted_total %llu\n"
+                 "# HELP registry_protocol_errors_total Connections dropped for breaking the protocol.\n"
+                 "# TYPE registry_protocol_errors_total counter\n"
+                 "registry_protocol_errors_total %llu\n"
+                 "# HELP registry_connections Connections open.\n"
+                 "# TYPE registry_connections gauge\n"
+                 "registry_connections %llu\n"
+                 "# HELP registry_peers Peers joined, including restored ones not back yet.\n"
+                 "# TYPE registry_peers gauge\n"
+                 "registry_peers %u\n"
+                 "# HELP registry_detached_peers Restored peers that have not joined again.\n"
+                 "# TYPE registry_detached_peers gauge\n"
+                 "registry_detached_peers %u\n"
+                 "# HELP registry_catalog_names Distinct file names published.\n"
+                 "# TYPE registry_catalog_names gauge\n"
+                 "registry_catalog_names %zu\n"
+                 "# HELP registry_catalog_bytes Memory held by the catalog.\n"
+                 "# TYPE registry_catalog_bytes gauge\n"
+                 "registry_catalog_bytes %zu\n"
+                 "# HELP registry_event_log_bytes Event log written since the last snapshot.\n"
+                 "# TYPE registry_event_log_bytes gauge\n"
+                 "registry_event_log_bytes %llu\n"
+                 "# HELP registry_worker_threads Event loop threads.\n"
+                 "# TYPE registry_worker_threads gauge\n"
+                 "registry_worker_threads %d\n",
+             ( unsigned long long ) accepted,( unsigned long long ) bad,( unsigned long long ) ( accepted-closed ),
+             peers_now,detached_now,names,cat_bytes,( unsigned long long ) log_bytes,worker_cnt );
+}
+
+// this handles the stats request: the metrics as text, after their length in 4 bytes
+void h_stats ( struct conn *c ) {
+    char *text= NULL;
+    size_t len= 0;
+    FILE *out= open_memstream( &text,&len );
+    if ( !out ) {
+        c->dead= true; // can't answer, and skipping the reply would desync the client
+        return;
+    }
+    metrics_text( out );
+    if ( fclose( out ) != 0 ) {
+        free( text );
+        c->dead= true;
+        return;
+    }
+    uint32_t len_n= htonl( len );
+    conn_send( c,&len_n,4 );
+    conn_send( c,text,len );
+    free( text );
+}
+
+// Advances the parser over the bytes of the frame at buf[0..len). Returns the frame length
+// once it is complete, 0 if more bytes are needed, or -1 if the peer broke the protocol.
+// Progress is kept in c so bytes that were already examined are not scanned again.
+long frame_parse ( struct conn *c,const unsigned char *buf,size_t len ) {
+    while ( c->scan<len ) {
+        switch ( c->st ) {
+        case ST_OP:
+            if ( buf[0]==join || buf[0]==reg ) {
+                c->st= ST_FIXED;
+                c->need= buf[0]==join ? 5 : 11;
+            } else if ( buf[0]==pub || buf[0]==search_batch || buf[0]==pub_add || buf[0]==pub_del ) {
+                c->st= ST_COUNT;
+            } else if ( buf[0]==search || buf[0]==search_all ) {
+                c->st= ST_NAME;
+                c->names_left= 1;
+            } else if ( buf[0]==stats ) {
+                return 1;
+            } else {
+                return -1;
+            }
+            c->scan= c->name_at= 1;
+            break;
+        case ST_FIXED:
+            if ( len<c->need ) {
+                c->scan= len;
+                return 0;
+            }
+            return c->need;
+        case ST_COUNT: {
+            if ( len<5 ) {
+                c->scan= len;
+                return 0;
+            }
+            uint32_t net_cnt;
+            memcpy( &net_cnt,buf+1,4 );
+            c->names_left= ntohl( net_cnt );
+            if ( c->names_left>MAX_FRAME/2 ) { // every name takes at least two bytes
+                return -1;
+            }
+            if ( c->names_left==0 ) {
+                return 5;
+            }
+            c->st= ST_NAME;
+            c->scan= c->name_at= 5;
+            break;
+        }
+        case ST_NAME: {
+            const unsigned char *nul= memchr( buf+c->scan,'\0',len-c->scan );
+            if ( !nul ) {
+                if ( len-c->name_at>MAX_NAME ) {
+                    return -1; // name too long to be a file name
+                }
+                c->scan= len;
+                return 0;
+            }
+            size_t end= nul-buf;
+            if ( end-c->name_at>MAX_NAME ) {
+                return -1;
+            }
+            c->scan= c->name_at= end+1;
+            if ( --c->names_left==0 ) {
+                return c->scan;
+            }
+            break;
+        }
+        }
+        if ( c->scan>MAX_FRAME ) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void frame_dispatch ( struct conn *c,const unsigned char *buf,size_t len ) { // run the handler for a complete frame
+    uint32_t net;
+    uint64_t t0= now_ns();
+    if ( buf[0]==join ) {
+        memcpy( &net,buf+1,4 );
+        h_join( c,ntohl( net ),NULL,0 ); //handles join request
+    } else if ( buf[0]==reg ) {
+        struct in_addr ip;
+        uint16_t port_n;
+        memcpy( &net,buf+1,4 );
+        memcpy( &ip,buf+5,4 );
+        memcpy( &port_n,buf+9,2 );
+        h_join( c,ntohl( net ),&ip,ntohs( port_n ) );
+    } else if ( buf[0]==pub ) {
+        memcpy( &net,buf+1,4 );
+        h_publish( c,ntohl( net ),( const char * ) buf+5,len-5 );  //handles publish request
+    } else if ( buf[0]==search ) {
+        h_search( c,( const char * ) buf+1 ); //handles search request
+    } else if ( buf[0]==search_batch ) {
+        memcpy( &net,buf+1,4 );
+        h_search_batch( c,ntohl( net ),( const char * ) buf+5 );
+    } else if ( buf[0]==stats ) {
+        h_stats( c );
+    } else if ( buf[0]==pub_add || buf[0]==pub_del ) {
+        memcpy( &net,buf+1,4 );
+        h_publish_delta( c,buf[0],ntohl( net ),( const char * ) buf+5,len-5 );
+    } else {
+        h_search_all( c,( const char * ) buf+1 );
+    }
+    metrics_record( &self->metrics,buf[0],now_ns()-t0 );
+    c->st= ST_OP;
+    c->scan= 0;
+}
+
+// Runs every complete frame in buf[0..len) and returns how many bytes were consumed,
+// or -1 if the connection has to be dropped.
+long frames_consume ( struct conn *c,const unsigned char *buf,size_t len ) {
+    size_t off= 0;
+    while ( off<len ) {
+        long n= frame_parse( c,buf+off,len-off );
+        if ( n<0 ) {
+            return -1;
+        }
+        if ( n==0 ) {
+            break;
+        }
+        frame_dispatch( c,buf+off,n );
+        off += n;
+    }
+    return off;
+}
+
+// Lifts the soft descriptor limit to the hard limit so idle peers are not capped at 1024.
+void raise_fd_limit ( void ) {
+    struct rlimit rl;
+    if ( getrlimit( RLIMIT_NOFILE,&rl )==0 && rl.rlim_cur<rl.rlim_max ) {
+        rl.rlim_cur= rl.rlim_max;
+        setrlimit( RLIMIT_NOFILE,&rl );
+    }
+}
+
+void conn_close ( struct conn *c ) { // drops the connection and any peer registered on it
+    close( c->sd ); // closing also removes it from the epoll set
+    metric_inc( &self->metrics.closed );
+    if ( c->peer ) {
+        pthread_mutex_lock( &state_mu );
+        peer_remove( c->peer );
+        pthread_mutex_unlock( &state_mu );
+    }
+    buf_bytes -= c->rcap+c->wcap;
+    free( c->rbuf );
+    free( c->wbuf );
+    pool_put( &self->conn_pool,c );
+}
+
+void accept_all ( int listen_sd ) { // edge-triggered, so keep accepting until the backlog is empty
     while ( true ) {
-        readfds = master;
-        if ( select( fd_max+1,&readfds,NULL,NULL,NULL )<0 ) { //main loop using select()
-            perror( "select" );
+        int new_sd= accept4( listen_sd,NULL,NULL,SOCK_NONBLOCK | SOCK_CLOEXEC );
+        if ( new_sd<0 ) {
+            if ( errno==EINTR || errno==ECONNABORTED ) {
+                continue;
+            }
+            if ( errno!=EAGAIN && errno!=EWOULDBLOCK ) {
+                perror( "accept" );
+            }
+            return;
+        }
+        struct conn *c= pool_get( &self->conn_pool );
+        if ( !c ) {
+            close( new_sd );
+            continue;
+        }
+        memset( c,0,sizeof( *c ) );
+        c->sd= new_sd;
+        struct epoll_event ev= { .events= EPOLLIN | EPOLLRDHUP | EPOLLET,.data.ptr= c };
+        if ( epoll_ctl( self->ep_fd,EPOLL_CTL_ADD,new_sd,&ev )<0 ) {
+            perror( "epoll_ctl" );
+            close( new_sd );
+            pool_put( &self->conn_pool,c );
+            continue;
+        }
+        metric_inc( &self->metrics.accepted );
+    }
+}
+
+// Feeds freshly received bytes to the parser. Complete frames are handled straight out of
+// data; only the trailing partial frame is copied into the connection's own buffer.
+int conn_input ( struct conn *c,const unsigned char *data,size_t n ) {
+    if ( c->rlen==0 ) {
+        long used= frames_consume( c,data,n );
+        if ( used<0 ) {
+            return -1;
+        }
+        data += used;
+        n -= used;
+        if ( n==0 ) {
+            return 0;
+        }
+    }
+    if ( c->rlen+n>c->rcap ) {
+        size_t cap= c->rcap ? c->rcap : 256;
+        while ( cap<c->rlen+n ) {
+            cap *= 2;
+        }
+        unsigned char *nb= realloc( c->rbuf,cap );
+        if ( !nb ) {
+            return -1;
+        }
+        buf_bytes += cap-c->rcap;
+        c->rbuf= nb;
+        c->rcap= cap;
+    }
+    memcpy( c->rbuf+c->rlen,data,n );
+    bool fresh= c->rlen==0; // the bytes just stored were already run through the parser above
+    c->rlen += n;
+    if ( fresh ) {
+        return 0;
+    }
+    long used= frames_consume( c,c->rbuf,c->rlen );
+    if ( used<0 ) {
+        return -1;
+    }
+    c->rlen -= used;
+    memmove( c->rbuf,c->rbuf+used,c->rlen );
+    if ( c->rlen==0 && c->rcap>RBUF_KEEP ) { // a big PUBLISH went through, give the memory back
+        buf_bytes -= c->rcap;
+        free( c->rbuf );
+        c->rbuf= NULL;
+        c->rcap= 0;
+    }
+    return 0;
+}
+
+void conn_readable ( struct conn *c ) { // read everything that has arrived and run the complete frames
+    static _Thread_local unsigned char scratch[64*1024];
+    while ( true ) {
+        if ( c->wlen>WBUF_HIGH ) {
+            break; // client isn't reading its answers; resume once EPOLLOUT drains them
+        }
+        ssize_t n = recv( c->sd,scratch,sizeof( scratch ),0 );
+        if ( n<0 && errno==EINTR ) {
+            continue;
+        }
+        if ( n<0 && ( errno==EAGAIN || errno==EWOULDBLOCK ) ) {
+            break; // drained, wait for the next edge
+        }
+        if ( n>0 && conn_input( c,scratch,n )<0 ) { // sent garbage
+            metric_inc( &self->metrics.bad_frames );
+            n= 0;
+        }
+        if ( n <= 0 ) { // disconnected
+            conn_close( c );
+            return;
+        }
+        if ( c->dead ) {
+            break;
+        }
+    }
+    if ( c->dead ) {
+        conn_close( c );
+    }
+}
+
+void on_sigusr1 ( int sig ) {
+    want_stats= 1;
+}
+
+// Memory held on behalf of peers and connections; divided by the peer count this is what
+// sizing a registry host needs. The other workers' connection slabs are read unlocked,
+// which is close enough for a report.
+void print_stats ( void ) {
+    size_t names= 0, cat_bytes= 0, conn_bytes= buf_bytes;
+    for ( int i=0; i<1<<CAT_SHARD_BITS; i++ ) {
+        pthread_mutex_lock( &shards[i].mu );
+        names += shards[i].cat.cnt;
+        cat_bytes += shards[i].cat.bytes;
+        pthread_mutex_unlock( &shards[i].mu );
+    }
+    for ( int i=0; i<worker_cnt; i++ ) {
+        conn_bytes += workers[i].conn_pool.slab_bytes;
+    }
+    pthread_mutex_lock( &state_mu );
+    size_t peer_bytes= peer_cap*sizeof( *peers ) + peer_pool.slab_bytes + files_bytes;
+    uint32_t cnt= peer_cnt;
+    pthread_mutex_unlock( &state_mu );
+    size_t total= peer_bytes + conn_bytes + cat_bytes;
+    fprintf( stderr,"STATS peers %u names %zu peer_bytes %zu conn_bytes %zu catalog_bytes %zu bytes_per_peer %.1f\n",
+             cnt,names,peer_bytes,conn_bytes,cat_bytes,cnt ? ( double ) total/cnt : 0.0 );
+}
+
+size_t catalog_names ( void ) { // distinct names over all shards
+    size_t names= 0;
+    for ( int i=0; i<1<<CAT_SHARD_BITS; i++ ) {
+        names += shards[i].cat.cnt;
+    }
+    return names;
+}
+
+void on_sigterm ( int sig ) {
+    want_exit= 1;
+}
+
+void on_sigchld ( int sig ) {
+    snap_done= 1;
+}
+
+// Applies one logged event during replay, exactly as it was applied the first time.
+void replay_event ( void *arg,enum wal_op op,const unsigned char *data,size_t len ) {
+    struct snap_peer rec;
+    uint32_t slot_cnt[2];
+    if ( op==WAL_JOIN && len==sizeof( rec ) ) {
+        memcpy( &rec,data,sizeof( rec ) );
+        peer_add( rec.id,( struct in_addr ) { rec.ip },rec.port );
+        return;
+    }
+    if ( len<4 ) {
+        return;
+    }
+    memcpy( slot_cnt,data,4 );
+    if ( slot_cnt[0]>=peer_cnt ) {
+        return;
+    }
+    struct peer_entry *p= peers[slot_cnt[0]];
+    bool names_ok= len>=8 && ( len==8 || data[len-1]=='\0' );
+    if ( names_ok ) {
+        memcpy( slot_cnt,data,8 );
+    }
+    if ( op==WAL_PUBLISH && names_ok ) {
+        peer_publish( p,slot_cnt[1],( const char * ) data+8,len-8 );
+    } else if ( op==WAL_ADD && names_ok ) {
+        peer_add_files( p,slot_cnt[1],( const char * ) data+8,len-8 );
+    } else if ( op==WAL_DEL && names_ok ) {
+        peer_del_files( p,slot_cnt[1],( const char * ) data+8,len-8 );
+    } else if ( op==WAL_LEAVE ) {
+        peer_remove( p );
+    } else if ( op==WAL_ADDR && len==4+sizeof( rec ) ) {
+        memcpy( &rec,data+4,sizeof( rec ) );
+        p->ip.s_addr= rec.ip;
+        p->port= rec.port;
+    }
+}
+
+// Sets up the catalog shards for about hint names in all, with some slack since the names
+// never split exactly evenly.
+void catalog_setup ( size_t hint ) {
+    for ( int i=0; i<1<<CAT_SHARD_BITS; i++ ) {
+        pthread_mutex_init( &shards[i].mu,NULL );
+        if ( catalog_init( &shards[i].cat,( hint>>CAT_SHARD_BITS )+( hint>>( CAT_SHARD_BITS+3 ) ) )<0 ) {
+            perror( "catalog_init" );
+            exit( 1 );
+        }
+    }
+}
+
+// Rebuilds the peer table and catalog from dir: the snapshot, then the log after it.
+// Every peer comes back detached, waiting for its JOIN. Returns the log segment to
+// continue with, or exits if the state on disk cannot be read.
+uint64_t restore ( const char *dir ) {
+    struct timespec t0, t1;
+    clock_gettime( CLOCK_MONOTONIC,&t0 );
+    struct snap_view v;
+    int rc= snap_open( dir,&v );
+    if ( rc<0 ) {
+        fprintf( stderr,"%s/snapshot is damaged; move it away to start empty\n",dir );
+        exit( 1 );
+    }
+    catalog_setup( rc==0 ? v.file_cnt : 0 ); // sized up front, so restoring never rehashes
+    uint64_t seq= 0, records= 0;
+    if ( rc==0 ) {
+        struct snap_peer sp;
+        const char *names;
+        while ( ( rc= snap_next( &v,&sp,&names ) )==0 ) {
+            struct peer_entry *p= peer_add( sp.id,( struct in_addr ) { sp.ip },sp.port );
+            if ( p && sp.file_cnt>0 ) {
+                peer_publish( p,sp.file_cnt,names,sp.names_len );
+            }
+        }
+        seq= v.seq;
+        snap_close( &v );
+        if ( rc<0 ) {
+            fprintf( stderr,"%s/snapshot is damaged; move it away to start empty\n",dir );
+            exit( 1 );
+        }
+    }
+    seq= wal_replay( dir,seq,replay_event,NULL,&records );
+
+    if ( peer_cnt>0 ) {
+        uint32_t cap= 16;
+        while ( cap<peer_cnt*2 ) {
+            cap *= 2;
+        }
+        detached= calloc( cap,sizeof( *detached ) );
+        if ( !detached ) {
+            perror( "calloc" );
             exit( 1 );
         }
-        for ( int sd=0; sd<=fd_max; sd++ ) {
-            if ( !FD_ISSET( sd,&readfds ) ) {
+        detached_mask= cap-1;
+        for ( uint32_t i=0; i<peer_cnt; i++ ) {
+            struct peer_entry **head= &detached[( peers[i]->id*2654435761u ) & detached_mask];
+            peers[i]->detached= true;
+            peers[i]->next_detached= *head;
+            *head= peers[i];
+        }
+        detached_cnt= peer_cnt;
+        detached_until= time( NULL )+rejoin_grace;
+    }
+    clock_gettime( CLOCK_MONOTONIC,&t1 );
+    fprintf( stderr,"RESTORE peers %u names %zu log_records %llu ms %.1f\n",peer_cnt,catalog_names(),
+             ( unsigned long long ) records,( t1.tv_sec-t0.tv_sec )*1e3+( t1.tv_nsec-t0.tv_nsec )/1e6 );
+    return seq;
+}
+
+// Runs in the forked child: the parent's memory is a frozen copy of the registry, so the
+// peer table can be walked without locks while the parent keeps serving.
+int snapshot_write ( const char *dir,uint64_t seq ) {
+    FILE *f= snap_begin( dir );
+    if ( !f ) {
+        return -1;
+    }
+    uint64_t files= 0;
+    for ( uint32_t i=0; i<peer_cnt; i++ ) {
+        struct peer_entry *p= peers[i];
+        struct snap_peer sp= { .id= p->id,.ip= p->ip.s_addr,.port= p->port,.file_cnt= p->file_cnt };
+        for ( uint32_t j=0; j<p->file_cnt; j++ ) {
+            sp.names_len += p->files[j].name->len+1;
+        }
+        if ( snap_put_peer( f,&sp )<0 ) {
+            fclose( f );
+            return -1;
+        }
+        for ( uint32_t j=0; j<p->file_cnt; j++ ) {
+            if ( snap_put_name( f,p->files[j].name->str,p->files[j].name->len )<0 ) {
+                fclose( f );
+                return -1;
+            }
+        }
+        files += p->file_cnt;
+    }
+    return snap_commit( f,dir,seq,peer_cnt,files );
+}
+
+// Starts a new log segment and forks a child to snapshot everything before it. Once the
+// child succeeds the older segments are deleted.
+void snapshot_start ( void ) {
+    if ( snap_pid>0 ) {
+        return; // one at a time
+    }
+    if ( wal_rotate( &wal )<0 ) {
+        perror( "Rotating the event log failed" );
+        return;
+    }
+    wal.bytes= 0;
+    pid_t pid= fork();
+    if ( pid==0 ) {
+        _exit( snapshot_write( wal.dir,wal.seq )<0 ? 1 : 0 );
+    }
+    if ( pid<0 ) {
+        perror( "fork" );
+        return;
+    }
+    snap_pid= pid;
+    snap_seq= wal.seq;
+}
+
+void snapshot_reap ( void ) {
+    int status;
+    snap_done= 0;
+    if ( snap_pid>0 && waitpid( snap_pid,&status,WNOHANG )==snap_pid ) {
+        snap_pid= 0;
+        if ( WIFEXITED( status ) && WEXITSTATUS( status )==0 ) {
+            wal_prune( wal.dir,snap_seq );
+        } else {
+            fprintf( stderr,"Writing the snapshot failed, keeping the event log\n" );
+        }
+    }
+}
+
+// Drops the restored peers that did not JOIN again within the grace period.
+void detached_expire ( void ) {
+    uint32_t dropped= 0;
+    for ( uint32_t i=peer_cnt; i-->0; ) { // backwards, so the peer moved into slot i was already seen
+        if ( peers[i]->detached ) {
+            peer_remove( peers[i] );
+            dropped++;
+        }
+    }
+    fprintf( stderr,"EXPIRE %u restored peers did not re-join\n",dropped );
+}
+
+// Flushes what this thread's wakeup logged; every thread commits its own group, so a reply
+// is never followed by a wait on another thread's clients. Starts a snapshot once the log
+// has grown enough.
+void log_commit ( void ) {
+    logged= false;
+    pthread_mutex_lock( &state_mu );
+    if ( wal.fd>=0 && wal.len>0 && wal_flush( &wal )<0 ) {
+        perror( "Writing the event log failed, no longer logging" );
+        close( wal.fd );
+        wal.fd= -1;
+    }
+    if ( wal.fd>=0 && wal.bytes>=SNAP_LOG_BYTES ) {
+        snapshot_start();
+    }
+    pthread_mutex_unlock( &state_mu );
+}
+
+// Per-process chores, done by worker 0, which is also the only thread signals go to.
+// Returns the epoll timeout: once a second while restored peers wait out their grace period.
+int housekeeping ( void ) {
+    if ( atomic_exchange( &want_stats,0 ) ) {
+        print_stats();
+    }
+    pthread_mutex_lock( &state_mu );
+    if ( want_exit ) { // the event log is already on disk; only the text log can be behind
+        evlog_stop();
+        exit( 0 );
+    }
+    if ( snap_done ) {
+        snapshot_reap();
+    }
+    if ( detached_cnt>0 && loop_now>=detached_until ) {
+        detached_expire();
+    }
+    int timeout= detached_cnt>0 ? 1000 : -1;
+    pthread_mutex_unlock( &state_mu );
+    return timeout;
+}
+
+// One event loop: accepts on the worker's own listener and serves those connections.
+void *worker_run ( void *arg ) {
+    self= arg;
+    rand_seed= self->id+1;
+    if ( evlog_thread()<0 ) {
+        fprintf( stderr,"Worker %d has no log ring, its events go unlogged\n",self->id );
+    }
+    loop_now= time( NULL );
+    int timeout= self->id==0 ? housekeeping() : -1;
+    struct epoll_event evs[MAX_EVENTS];
+    while ( true ) {
+        // main loop, only ready sockets come back
+        int n= epoll_pwait( self->ep_fd,evs,MAX_EVENTS,timeout,self->id==0 ? &wait_sigs : NULL );
+        loop_now= time( NULL );
+        if ( self->id==0 ) {
+            timeout= housekeeping();
+        }
+        if ( n<0 ) {
+            if ( errno==EINTR ) {
                 continue;
             }
-            if ( sd==listen_sd ) { // New connection
-                struct sockaddr_in cli;
-                socklen_t clen= sizeof( cli );
-                int new_sd= accept( listen_sd,( struct sockaddr * ) &cli,&clen );
-                if ( new_sd<0 ) {
-                    continue;
-                }
-                FD_SET( new_sd,&master );
-                if ( new_sd >fd_max ) {
-                    fd_max =new_sd;
-                }
+            perror( "epoll_wait" );
+            exit( 1 );
+        }
+        for ( int i=0; i<n; i++ ) {
+            struct conn *c= evs[i].data.ptr;
+            if ( c==&self->listen_conn ) { // New connection(s)
+                accept_all( self->listen_sd );
+            } else if ( evs[i].events & EPOLLERR ) {
+                conn_close( c );
             } else {
-                unsigned char op; // Existing peer sent data
-                int n = recv( sd,&op,1,0 );
-                if ( n <= 0 ) { // disconnected
-                    close( sd );
-                    FD_CLR( sd,&master );
-                    for ( int i=0; i<peer_cnt; i++ ) {
-                        if ( peers[i].sock==sd ) {
-                            peers[i] =peers[--peer_cnt];
-                            break;
-                        }
-                    }
-                    continue;
-                }
-                if ( op==join ) {
-                    h_join( sd ); //handles join request
-                } else if ( op==pub ) {
-                    h_publish( sd );  //handles publish request
-                } else if ( op==search ) {
-                    h_search( sd ); //handles search request
-                } else {
-                    close( sd );
-                    FD_CLR( sd,&master );
+                if ( evs[i].events & EPOLLOUT ) {
+                    conn_flush( c );
                 }
+                // Existing peer sent data (or hung up, which recv reports as 0). Also runs after
+                // a flush, since input left unread under backpressure won't raise a new edge.
+                conn_readable( c );
             }
         }
+        // Group commit: everything this wakeup changed goes to the log in one write
+        if ( logged ) {
+            log_commit();
+        }
+    }
+    return NULL;
+}
+
+int main ( int argc,char *argv[] ) {
+    int opt;
+    const char *state_dir= NULL;
+    bool sync_log= false;
+    int log_level= LOG_QUERIES, log_sample= 1;
+    long ncpu= sysconf( _SC_NPROCESSORS_ONLN );
+    worker_cnt= ncpu>0 && ncpu<MAX_THREADS ? ncpu : 1;
+    while ( ( opt= getopt( argc,argv,"s:d:Fg:t:l:S:" ) ) != -1 ) {
+        if ( opt=='s' && strcmp( optarg,"rr" )==0 ) {
+            pick= PICK_RR;
+        } else if ( opt=='s' && strcmp( optarg,"least" )==0 ) {
+            pick= PICK_LEAST;
+        } else if ( opt=='d' ) {
+            state_dir= optarg;
+        } else if ( opt=='F' ) {
+            sync_log= true;
+        } else if ( opt=='g' && atoi( optarg )>=0 ) {
+            rejoin_grace= atoi( optarg );
+        } else if ( opt=='t' && atoi( optarg )>=1 && atoi( optarg )<=MAX_THREADS ) {
+            worker_cnt= atoi( optarg );
+        } else if ( opt=='l' && atoi( optarg )>=LOG_OFF && atoi( optarg )<=LOG_QUERIES ) {
+            log_level= atoi( optarg );
+        } else if ( opt=='S' && atoi( optarg )>=1 ) {
+            log_sample= atoi( optarg );
+        } else {
+            optind= argc; // fall through to the usage message
+            break;
+        }
+    }
+    if ( argc-optind != 1 ) {
+        fprintf( stderr,"Usage: %s [-t threads] [-s rr|least] [-l log level 0-2] [-S log 1 in n searches] "
+                 "[-d state dir [-F] [-g rejoin grace seconds]] <port>\n",argv[0] );
+        exit( 1 );
+    }
+    raise_fd_limit();
+    pool_init( &peer_pool,sizeof( struct peer_entry ) );
+    loop_now= time( NULL );
+    if ( state_dir ) { // bring back the peers and files from before the restart, then log from there
+        if ( mkdir( state_dir,0755 )<0 && errno != EEXIST ) {
+            perror( state_dir );
+            exit( 1 );
+        }
+        uint64_t seq= restore( state_dir );
+        if ( wal_open( &wal,state_dir,seq,sync_log )<0 ) {
+            perror( "Opening the event log failed" );
+            exit( 1 );
+        }
+    } else {
+        catalog_setup( 0 );
+    }
+    struct sigaction sa= { .sa_handler= on_sigusr1 }; // no SA_RESTART, so epoll_wait wakes up
+    sigaction( SIGUSR1,&sa,NULL );
+    sa.sa_handler= on_sigchld;
+    sigaction( SIGCHLD,&sa,NULL );
+    sa.sa_handler= on_sigterm;
+    sigaction( SIGTERM,&sa,NULL );
+    sigaction( SIGINT,&sa,NULL );
+    if ( wal.fd>=0 && ( peer_cnt>0 || wal.seq>0 ) ) {
+        snapshot_start(); // fold the replayed log into a fresh snapshot
+    }
+
+    workers= calloc( worker_cnt,sizeof( *workers ) );
+    if ( !workers ) {
+        perror( "calloc" );
+        exit( 1 );
+    }
+    for ( int i=0; i<worker_cnt; i++ ) { // all listeners exist before any thread accepts
+        struct worker *w= &workers[i];
+        w->id= i;
+        w->listen_sd= m_listener( argv[optind] );
+        fcntl( w->listen_sd,F_SETFL,fcntl( w->listen_sd,F_GETFL )|O_NONBLOCK );
+        pool_init( &w->conn_pool,sizeof( struct conn ) );
+        w->ep_fd= epoll_create1( EPOLL_CLOEXEC );
+        if ( w->ep_fd<0 ) {
+            perror( "epoll_create1" );
+            exit( 1 );
+        }
+        w->listen_conn.sd= w->listen_sd;
+        struct epoll_event lev= { .events= EPOLLIN | EPOLLET,.data.ptr= &w->listen_conn };
+        if ( epoll_ctl( w->ep_fd,EPOLL_CTL_ADD,w->listen_sd,&lev )<0 ) {
+            perror( "epoll_ctl" );
+            exit( 1 );
+        }
+    }
+
+    // The signals stay blocked everywhere except in worker 0's epoll_pwait
+    sigset_t sigs;
+    sigemptyset( &sigs );
+    sigaddset( &sigs,SIGUSR1 );
+    sigaddset( &sigs,SIGCHLD );
+    sigaddset( &sigs,SIGTERM );
+    sigaddset( &sigs,SIGINT );
+    pthread_sigmask( SIG_BLOCK,&sigs,&wait_sigs );
+    if ( evlog_start( STDOUT_FILENO,log_level,log_sample )<0 ) {
+        perror( "Starting the log thread failed" );
+        exit( 1 );
+    }
+    for ( int i=1; i<worker_cnt; i++ ) {
+        if ( pthread_create( &workers[i].thread,NULL,worker_run,&workers[i] ) != 0 ) {
+            fprintf( stderr,"Could not start worker thread %d\n",i );
+            exit( 1 );
+        }
     }
+    worker_run( &workers[0] );
     return 0;
 }
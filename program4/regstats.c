@@ -0,0 +1,49 @@
+// Prints a running registry's metrics: sends STATS and writes the Prometheus text it gets
+// back to stdout, e.g. for node_exporter's textfile collector or a quick look at p99.
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+
+int main ( int argc,char *argv[] ) {
+    if ( argc != 3 ) {
+        fprintf( stderr,"Usage: %s <host> <port>\n",argv[0] );
+        exit( 1 );
+    }
+    struct addrinfo hints= { 0 }, *res;
+    hints.ai_family= AF_INET;
+    hints.ai_socktype= SOCK_STREAM;
+    int rc= getaddrinfo( argv[1],argv[2],&hints,&res );
+    if ( rc != 0 ) {
+        fprintf( stderr,"getaddrinfo: %s\n",gai_strerror( rc ) );
+        exit( 1 );
+    }
+    int s= socket( res->ai_family,res->ai_socktype,res->ai_protocol );
+    if ( s<0 || connect( s,res->ai_addr,res->ai_addrlen )<0 ) {
+        perror( "connect" );
+        exit( 1 );
+    }
+    freeaddrinfo( res );
+
+    unsigned char req= 0x07;
+    uint32_t len_n;
+    if ( send( s,&req,1,0 ) != 1 || recv( s,&len_n,4,MSG_WAITALL ) != 4 ) {
+        perror( "STATS" );
+        exit( 1 );
+    }
+    uint32_t len= ntohl( len_n );
+    char *text= malloc( len+1 ); // +1: an empty reply still gets a buffer
+    if ( !text || ( len>0 && recv( s,text,len,MSG_WAITALL ) != ( ssize_t ) len ) ) {
+        perror( "STATS" );
+        exit( 1 );
+    }
+    fwrite( text,1,len,stdout );
+    free( text );
+    close( s );
+    return 0;
+}